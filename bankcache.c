@@ -0,0 +1,324 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bankcache.h"
+#include "gabor.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Compiled filter spectra on disk, so a new process doesn't rebuild the bank.
+// Files are mapped read-only and shared, so every worker on a node uses the
+// same physical pages. Layout, all offsets from the start of the file:
+//
+//   cache_header_s
+//   freqs, angles, sigmas      num_filters doubles each, to rule out hash collisions
+//   cache_entry_s              one per filter
+//   spans and values           each block starting on a CACHE_ALIGN boundary
+
+#define CACHE_MAGIC "GABORBK1"
+#define CACHE_VERSION 1
+#define CACHE_ALIGN 64
+
+struct cache_header_s{
+    char magic[8];
+    uint64_t hash;
+    uint32_t version;
+    uint32_t real_size;
+    uint32_t height;
+    uint32_t width;
+    uint32_t num_filters;
+    uint32_t reserved;
+    double spectrum_threshold;
+};
+
+struct cache_entry_s{
+    uint64_t spans_offset;
+    uint64_t vals_offset;
+    uint32_t num_spans;
+    uint32_t num_vals;
+    struct subband_s subband;
+};
+
+
+// FNV-1a, stable across runs and machines of the same endianness
+static uint64_t hash_bytes(uint64_t hash, const void* data, const size_t size){
+
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+
+}
+
+
+
+// Everything the compiled spectra depend on, including the build's precision
+unsigned long long hash_gabor_filter_bank(const struct gabor_filter_bank_s bank){
+
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t dims[4] = {bank.height, bank.width, bank.num_filters, sizeof(real_t)};
+
+    hash = hash_bytes(hash, dims, sizeof(dims));
+    hash = hash_bytes(hash, &bank.spectrum_threshold, sizeof(bank.spectrum_threshold));
+    hash = hash_bytes(hash, bank.freqs, bank.num_filters*sizeof(double));
+    hash = hash_bytes(hash, bank.angles, bank.num_filters*sizeof(double));
+    hash = hash_bytes(hash, bank.sigmas, bank.num_filters*sizeof(double));
+
+    return hash;
+
+}
+
+
+
+static void cache_path(const struct gabor_filter_bank_s bank, const char* const cache_dir, char* path, const size_t size){
+
+    snprintf(path, size, "%s/gabor_bank_%016llx.cache", cache_dir, hash_gabor_filter_bank(bank));
+
+}
+
+
+
+static uint64_t align_offset(const uint64_t offset){
+
+    return (offset + CACHE_ALIGN - 1)/CACHE_ALIGN*CACHE_ALIGN;
+
+}
+
+
+
+
+
+
+// Point the bank's spectra into a mapped cache file, if there is one for it.
+// Returns the bank unchanged (spectra still NULL) when there is no usable cache.
+struct gabor_filter_bank_s load_gabor_filter_bank_cache(struct gabor_filter_bank_s bank, const char* const cache_dir){
+
+    char path[1024];
+    cache_path(bank, cache_dir, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return bank;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(struct cache_header_s)){
+        close(fd);
+        return bank;
+    }
+
+    size_t size = info.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return bank;
+    }
+
+    const char* base = (const char*)map;
+    const struct cache_header_s* header = (const struct cache_header_s*)base;
+
+    // Make sure it really is this bank, in this precision
+    size_t params_size = 3*bank.num_filters*sizeof(double);
+    size_t table_end = sizeof(struct cache_header_s) + params_size + bank.num_filters*sizeof(struct cache_entry_s);
+    const double* params = (const double*)(base + sizeof(struct cache_header_s));
+
+    if (memcmp(header->magic, CACHE_MAGIC, 8) != 0 || header->version != CACHE_VERSION ||
+        header->hash != hash_gabor_filter_bank(bank) || header->real_size != sizeof(real_t) ||
+        header->height != bank.height || header->width != bank.width || header->num_filters != bank.num_filters ||
+        header->spectrum_threshold != bank.spectrum_threshold || size < table_end ||
+        memcmp(params, bank.freqs, bank.num_filters*sizeof(double)) != 0 ||
+        memcmp(params + bank.num_filters, bank.angles, bank.num_filters*sizeof(double)) != 0 ||
+        memcmp(params + 2*bank.num_filters, bank.sigmas, bank.num_filters*sizeof(double)) != 0){
+
+        fprintf(stderr, "Ignoring stale filter bank cache %s\n", path);
+        munmap(map, size);
+        return bank;
+
+    }
+
+    const struct cache_entry_s* entries = (const struct cache_entry_s*)(base + sizeof(struct cache_header_s) + params_size);
+
+    // The per-filter headers are copied, the spans and values stay in the mapping
+    bank.spectra = (struct sparse_spectrum_s*)malloc(bank.num_filters*sizeof(struct sparse_spectrum_s));
+    if (bank.spectra == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    bank.subbands = (struct subband_s*)malloc(bank.num_filters*sizeof(struct subband_s));
+    if (bank.subbands == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+
+        struct cache_entry_s entry = entries[i];
+
+        if (entry.spans_offset + entry.num_spans*sizeof(struct spectrum_span_s) > size ||
+            entry.vals_offset + entry.num_vals*sizeof(complex_t) > size){
+            fprintf(stderr, "Ignoring truncated filter bank cache %s\n", path);
+            free(bank.spectra);
+            free(bank.subbands);
+            bank.spectra = NULL;
+            bank.subbands = NULL;
+            munmap(map, size);
+            return bank;
+        }
+
+        bank.spectra[i].height = bank.height;
+        bank.spectra[i].width = bank.width;
+        bank.spectra[i].num_spans = entry.num_spans;
+        bank.spectra[i].num_vals = entry.num_vals;
+        bank.spectra[i].spans = (struct spectrum_span_s*)(base + entry.spans_offset);
+        bank.spectra[i].vals = (complex_t*)(base + entry.vals_offset);
+        bank.subbands[i] = entry.subband;
+
+    }
+
+    bank.cache_map = map;
+    bank.cache_size = size;
+
+    return bank;
+
+}
+
+
+
+
+
+
+// Write a compiled bank out for later runs. The file is renamed into place
+// once complete, so a process loading it never sees half of one.
+int save_gabor_filter_bank_cache(const struct gabor_filter_bank_s bank, const char* const cache_dir){
+
+    if (bank.spectra == NULL){
+        return 0;
+    }
+
+    char path[1024];
+    char temp_path[1040];
+    cache_path(bank, cache_dir, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld", path, (long)getpid());
+
+    struct cache_header_s header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.hash = hash_gabor_filter_bank(bank);
+    header.version = CACHE_VERSION;
+    header.real_size = sizeof(real_t);
+    header.height = bank.height;
+    header.width = bank.width;
+    header.num_filters = bank.num_filters;
+    header.spectrum_threshold = bank.spectrum_threshold;
+
+    struct cache_entry_s* entries = (struct cache_entry_s*)calloc(bank.num_filters, sizeof(struct cache_entry_s));
+    if (entries == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Lay the data blocks out after the table
+    uint64_t offset = sizeof(struct cache_header_s) + 3*bank.num_filters*sizeof(double) + bank.num_filters*sizeof(struct cache_entry_s);
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+
+        entries[i].num_spans = bank.spectra[i].num_spans;
+        entries[i].num_vals = bank.spectra[i].num_vals;
+        entries[i].subband = bank.subbands[i];
+
+        offset = align_offset(offset);
+        entries[i].spans_offset = offset;
+        offset += bank.spectra[i].num_spans*sizeof(struct spectrum_span_s);
+
+        offset = align_offset(offset);
+        entries[i].vals_offset = offset;
+        offset += bank.spectra[i].num_vals*sizeof(complex_t);
+
+    }
+
+    FILE* fid = fopen(temp_path, "wb");
+    if (fid == NULL){
+        fprintf(stderr, "Could not write filter bank cache %s\n", temp_path);
+        free(entries);
+        return 0;
+    }
+
+    static const char zeros[CACHE_ALIGN] = {0};
+    int ok = 1;
+
+    ok &= fwrite(&header, sizeof(header), 1, fid) == 1;
+    ok &= fwrite(bank.freqs, sizeof(double), bank.num_filters, fid) == bank.num_filters;
+    ok &= fwrite(bank.angles, sizeof(double), bank.num_filters, fid) == bank.num_filters;
+    ok &= fwrite(bank.sigmas, sizeof(double), bank.num_filters, fid) == bank.num_filters;
+    ok &= fwrite(entries, sizeof(struct cache_entry_s), bank.num_filters, fid) == bank.num_filters;
+
+    for (unsigned int i = 0; i < bank.num_filters && ok; i++){
+
+        struct sparse_spectrum_s spec = bank.spectra[i];
+
+        long pos = ftell(fid);
+        ok &= fwrite(zeros, 1, entries[i].spans_offset - pos, fid) == entries[i].spans_offset - pos;
+        ok &= fwrite(spec.spans, sizeof(struct spectrum_span_s), spec.num_spans, fid) == spec.num_spans;
+
+        pos = ftell(fid);
+        ok &= fwrite(zeros, 1, entries[i].vals_offset - pos, fid) == entries[i].vals_offset - pos;
+        ok &= fwrite(spec.vals, sizeof(complex_t), spec.num_vals, fid) == spec.num_vals;
+
+    }
+
+    ok &= fclose(fid) == 0;
+    free(entries);
+
+    if (!ok || rename(temp_path, path) != 0){
+        fprintf(stderr, "Could not write filter bank cache %s\n", path);
+        remove(temp_path);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+
+
+
+
+
+// compile_gabor_filter_bank(), but reusing the spectra from cache_dir when they are there
+// and leaving them there for next time when they aren't
+struct gabor_filter_bank_s compile_gabor_filter_bank_cached(struct gabor_filter_bank_s bank, const unsigned int num_threads, const char* const cache_dir){
+
+    if (bank.spectra == NULL){
+        bank = load_gabor_filter_bank_cache(bank, cache_dir);
+    }
+
+    if (bank.spectra == NULL){
+        bank = compile_gabor_filter_bank(bank, num_threads);
+        save_gabor_filter_bank_cache(bank, cache_dir);
+    }
+    else if (num_threads > 1 && bank.pool == NULL){
+        bank.pool = init_thread_pool(num_threads);
+    }
+
+    return bank;
+
+}
+
+
+
+void unmap_gabor_filter_bank_cache(struct gabor_filter_bank_s bank){
+
+    if (bank.cache_map != NULL){
+        munmap(bank.cache_map, bank.cache_size);
+    }
+
+}
@@ -0,0 +1,18 @@
+#ifndef bankcache_h
+#define bankcache_h
+
+#include "types.h"
+
+#define DEFAULT_BANK_CACHE_DIR "."
+
+unsigned long long hash_gabor_filter_bank(const struct gabor_filter_bank_s bank);
+
+struct gabor_filter_bank_s load_gabor_filter_bank_cache(struct gabor_filter_bank_s bank, const char* const cache_dir);
+
+int save_gabor_filter_bank_cache(const struct gabor_filter_bank_s bank, const char* const cache_dir);
+
+struct gabor_filter_bank_s compile_gabor_filter_bank_cached(struct gabor_filter_bank_s bank, const unsigned int num_threads, const char* const cache_dir);
+
+void unmap_gabor_filter_bank_cache(struct gabor_filter_bank_s bank);
+
+#endif
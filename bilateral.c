@@ -1,12 +1,28 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
 
 #include "bilateral.h"
 #include "types.h"
 #include "image.h"
+#include "threadpool.h"
+#include "kernels.h"
 
-void bilateral_filter(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range){
+// Grid cells per sigma, along the image axes and along the range
+#define BILATERAL_GRID_SAMPLING 1
+
+// Empty cells around the data, so the blur never needs to look past the ends of the grid.
+// Also the radius of the blur.
+#define BILATERAL_GRID_PAD (2*BILATERAL_GRID_SAMPLING)
+
+
+// Brute force, every pixel within 3 sigma_spatial of each output pixel.
+// Pixels past the edges of the image take no part, the weights are normalized over those inside.
+// Slow, but exact: the reference bilateral_filter() is checked against.
+void bilateral_filter_reference(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range){
 
     // Compute the filter size
     unsigned int filt_height = 6*sigma_spatial+1;
@@ -17,29 +33,28 @@ void bilateral_filter(struct image_s img_in, struct image_s img_out, double sigm
 
     // iterate over each image pixel
     for (int i = 0; i < img_in.height; i++){
-        printf("%d\n", i);
         for (int j = 0; j < img_in.width; j++){
 
             // Normalization term for the filter
             double filt_weight = 0;
+            complex_t sum = 0;
 
             // Iterate over each filter pixel
             for (int m = 0; m < filt_height; m++){
                 for (int n = 0; n < filt_width; n++){
 
-                    // Image pixel "under" filter pixel (can be outside image size!)
-                    int img_y = ((m - center_y) + i) % img_in.height;
-                    int img_x = ((n - center_x) + j) % img_in.width;
+                    // Image pixel "under" filter pixel, skipped if it is outside the image
+                    int img_y = (m - center_y) + i;
+                    int img_x = (n - center_x) + j;
+                    if (img_y < 0 || img_y >= (int)img_in.height || img_x < 0 || img_x >= (int)img_in.width){
+                        continue;
+                    }
 
                     // Compute the spatial difference (euclidian distance)
                     double spatial_diff = sqrt(pow((img_x - j),2) + pow((img_y - i),2));
 
-                    // "wrap" pixel values into the image size
-                    img_x %= img_in.width;
-                    img_y %= img_in.height;
-
                     // Compute the range difference (digital count difference)
-                    double range_diff = cabs(img_in.vals[img_y][img_x]) - cabs(img_in.vals[i][j]);
+                    double range_diff = CABS(img_in.vals[img_y][img_x]) - CABS(img_in.vals[i][j]);
 
                     // Compute the multiplication of both gaussians
                     double filt_val = exp(-1.0 * pow(spatial_diff,2) / (2*pow(sigma_spatial, 2))) * exp(-1.0 * pow(range_diff,2) / (2*pow(sigma_range, 2)));
@@ -48,15 +63,384 @@ void bilateral_filter(struct image_s img_in, struct image_s img_out, double sigm
                     filt_weight += filt_val;
 
                     // Convolve
-                    img_out.vals[i][j] += img_in.vals[img_y][img_x] * filt_val;
+                    sum += img_in.vals[img_y][img_x] * (real_t)filt_val;
 
                 }
             }
 
             // Normalize by the filter sum
-            img_out.vals[i][j] /= filt_weight;
+            img_out.vals[i][j] = sum / (real_t)filt_weight;
+
+        }
+    }
+
+}
+
+
+
+// Arguments for the row bands of bilateral_filter_exact(). The image is split into planes
+// of real parts, imaginary parts and magnitudes so whole rows go through the vector kernels.
+struct bilateral_exact_s{
+    const real_t* in_re;
+    const real_t* in_im;
+    const real_t* mag;
+    const real_t* spatial;      // Spatial weight of each tap, filt_height rows of filt_width
+    unsigned int filt_height;
+    unsigned int filt_width;
+    real_t range_scale;         // 1/(2 sigma_range^2)
+    struct image_s img_out;
+};
+
+
+// Over a band of output rows, each tap added to a whole row at once. Clipping the row to the
+// pixels whose neighbour is inside the image takes the place of the reference's bounds check, and
+// the taps go in the same order, so every pixel sums the same terms the same way.
+static void bilateral_exact_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct bilateral_exact_s* op = (struct bilateral_exact_s*)arg;
+
+    const int height = (int)op->img_out.height;
+    const int width = (int)op->img_out.width;
+    const int center_y = op->filt_height/2;
+    const int center_x = op->filt_width/2;
+
+    real_t* sums = (real_t*)malloc(3*(size_t)width*sizeof(real_t));
+    if (sums == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    real_t* sum_re = sums;
+    real_t* sum_im = sums + width;
+    real_t* weight = sums + 2*width;
+
+    for (int i = begin; i < (int)end; i++){
+
+        memset(sums, 0, 3*(size_t)width*sizeof(real_t));
+        const real_t* center_mag = op->mag + (size_t)i*width;
+
+        for (int m = 0; m < (int)op->filt_height; m++){
+
+            int img_y = (m - center_y) + i;
+            if (img_y < 0 || img_y >= height){
+                continue;
+            }
+            size_t row = (size_t)img_y*width;
+
+            for (int n = 0; n < (int)op->filt_width; n++){
+
+                // Output pixels [first, last) have this tap inside the image
+                int dx = n - center_x;
+                int first = (dx < 0) ? -dx : 0;
+                int last = (dx > 0) ? width - dx : width;
+                if (last <= first){
+                    continue;
+                }
+
+                bilateral_accumulate(sum_re + first, sum_im + first, weight + first,
+                                     op->in_re + row + first + dx, op->in_im + row + first + dx, op->mag + row + first + dx,
+                                     center_mag + first, op->spatial[m*op->filt_width + n], op->range_scale, last - first);
+
+            }
+        }
+
+        for (int j = 0; j < width; j++){
+            real_t* out = (real_t*)&op->img_out.vals[i][j];
+            out[0] = sum_re[j]/weight[j];
+            out[1] = sum_im[j]/weight[j];
+        }
+
+    }
+
+    free(sums);
+}
+
+
+
+// The brute force filter made fast without changing what it computes: the spatial kernel is
+// tabulated once, rows are clipped instead of checking every tap against the edges, the range
+// weights are worked out for a row of pixels at a time by the vector kernels, and bands of rows
+// run in parallel. Matches bilateral_filter_reference() to within rounding, far under 1e-6 in
+// double precision. img_out must not be img_in.
+void bilateral_filter_exact(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range){
+
+    struct bilateral_exact_s op;
+
+    // Same size and center as the reference
+    op.filt_height = 6*sigma_spatial+1;
+    op.filt_width = 6*sigma_spatial+1;
+    int center_x = op.filt_width/2;
+    int center_y = op.filt_height/2;
+
+    size_t num_pixels = (size_t)img_in.height*img_in.width;
+    real_t* spatial = (real_t*)malloc((size_t)op.filt_height*op.filt_width*sizeof(real_t));
+    real_t* planes = (real_t*)malloc(3*num_pixels*sizeof(real_t));
+    if (spatial == NULL || planes == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The spatial weights exactly as the reference computes them
+    for (int m = 0; m < (int)op.filt_height; m++){
+        for (int n = 0; n < (int)op.filt_width; n++){
+            double spatial_diff = sqrt(pow((n - center_x),2) + pow((m - center_y),2));
+            spatial[m*op.filt_width + n] = (real_t)exp(-1.0 * pow(spatial_diff,2) / (2*pow(sigma_spatial, 2)));
+        }
+    }
+
+    real_t* in_re = planes;
+    real_t* in_im = planes + num_pixels;
+    real_t* mag = planes + 2*num_pixels;
+    for (unsigned int i = 0; i < img_in.height; i++){
+        for (unsigned int j = 0; j < img_in.width; j++){
+            size_t k = (size_t)i*img_in.width + j;
+            in_re[k] = CREAL(img_in.vals[i][j]);
+            in_im[k] = CIMAG(img_in.vals[i][j]);
+            mag[k] = CABS(img_in.vals[i][j]);
+        }
+    }
+
+    op.in_re = in_re;
+    op.in_im = in_im;
+    op.mag = mag;
+    op.spatial = spatial;
+    op.range_scale = (real_t)(1/(2*pow(sigma_range, 2)));
+    op.img_out = img_out;
+
+    parallel_for_rows(img_in.height, img_in.width*op.filt_height*op.filt_width, bilateral_exact_rows, &op);
+
+    free(spatial);
+    free(planes);
+
+}
+
+
+
+// Bilateral grid (Paris and Durand, Chen et al.): the image is splatted into a coarse 3D grid over
+// position and range, about sigma apart on each axis, blurred there with a small separable Gaussian,
+// and read back by trilinear interpolation at each pixel's position and range. Values and
+// weights go through the grid side by side and are divided at the end, which normalizes the
+// kernel, pixels past the edges just never add anything.
+struct bilateral_grid_s{
+    complex_t* vals;
+    real_t* weights;
+    unsigned int depth;         // Cells along the range
+    unsigned int height;
+    unsigned int width;
+    double spatial_step;        // Pixels per cell
+    double range_step;          // Range per cell
+    double range_min;
+};
+
+
+// Arguments for the loop bodies below, which parallel_for() splits into bands
+struct bilateral_op_s{
+    struct bilateral_grid_s* grid;
+    struct image_s img_in;
+    struct image_s img_out;
+    unsigned int axis;          // Blur along x (0), y (1) or the range (2)
+};
+
+
+// Where a pixel lands in the grid, in cells, and the cell below it
+static void grid_position(const struct bilateral_grid_s* grid, const double y, const double x, const double r, unsigned int cell[3], double frac[3]){
+
+    double pos[3];
+    pos[0] = (r - grid->range_min)/grid->range_step + BILATERAL_GRID_PAD;
+    pos[1] = y/grid->spatial_step + BILATERAL_GRID_PAD;
+    pos[2] = x/grid->spatial_step + BILATERAL_GRID_PAD;
+
+    for (int a = 0; a < 3; a++){
+        cell[a] = (unsigned int)pos[a];
+        frac[a] = pos[a] - cell[a];
+    }
+
+}
+
+
+// Add every pixel to the eight cells around it, weighted by how close it is to each
+static void splat_grid(struct bilateral_grid_s* grid, const struct image_s img){
+
+    size_t plane = (size_t)grid->height*grid->width;
+
+    for (unsigned int i = 0; i < img.height; i++){
+        for (unsigned int j = 0; j < img.width; j++){
+
+            unsigned int cell[3];
+            double frac[3];
+            grid_position(grid, i, j, CABS(img.vals[i][j]), cell, frac);
+
+            for (unsigned int c = 0; c < 8; c++){
+                unsigned int dz = c >> 2, dy = (c >> 1) & 1, dx = c & 1;
+                double w = (dz ? frac[0] : 1 - frac[0])*(dy ? frac[1] : 1 - frac[1])*(dx ? frac[2] : 1 - frac[2]);
+                size_t k = (cell[0] + dz)*plane + (size_t)(cell[1] + dy)*grid->width + cell[2] + dx;
+                grid->vals[k] += img.vals[i][j]*(real_t)w;
+                grid->weights[k] += (real_t)w;
+            }
+
+        }
+    }
+
+}
+
 
+// Over lines of the grid along op->axis, a Gaussian a little under a sigma wide. Lines are zero past their ends.
+static void blur_grid_lines(void* arg, const unsigned int begin, const unsigned int end){
+    struct bilateral_op_s* op = (struct bilateral_op_s*)arg;
+    struct bilateral_grid_s* grid = op->grid;
+
+    // Splatting and slicing each spread a pixel over two cells, which adds a third of a cell squared to the
+    // variance, the blur makes up the rest of the sigma. The kernel's sum cancels out in the normalization.
+    real_t taps[BILATERAL_GRID_PAD + 1];
+    double variance = BILATERAL_GRID_SAMPLING*BILATERAL_GRID_SAMPLING - 1.0/3;
+    for (int k = 0; k <= BILATERAL_GRID_PAD; k++){
+        taps[k] = (real_t)exp(-k*k/(2*variance));
+    }
+
+    size_t plane = (size_t)grid->height*grid->width;
+    unsigned int lengths[3] = {grid->width, grid->height, grid->depth};
+    size_t steps[3] = {1, grid->width, plane};
+    unsigned int length = lengths[op->axis];
+    size_t step = steps[op->axis];
+
+    // The line, with room for the zeros past each end
+    complex_t* line_vals = (complex_t*)malloc((length + 2*BILATERAL_GRID_PAD)*sizeof(complex_t));
+    real_t* line_weights = (real_t*)malloc((length + 2*BILATERAL_GRID_PAD)*sizeof(real_t));
+    if (line_vals == NULL || line_weights == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int t = 0; t < BILATERAL_GRID_PAD; t++){
+        line_vals[t] = 0;
+        line_weights[t] = 0;
+        line_vals[length + BILATERAL_GRID_PAD + t] = 0;
+        line_weights[length + BILATERAL_GRID_PAD + t] = 0;
+    }
+
+    for (unsigned int l = begin; l < end; l++){
+
+        // First cell of line l, counting the lines across the other two axes
+        size_t first;
+        if (op->axis == 0){
+            first = (size_t)l*grid->width;
         }
+        else if (op->axis == 1){
+            first = (l/grid->width)*plane + l % grid->width;
+        }
+        else{
+            first = l;
+        }
+
+        for (unsigned int t = 0; t < length; t++){
+            line_vals[BILATERAL_GRID_PAD + t] = grid->vals[first + t*step];
+            line_weights[BILATERAL_GRID_PAD + t] = grid->weights[first + t*step];
+        }
+
+        for (unsigned int t = 0; t < length; t++){
+            const complex_t* v = line_vals + BILATERAL_GRID_PAD + t;
+            const real_t* w = line_weights + BILATERAL_GRID_PAD + t;
+            complex_t sum_vals = taps[0]*v[0];
+            real_t sum_weights = taps[0]*w[0];
+            for (int k = 1; k <= BILATERAL_GRID_PAD; k++){
+                sum_vals += taps[k]*(v[-k] + v[k]);
+                sum_weights += taps[k]*(w[-k] + w[k]);
+            }
+            grid->vals[first + t*step] = sum_vals;
+            grid->weights[first + t*step] = sum_weights;
+        }
+
     }
 
+    free(line_vals);
+    free(line_weights);
+}
+
+
+// Over rows, interpolate the blurred grid at every pixel and normalize
+static void slice_grid_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct bilateral_op_s* op = (struct bilateral_op_s*)arg;
+    const struct bilateral_grid_s* grid = op->grid;
+
+    size_t plane = (size_t)grid->height*grid->width;
+
+    for (unsigned int i = begin; i < end; i++){
+        for (unsigned int j = 0; j < op->img_in.width; j++){
+
+            unsigned int cell[3];
+            double frac[3];
+            grid_position(grid, i, j, CABS(op->img_in.vals[i][j]), cell, frac);
+
+            complex_t val = 0;
+            real_t weight = 0;
+            for (unsigned int c = 0; c < 8; c++){
+                unsigned int dz = c >> 2, dy = (c >> 1) & 1, dx = c & 1;
+                real_t w = (real_t)((dz ? frac[0] : 1 - frac[0])*(dy ? frac[1] : 1 - frac[1])*(dx ? frac[2] : 1 - frac[2]));
+                size_t k = (cell[0] + dz)*plane + (size_t)(cell[1] + dy)*grid->width + cell[2] + dx;
+                val += w*grid->vals[k];
+                weight += w*grid->weights[k];
+            }
+
+            // The pixel's own splat keeps the weight above zero, unless it underflowed
+            op->img_out.vals[i][j] = (weight > 0) ? val/weight : op->img_in.vals[i][j];
+
+        }
+    }
+}
+
+
+
+// Edge-preserving smoothing through a bilateral grid. Works in O(HW) plus the grid, which shrinks
+// as sigma_spatial grows, so the cost hardly depends on it. An approximation of
+// bilateral_filter_reference(), the kernel being a Gaussian of about the same widths.
+// img_out may be img_in.
+void bilateral_filter(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range){
+
+    struct bilateral_grid_s grid;
+
+    // The range is the magnitude, as in the reference
+    double range_min = REAL_MAX;
+    double range_max = 0;
+    for (unsigned int i = 0; i < img_in.height; i++){
+        for (unsigned int j = 0; j < img_in.width; j++){
+            double r = CABS(img_in.vals[i][j]);
+            range_min = (r < range_min) ? r : range_min;
+            range_max = (r > range_max) ? r : range_max;
+        }
+    }
+
+    grid.spatial_step = sigma_spatial/BILATERAL_GRID_SAMPLING;
+    grid.range_step = sigma_range/BILATERAL_GRID_SAMPLING;
+    grid.range_min = range_min;
+
+    // One more cell than the data reaches for the interpolation, and the padding on both sides
+    grid.depth = (unsigned int)((range_max - range_min)/grid.range_step) + 2 + 2*BILATERAL_GRID_PAD;
+    grid.height = (unsigned int)((img_in.height - 1)/grid.spatial_step) + 2 + 2*BILATERAL_GRID_PAD;
+    grid.width = (unsigned int)((img_in.width - 1)/grid.spatial_step) + 2 + 2*BILATERAL_GRID_PAD;
+
+    size_t num_cells = (size_t)grid.depth*grid.height*grid.width;
+    grid.vals = (complex_t*)calloc(num_cells, sizeof(complex_t));
+    grid.weights = (real_t*)calloc(num_cells, sizeof(real_t));
+    if (grid.vals == NULL || grid.weights == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    splat_grid(&grid, img_in);
+
+    struct bilateral_op_s op;
+    op.grid = &grid;
+    op.img_in = img_in;
+    op.img_out = img_out;
+
+    // Blur along x, y and the range, the lines along each axis are independent
+    op.axis = 0;
+    parallel_for(grid.depth*grid.height, blur_grid_lines, &op);
+    op.axis = 1;
+    parallel_for(grid.depth*grid.width, blur_grid_lines, &op);
+    op.axis = 2;
+    parallel_for(grid.height*grid.width, blur_grid_lines, &op);
+
+    parallel_for_rows(img_in.height, img_in.width, slice_grid_rows, &op);
+
+    free(grid.vals);
+    free(grid.weights);
+
 }
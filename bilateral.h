@@ -5,4 +5,8 @@
 
 void bilateral_filter(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range);
 
+void bilateral_filter_exact(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range);
+
+void bilateral_filter_reference(struct image_s img_in, struct image_s img_out, double sigma_spatial, double sigma_range);
+
 #endif
@@ -1,124 +1,1724 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "convolve.h"
 #include "types.h"
 #include "image.h"
 #include "filter.h"
+#include "threadpool.h"
+#include "workspace.h"
+#include "kernels.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <complex.h>
+#include <math.h>
 #include <fftw3.h>
+#include <pthread.h>
+#include <string.h>
 
-// FFTW uses the image origin (0,0) as the FFT origin.
-// Normally it doesn't matter because I can take the abs in the freq. domain
-// But, Gabor filter is a complex filter, so I can't.
-// Thus, I need to get the phase to align before taking the FFT.
-void shift_filter(struct filter_s filt){
+// Plans live for the whole process and are reused across filters and images.
+// FFTW_MEASURE planning is far slower than the transforms themselves, so a
+// plan is made once per (kind, size, direction, placement, alignment) and executed
+// on whatever arrays the caller hands in through the new-array interface.
+enum plan_kind_e{
+    PLAN_DFT,       // complex to complex
+    PLAN_DFT_R2C,   // real to the left half of a full size complex array
+    PLAN_SPLIT_DFT,     // complex to complex, real and imaginary parts in separate planes
+    PLAN_SPLIT_R2C      // real to the left halves of full size real and imaginary planes
+};
 
-    // Make a target image
-    struct filter_s filt_shift = init_filter_empty(filt.height, filt.width);
+struct plan_cache_entry_s{
+    FFTW(plan) plan;
+    enum plan_kind_e kind;
+    unsigned int height;
+    unsigned int width;
+    int direction;
+    int in_place;
+    int aligned;
+    int num_threads;
+    unsigned int stride;    // Elements between rows of the complex array or the split planes, at least width
+    unsigned int in_stride; // Elements between rows of the real input of the r2c kinds, at least width
+    unsigned int howmany;   // Complex transforms done at once, each height*stride after the last
+};
 
-    // Find the center pixel
-    int center_x = filt.width/2;
-    int center_y = filt.height/2;
+static struct plan_cache_entry_s* plan_cache = NULL;
+static unsigned int plan_cache_size = 0;
+static unsigned int plan_cache_capacity = 0;
+
+// The FFTW planner is not thread safe, executing plans is
+static pthread_mutex_t plan_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Threads each new plan splits a single transform over, see set_transform_threads()
+static int plan_threads = 1;
+static int fftw_threads_ready = 0;
+
+// Planner rigor for new plans, see set_plan_rigor()
+static unsigned int plan_rigor = FFTW_MEASURE;
+
+
+// Make a plan for the key on scratch buffers, since measuring overwrites the arrays
+static FFTW(plan) make_plan(const struct plan_cache_entry_s key){
+
+    unsigned int height = key.height;
+    unsigned int width = key.width;
+    FFTW(plan) plan = NULL;
+
+    unsigned int flags = plan_rigor;
+    if (!key.aligned){
+        flags |= FFTW_UNALIGNED;
+    }
+
+    // Room for a complex array or two aligned planes, split plans put the imaginary plane second.
+    // Real input rows are never more than twice as long as complex ones, so it fits too.
+    size_t plane_size = WORKSPACE_ROUND(key.stride*height*sizeof(real_t));
+    complex_t* plan_in = (complex_t*)FFTW(malloc)(key.howmany*2*plane_size);
+    complex_t* plan_out = key.in_place ? plan_in : (complex_t*)FFTW(malloc)(key.howmany*2*plane_size);
+    if (plan_in == NULL || plan_out == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    real_t* in_re = (real_t*)plan_in;
+    real_t* in_im = (real_t*)((char*)plan_in + plane_size);
+    real_t* out_re = (real_t*)plan_out;
+    real_t* out_im = (real_t*)((char*)plan_out + plane_size);
+
+    // Row major, with the output rows as long as the input ones for the half size real transforms too
+    FFTW(iodim) dims[2];
+    dims[0].n = height;
+    dims[0].is = key.stride;
+    dims[0].os = key.stride;
+    dims[1].n = width;
+    dims[1].is = 1;
+    dims[1].os = 1;
+
+    if (key.howmany > 1){
+        printf("Planning %u of %ux%u...", key.howmany, height, width);
+    }
+    else{
+        printf("Planning %ux%u...", height, width);
+    }
+    fflush(stdout);
+
+    if (fftw_threads_ready){
+        FFTW(plan_with_nthreads)(key.num_threads);
+    }
+
+    // Rows are stride apart in the complex arrays, in_stride apart in the real input of r2c
+    int n[2] = {height, width};
+    int embed[2] = {height, key.stride};
+    int in_embed[2] = {height, key.in_stride};
+
+    if (key.kind == PLAN_DFT){
+        int dist = height*key.stride;
+        plan = FFTW(plan_many_dft)(2, n, key.howmany, plan_in, embed, 1, dist, plan_out, embed, 1, dist, key.direction, flags);
+    }
+    else if (key.kind == PLAN_DFT_R2C){
+        // Write each output row into a full width row, the right half is filled in by symmetry later
+        plan = FFTW(plan_many_dft_r2c)(2, n, key.howmany, (real_t*)plan_in, in_embed, 1, height*key.in_stride, plan_out, embed, 1, height*key.stride, flags);
+    }
+    else if (key.kind == PLAN_SPLIT_DFT){
+        // Split transforms have no direction, the inverse is made by swapping the planes
+        plan = FFTW(plan_guru_split_dft)(2, dims, 0, NULL, in_re, in_im, out_re, out_im, flags);
+    }
+    else if (key.kind == PLAN_SPLIT_R2C){
+        // The real input has its own row stride
+        FFTW(iodim) in_dims[2] = {dims[0], dims[1]};
+        in_dims[0].is = key.in_stride;
+        plan = FFTW(plan_guru_split_dft_r2c)(2, in_dims, 0, NULL, in_re, out_re, out_im, flags);
+    }
 
-    // Swap the top-left and bottom-right fields, bringing the center to 0,0.
-    for (unsigned int i = 0; i < center_y; i++){
-        for (unsigned int j = 0; j < center_x; j++){
-            filt_shift.vals[i][j] = filt.vals[i+center_y][j+center_x];
+    printf("done\n");
+
+    if (!key.in_place){
+        FFTW(free)(plan_out);
+    }
+    FFTW(free)(plan_in);
+
+    return plan;
+
+}
+
+
+static FFTW(plan) get_plan(struct plan_cache_entry_s key){
+
+    pthread_mutex_lock(&plan_cache_lock);
+
+    key.num_threads = plan_threads;
+
+    // Look for a plan we already made
+    for (unsigned int i = 0; i < plan_cache_size; i++){
+        struct plan_cache_entry_s entry = plan_cache[i];
+        if (entry.kind == key.kind && entry.height == key.height && entry.width == key.width && entry.direction == key.direction && entry.in_place == key.in_place && entry.aligned == key.aligned && entry.num_threads == key.num_threads && entry.stride == key.stride && entry.in_stride == key.in_stride && entry.howmany == key.howmany){
+            pthread_mutex_unlock(&plan_cache_lock);
+            return entry.plan;
+        }
+    }
+
+    // Grow the cache if needed
+    if (plan_cache_size == plan_cache_capacity){
+        plan_cache_capacity = (plan_cache_capacity == 0) ? 8 : 2*plan_cache_capacity;
+        plan_cache = (struct plan_cache_entry_s*)realloc(plan_cache, plan_cache_capacity*sizeof(struct plan_cache_entry_s));
+        if (plan_cache == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
         }
     }
-    for (unsigned int i = 0; i < center_y; i++){
-        for (unsigned int j = 0; j < center_x; j++){
-            filt_shift.vals[i+center_y][j+center_x] = filt.vals[i][j];
+
+    key.plan = make_plan(key);
+
+    plan_cache[plan_cache_size] = key;
+    plan_cache_size++;
+
+    pthread_mutex_unlock(&plan_cache_lock);
+
+    return key.plan;
+
+}
+
+
+
+// One direction of a recursive_filter_s, ready for periodic lines of length n.
+// A pass started from zero state leaves the state c; the state a periodic line really starts
+// with is s = A^n s + c, so s = (I - A^n)^-1 c, with A the 3x3 companion matrix of the recursion.
+struct periodic_recursion_s{
+    complex_t weights[4];       // b, then the feedback coefficients, as complex_weighted_sum() takes them
+    complex_t start[3][3];      // (I - A^n)^-1
+};
+
+
+// Arguments for the loop bodies below, which parallel_for() splits into bands
+struct array_op_s{
+    complex_t* out;
+    const complex_t* in;
+    const complex_t* filt;
+    real_t* out_re;         // Split planes, for the *_split bodies
+    real_t* out_im;
+    const real_t* in_re;
+    const real_t* in_im;
+    struct sparse_spectrum_s sparse;
+    const struct sparse_spectrum_s* filters;    // A batch of filters, and how many
+    unsigned int count;
+    const complex_t* taps;  // 2*radius + 1 taps of a 1D convolution
+    unsigned int radius;
+    const struct periodic_recursion_s* forward;     // Recursive filter passes, set up for the line length
+    const struct periodic_recursion_s* backward;
+    real_t divisor;
+    unsigned int height;
+    unsigned int width;
+    unsigned int stride;    // Elements from one row of out (and in) to the next
+    unsigned int in_stride; // Same for in, for the separable and recursive passes where the two differ
+    unsigned int plane_stride;  // Elements from one row of the split planes to the next, in and out alike
+    unsigned int shift;     // Rows or columns to rotate by, for the in place shifts
+    complex_t offset;       // Taken off in as it is read by the recursive passes
+};
+
+
+static void clear_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        op->out[i] = 0;
+    }
+}
+
+
+static void multiply_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    complex_multiply(op->out + begin, op->in + begin, op->filt + begin, end - begin);
+}
+
+
+static void normalize_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    complex_scale(op->out + begin, op->out + begin, 1/op->divisor, end - begin);
+}
+
+
+// Normalize into a different array
+static void normalize_copy_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    complex_scale(op->out + begin, op->in + begin, 1/op->divisor, end - begin);
+}
+
+
+// Over spans of a sparse filter, writing into a full size spectrum
+static void multiply_spans(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int s = begin; s < end; s++){
+
+        struct spectrum_span_s span = op->sparse.spans[s];
+        const complex_t* img_row = op->in + op->stride*span.row + span.start;
+        const complex_t* filt_vals = op->sparse.vals + span.offset;
+        complex_t* out_row = op->out + op->stride*span.row + span.start;
+
+        complex_multiply(out_row, img_row, filt_vals, span.length);
+
+    }
+}
+
+
+// First span on or after row, spans are stored in row order
+static unsigned int first_span_from_row(const struct sparse_spectrum_s spec, const unsigned int row){
+    unsigned int low = 0;
+    unsigned int high = spec.num_spans;
+    while (low < high){
+        unsigned int mid = low + (high - low)/2;
+        if (spec.spans[mid].row < row){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
         }
     }
+    return low;
+}
+
+
+// Over rows, for each of the op->count filters clear that row of its spectrum in the batch
+// and multiply in the filter's spans on it, so every filter uses the image row while it is in cache.
+// The spectra in the batch are height*stride apart.
+static void multiply_batch_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    size_t dist = (size_t)op->height*op->stride;
+    for (unsigned int i = begin; i < end; i++){
+
+        const complex_t* img_row = op->in + op->stride*i;
+
+        for (unsigned int k = 0; k < op->count; k++){
+
+            complex_t* out_row = op->out + dist*k + op->stride*i;
+            for (unsigned int j = 0; j < op->stride; j++){
+                out_row[j] = 0;
+            }
+
+            struct sparse_spectrum_s spec = op->filters[k];
+            for (unsigned int s = first_span_from_row(spec, i); s < spec.num_spans && spec.spans[s].row == i; s++){
+                struct spectrum_span_s span = spec.spans[s];
+                complex_multiply(out_row + span.start, img_row + span.start, spec.vals + span.offset, span.length);
+            }
 
-    // Swap the bottom-left and top-right fields
-    for (unsigned int i = center_y; i < filt.height; i++){
-        for (unsigned int j = 0; j < center_x; j++){
-            filt_shift.vals[i][j] = filt.vals[i-center_y][j+center_x];
         }
+
     }
-    for (unsigned int i = center_y; i < filt.height; i++){
-        for (unsigned int j = 0; j < center_x; j++){
-            filt_shift.vals[i-center_y][j+center_x] = filt.vals[i][j];
+}
+
+
+// Over rows, out[i][j] = sum over d of taps[radius + d]*in[i][(j - d) % width], d in -radius..radius.
+// Reads the real rows in_re when in is NULL, either way in_stride apart. Each row is copied into its output row with radius
+// values wrapped on to either end, so every tap is one run over contiguous values, out rows have room
+// for them. The sums then fill the row from its start, never ahead of the values still to be read.
+static void convolve_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    unsigned int radius = op->radius;
+    unsigned int width = op->width;
+
+    const complex_t* shifted[2*radius + 1];
+
+    for (unsigned int i = begin; i < end; i++){
+
+        complex_t* ext = op->out + (size_t)op->stride*i;
+
+        // in[i][j - d] is ext[j - d + radius], with t = radius + d
+        for (unsigned int t = 0; t < 2*radius + 1; t++){
+            shifted[t] = ext + 2*radius - t;
+        }
+
+        // The row itself, then the wrapped ends
+        if (op->in != NULL){
+            memcpy(ext + radius, op->in + (size_t)op->in_stride*i, width*sizeof(complex_t));
+        }
+        else{
+            for (unsigned int j = 0; j < width; j++){
+                ext[radius + j] = op->in_re[(size_t)op->in_stride*i + j];
+            }
+        }
+        for (unsigned int p = 0; p < radius; p++){
+            ext[p] = ext[radius + (width - (radius - p) % width) % width];
+            ext[radius + width + p] = ext[radius + p % width];
         }
+
+        complex_weighted_sum(ext, shifted, op->taps, 2*radius + 1, width);
+
     }
+}
+
+
+// Over rows, out[i][j] = sum over d of taps[radius + d]*in[(i - d) % height][j], d in -radius..radius
+static void convolve_columns(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    unsigned int radius = op->radius;
+
+    const complex_t* rows[2*radius + 1];
+
+    for (unsigned int i = begin; i < end; i++){
+
+        for (unsigned int t = 0; t < 2*radius + 1; t++){
+            long d = (long)t - (long)radius;
+            unsigned int src = (unsigned int)((((long)i - d) % (long)op->height + (long)op->height) % (long)op->height);
+            rows[t] = op->in + (size_t)op->in_stride*src;
+        }
+
+        complex_weighted_sum(op->out + (size_t)op->stride*i, rows, op->taps, 2*radius + 1, op->width);
 
-    // Copy back and free the results
-    for (unsigned int i = 0; i < filt.height*filt.width; i++){
-        filt.raw_vals[i] = filt_shift.raw_vals[i];
     }
-    free_filter(filt_shift);
+}
+
+
+// Over rows, out[i][j] = in[(i + height/2) % height][(j + width/2) % width]
+static void shift_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+
+        const complex_t* in_row = op->in + op->stride*((i + op->height/2) % op->height);
+        complex_t* out_row = op->out + op->stride*i;
+        unsigned int center_x = op->width/2;
 
+        for (unsigned int j = 0; j < op->width - center_x; j++){
+            out_row[j] = in_row[j + center_x];
+        }
+        for (unsigned int j = op->width - center_x; j < op->width; j++){
+            out_row[j] = in_row[j + center_x - op->width];
+        }
+
+    }
 }
 
 
+// Over rows of the top half, swap the quadrants of an even sized array in place
+static void swap_quadrant_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    unsigned int half_x = op->width/2;
+    for (unsigned int i = begin; i < end; i++){
 
-void convolve_frequency(const struct image_s img_in_raw, struct image_s img_out_raw, const struct filter_s filt_raw){
+        complex_t* top = op->out + op->stride*i;
+        complex_t* bottom = op->out + op->stride*(i + op->height/2);
 
-    // get image dims
-    int height = img_in_raw.height;
-    int width = img_in_raw.width;
+        for (unsigned int j = 0; j < half_x; j++){
+            complex_t temp = top[j];
+            top[j] = bottom[j + half_x];
+            bottom[j + half_x] = temp;
 
-    // Allocate all needed images
-    struct image_s img = init_image_empty(height, width);
-    struct image_s img_fft = init_image_empty(height, width);
-    struct filter_s filt = init_filter_empty(height, width);
-    struct filter_s filt_fft = init_filter_empty(height, width);
+            temp = top[j + half_x];
+            top[j + half_x] = bottom[j];
+            bottom[j] = temp;
+        }
 
-    // Make the FFT plans
-    printf("Planning...");
-    fflush(stdout);
-    fftw_plan img_in_plan = fftw_plan_dft_2d(height, width, img.raw_vals, img_fft.raw_vals, FFTW_FORWARD, FFTW_MEASURE);
-    printf("...");
-    fflush(stdout);
-    fftw_plan filt_plan = fftw_plan_dft_2d(height, width, filt.raw_vals, filt_fft.raw_vals, FFTW_FORWARD, FFTW_MEASURE);
-    printf("...");
-    fflush(stdout);
-    fftw_plan img_out_plan = fftw_plan_dft_2d(height, width, img_fft.raw_vals, img.raw_vals, FFTW_BACKWARD, FFTW_MEASURE);
-    printf("done\n");
+    }
+}
 
-    // Copy the image and filter data into the planned arrays
-    for (unsigned int i = 0; i < width*height; i++){
-        img.raw_vals[i] = img_in_raw.raw_vals[i];
+
+static void reverse_elements(complex_t* vals, const unsigned int length){
+    for (unsigned int j = 0; j < length/2; j++){
+        complex_t temp = vals[j];
+        vals[j] = vals[length - 1 - j];
+        vals[length - 1 - j] = temp;
     }
-    for (unsigned int i = 0; i < width*height; i++){
-        filt.raw_vals[i] = filt_raw.raw_vals[i];
+}
+
+
+// Over rows, rotate each row left by shift with three reversals
+static void rotate_row_elements(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        complex_t* row = op->out + op->stride*i;
+        reverse_elements(row, op->shift);
+        reverse_elements(row + op->shift, op->width - op->shift);
+        reverse_elements(row, op->width);
     }
+}
 
-    // Shift the filter
-    shift_filter(filt);
 
-    // Execute the FFTs
-    fftw_execute(img_in_plan);
-    fftw_execute(filt_plan);
+// Over pairs, reverse the order of the op->height rows starting at op->out
+static void reverse_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        complex_t* top = op->out + op->stride*i;
+        complex_t* bottom = op->out + op->stride*(op->height - 1 - i);
+        for (unsigned int j = 0; j < op->width; j++){
+            complex_t temp = top[j];
+            top[j] = bottom[j];
+            bottom[j] = temp;
+        }
+    }
+}
+
+
+// Over rows, multiply by (-1)^(u+v), a shift by half the size in each direction
+static void alternate_sign_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        complex_t* row = op->out + op->stride*i;
+        for (unsigned int j = (i + 1) % 2; j < op->width; j += 2){
+            row[j] = -row[j];
+        }
+    }
+}
+
+
+// Over rows, fill columns width/2+1.. of an r2c output from X[k][l] = conj(X[-k][-l])
+static void hermitian_fill_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        complex_t* row = op->out + op->stride*i;
+        const complex_t* mirror_row = op->out + op->stride*((op->height - i) % op->height);
+        for (unsigned int j = op->width/2 + 1; j < op->width; j++){
+            row[j] = CONJ(mirror_row[op->width - j]);
+        }
+    }
+}
+
+
+
+
+// The same bodies for split planes
+
+
+static void clear_split_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        op->out_re[i] = 0;
+        op->out_im[i] = 0;
+    }
+}
+
+
+// Over rows, split image spectrum times an interleaved filter spectrum.
+// The planes' rows are op->plane_stride apart, the filter's op->stride.
+static void multiply_split_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        const complex_t* filt_row = op->filt + op->stride*i;
+        unsigned int first = op->plane_stride*i;
+        for (unsigned int j = 0; j < op->width; j++){
+            real_t filt_re = CREAL(filt_row[j]);
+            real_t filt_im = CIMAG(filt_row[j]);
+            op->out_re[first + j] = op->in_re[first + j]*filt_re - op->in_im[first + j]*filt_im;
+            op->out_im[first + j] = op->in_re[first + j]*filt_im + op->in_im[first + j]*filt_re;
+        }
+    }
+}
+
+
+static void normalize_split_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    real_t scale = 1/op->divisor;
+    for (unsigned int i = begin; i < end; i++){
+        op->out_re[i] *= scale;
+        op->out_im[i] *= scale;
+    }
+}
+
+
+static void multiply_split_spans(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int s = begin; s < end; s++){
+
+        struct spectrum_span_s span = op->sparse.spans[s];
+        unsigned int first = op->plane_stride*span.row + span.start;
+        const complex_t* filt_vals = op->sparse.vals + span.offset;
+
+        for (unsigned int j = 0; j < span.length; j++){
+            real_t filt_re = CREAL(filt_vals[j]);
+            real_t filt_im = CIMAG(filt_vals[j]);
+            op->out_re[first + j] = op->in_re[first + j]*filt_re - op->in_im[first + j]*filt_im;
+            op->out_im[first + j] = op->in_re[first + j]*filt_im + op->in_im[first + j]*filt_re;
+        }
+
+    }
+}
+
+
+static void hermitian_fill_split_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+    for (unsigned int i = begin; i < end; i++){
+        unsigned int row = op->plane_stride*i;
+        unsigned int mirror_row = op->plane_stride*((op->height - i) % op->height);
+        for (unsigned int j = op->width/2 + 1; j < op->width; j++){
+            op->out_re[row + j] = op->out_re[mirror_row + op->width - j];
+            op->out_im[row + j] = -op->out_im[mirror_row + op->width - j];
+        }
+    }
+}
+
+
+
+// in and out both have rows stride apart
+void execute_fft_2d(complex_t* in, complex_t* out, const unsigned int height, const unsigned int width, const unsigned int stride, const int direction){
+
+    struct plan_cache_entry_s key;
+    key.kind = PLAN_DFT;
+    key.howmany = 1;
+    key.height = height;
+    key.width = width;
+    key.stride = stride;
+    key.in_stride = 0;
+    key.direction = direction;
+    key.in_place = (in == out);
+    key.aligned = (FFTW(alignment_of)((real_t*)in) == 0) && (FFTW(alignment_of)((real_t*)out) == 0);
+
+    FFTW(execute_dft)(get_plan(key), in, out);
+
+}
+
+
+
+// count transforms in place, on arrays height*stride apart starting at vals, with one batched plan
+void execute_fft_2d_batch(complex_t* vals, const unsigned int count, const unsigned int height, const unsigned int width, const unsigned int stride, const int direction){
+
+    struct plan_cache_entry_s key;
+    key.kind = PLAN_DFT;
+    key.howmany = count;
+    key.height = height;
+    key.width = width;
+    key.stride = stride;
+    key.in_stride = 0;
+    key.direction = direction;
+    key.in_place = 1;
+    key.aligned = (FFTW(alignment_of)((real_t*)vals) == 0);
+
+    FFTW(execute_dft)(get_plan(key), vals, vals);
+
+}
+
 
-    // Perform pointwise multiplication
-    for (unsigned int i = 0; i < width*height; i++){
-        img_fft.raw_vals[i] *= filt_fft.raw_vals[i];
+
+// Forward transform of real data into a full size complex spectrum.
+// The real transform only computes columns 0..width/2, the rest follow from
+// Hermitian symmetry: X[k][l] = conj(X[-k][-l]). The input rows are in_stride apart, the output ones stride apart.
+void execute_fft_2d_r2c(real_t* in, complex_t* out, const unsigned int height, const unsigned int width, const unsigned int in_stride, const unsigned int stride){
+
+    execute_fft_2d_r2c_batch(in, out, 1, height, width, in_stride, stride);
+
+}
+
+
+
+// Same as execute_fft_2d_r2c() for count images with one batched plan.
+// The inputs are height*in_stride apart, the spectra height*stride apart.
+void execute_fft_2d_r2c_batch(real_t* in, complex_t* out, const unsigned int count, const unsigned int height, const unsigned int width, const unsigned int in_stride, const unsigned int stride){
+
+    struct plan_cache_entry_s key;
+    key.kind = PLAN_DFT_R2C;
+    key.howmany = count;
+    key.height = height;
+    key.width = width;
+    key.stride = stride;
+    key.in_stride = in_stride;
+    key.direction = FFTW_FORWARD;
+    key.in_place = 0;
+    key.aligned = (FFTW(alignment_of)(in) == 0) && (FFTW(alignment_of)((real_t*)out) == 0);
+
+    FFTW(execute_dft_r2c)(get_plan(key), in, out);
+
+    // Fill in the right halves from the left
+    struct array_op_s op;
+    op.height = height;
+    op.width = width;
+    op.stride = stride;
+    for (unsigned int k = 0; k < count; k++){
+        op.out = out + (size_t)height*stride*k;
+        parallel_for_rows(height, width, hermitian_fill_rows, &op);
+    }
+
+}
+
+
+
+// Same as execute_fft_2d(), on split planes with rows stride apart. Inverse transforms swap the
+// real and imaginary planes of both sides, since conj(DFT(conj(x))) is the inverse DFT.
+void execute_fft_2d_split(real_t* in_re, real_t* in_im, real_t* out_re, real_t* out_im, const unsigned int height, const unsigned int width, const unsigned int stride, const int direction){
+
+    struct plan_cache_entry_s key;
+    key.kind = PLAN_SPLIT_DFT;
+    key.howmany = 1;
+    key.height = height;
+    key.width = width;
+    key.stride = stride;
+    key.in_stride = 0;
+    key.direction = FFTW_FORWARD;
+    key.in_place = (in_re == out_re);
+    key.aligned = (FFTW(alignment_of)(in_re) == 0) && (FFTW(alignment_of)(in_im) == 0) && (FFTW(alignment_of)(out_re) == 0) && (FFTW(alignment_of)(out_im) == 0);
+
+    if (direction == FFTW_FORWARD){
+        FFTW(execute_split_dft)(get_plan(key), in_re, in_im, out_re, out_im);
+    }
+    else{
+        FFTW(execute_split_dft)(get_plan(key), in_im, in_re, out_im, out_re);
+    }
+
+}
+
+
+
+// Same as execute_fft_2d_r2c(), into split planes with rows stride apart
+void execute_fft_2d_r2c_split(real_t* in, real_t* out_re, real_t* out_im, const unsigned int height, const unsigned int width, const unsigned int in_stride, const unsigned int stride){
+
+    struct plan_cache_entry_s key;
+    key.kind = PLAN_SPLIT_R2C;
+    key.howmany = 1;
+    key.height = height;
+    key.width = width;
+    key.stride = stride;
+    key.in_stride = in_stride;
+    key.direction = FFTW_FORWARD;
+    key.in_place = 0;
+    key.aligned = (FFTW(alignment_of)(in) == 0) && (FFTW(alignment_of)(out_re) == 0) && (FFTW(alignment_of)(out_im) == 0);
+
+    FFTW(execute_split_dft_r2c)(get_plan(key), in, out_re, out_im);
+
+    struct array_op_s op;
+    op.out_re = out_re;
+    op.out_im = out_im;
+    op.height = height;
+    op.width = width;
+    op.plane_stride = stride;
+    parallel_for_rows(height, width, hermitian_fill_split_rows, &op);
+
+}
+
+
+
+// Split every transform, and the O(HW) loops around them, over num_threads threads.
+// Meant for very large single images. Call it before any transform is made.
+void set_transform_threads(const unsigned int num_threads){
+
+    pthread_mutex_lock(&plan_cache_lock);
+
+    if (num_threads > 1 && !fftw_threads_ready){
+        if (!FFTW(init_threads)()){
+            fprintf(stderr, "FFTW thread initialization failed\n");
+            exit(EXIT_FAILURE);
+        }
+        fftw_threads_ready = 1;
     }
+    plan_threads = (num_threads > 0) ? num_threads : 1;
+
+    pthread_mutex_unlock(&plan_cache_lock);
+
+    set_loop_threads(num_threads);
+
+}
+
+
+
+// FFTW_ESTIMATE, FFTW_MEASURE (the default), FFTW_PATIENT or FFTW_EXHAUSTIVE.
+// Only affects plans that haven't been made yet.
+void set_plan_rigor(const unsigned int rigor){
+
+    pthread_mutex_lock(&plan_cache_lock);
+    plan_rigor = rigor;
+    pthread_mutex_unlock(&plan_cache_lock);
+
+}
+
+
 
-    // Execute the inverse transform
-    fftw_execute(img_out_plan);
+// Parse "estimate", "measure", "patient" or "exhaustive", returns 0 if it is none of them
+int parse_plan_rigor(const char* const name, unsigned int* rigor){
 
-    // Copy data to output image, with normalization
-    for (unsigned int i = 0; i < width*height; i++){
-        img_out_raw.raw_vals[i] = img.raw_vals[i]/(height*width);
+    if (strcmp(name, "estimate") == 0){
+        *rigor = FFTW_ESTIMATE;
     }
+    else if (strcmp(name, "measure") == 0){
+        *rigor = FFTW_MEASURE;
+    }
+    else if (strcmp(name, "patient") == 0){
+        *rigor = FFTW_PATIENT;
+    }
+    else if (strcmp(name, "exhaustive") == 0){
+        *rigor = FFTW_EXHAUSTIVE;
+    }
+    else{
+        return 0;
+    }
+
+    return 1;
+
+}
+
 
-    // Free everything we made
-    free_image(img);
-    free_image(img_fft);
-    free_filter(filt);
-    free_filter(filt_fft);
 
-    fftw_destroy_plan(img_in_plan);
-    fftw_destroy_plan(filt_plan);
-    fftw_destroy_plan(img_out_plan);
+// Wisdom lets a new process skip measuring plans an earlier one already measured.
+// A missing file is fine, there is just nothing to import yet.
+int load_fftw_wisdom(const char* const path){
+
+    pthread_mutex_lock(&plan_cache_lock);
+    int loaded = FFTW(import_wisdom_from_filename)(path);
+    pthread_mutex_unlock(&plan_cache_lock);
+
+    return loaded;
 
 }
 
-// This is as unoptomized as the American Congress
+
+
+// Write out everything learned so far, call it before cleanup_fftw() which forgets it
+int save_fftw_wisdom(const char* const path){
+
+    pthread_mutex_lock(&plan_cache_lock);
+    int saved = FFTW(export_wisdom_to_filename)(path);
+    pthread_mutex_unlock(&plan_cache_lock);
+
+    if (!saved){
+        fprintf(stderr, "Could not write wisdom to %s\n", path);
+    }
+
+    return saved;
+
+}
+
+
+
+// Make every plan a full size image goes through, so its wisdom can be saved ahead of time.
+// Decimated subband sizes depend on the bank and are picked up on the first real run instead.
+void prepare_fft_plans(const unsigned int height, const unsigned int width){
+
+    struct plan_cache_entry_s key;
+    key.height = height;
+    key.width = width;
+    key.stride = padded_row_stride(width, sizeof(complex_t));
+    key.in_stride = 0;
+    key.howmany = 1;
+    key.aligned = 1;
+
+    // Forward image transforms, complex and real
+    key.kind = PLAN_DFT;
+    key.direction = FFTW_FORWARD;
+    key.in_place = 0;
+    get_plan(key);
+
+    key.kind = PLAN_DFT_R2C;
+    key.in_stride = padded_row_stride(width, sizeof(real_t));
+    get_plan(key);
+    key.in_stride = 0;
+
+    // Forward filter transforms and inverse response transforms, both in place
+    key.kind = PLAN_DFT;
+    key.in_place = 1;
+    get_plan(key);
+
+    key.direction = FFTW_BACKWARD;
+    get_plan(key);
+
+}
+
+
+
+void cleanup_fftw(){
+
+    set_loop_threads(1);
+
+    pthread_mutex_lock(&plan_cache_lock);
+
+    for (unsigned int i = 0; i < plan_cache_size; i++){
+        FFTW(destroy_plan)(plan_cache[i].plan);
+    }
+
+    free(plan_cache);
+    plan_cache = NULL;
+    plan_cache_size = 0;
+    plan_cache_capacity = 0;
+
+    pthread_mutex_unlock(&plan_cache_lock);
+
+    if (fftw_threads_ready){
+        FFTW(cleanup_threads)();
+        fftw_threads_ready = 0;
+    }
+    else{
+        FFTW(cleanup)();
+    }
+
+}
+
+
+
+// Circularly shift an array in place so out[i][j] = in[(i + shift_y) % height][(j + shift_x) % width].
+// Needs no scratch memory, and even sizes shifted by half take a single quadrant swap pass.
+static void rotate_2d(complex_t* vals, const unsigned int height, const unsigned int width, const unsigned int stride, const unsigned int shift_y, const unsigned int shift_x){
+
+    struct array_op_s op;
+    op.out = vals;
+    op.height = height;
+    op.width = width;
+    op.stride = stride;
+
+    if (height % 2 == 0 && width % 2 == 0 && shift_y == height/2 && shift_x == width/2){
+        parallel_for_rows(height/2, width, swap_quadrant_rows, &op);
+        return;
+    }
+
+    // Rotate within each row
+    if (shift_x % width != 0){
+        op.shift = shift_x % width;
+        parallel_for_rows(height, width, rotate_row_elements, &op);
+    }
+
+    // Then rotate the rows themselves, again with three reversals
+    unsigned int rows = shift_y % height;
+    if (rows != 0){
+
+        op.height = rows;
+        parallel_for_rows(rows/2, width, reverse_rows, &op);
+
+        op.out = vals + stride*rows;
+        op.height = height - rows;
+        parallel_for_rows((height - rows)/2, width, reverse_rows, &op);
+
+        op.out = vals;
+        op.height = height;
+        parallel_for_rows(height/2, width, reverse_rows, &op);
+
+    }
+
+}
+
+
+
+// Move the zero frequency (0,0) to the middle (height/2, width/2), for display
+void fftshift_2d(complex_t* vals, const unsigned int height, const unsigned int width, const unsigned int stride){
+
+    rotate_2d(vals, height, width, stride, height - height/2, width - width/2);
+
+}
+
+
+
+// Undo fftshift_2d(), bringing the middle (height/2, width/2) to (0,0)
+void ifftshift_2d(complex_t* vals, const unsigned int height, const unsigned int width, const unsigned int stride){
+
+    rotate_2d(vals, height, width, stride, height/2, width/2);
+
+}
+
+
+
+// FFTW uses the image origin (0,0) as the FFT origin.
+// Normally it doesn't matter because I can take the abs in the freq. domain
+// But, Gabor filter is a complex filter, so I can't.
+// Thus, I need to get the phase to align before taking the FFT.
+void shift_filter(struct filter_s filt){
+
+    // Bring the center pixel to 0,0, wrapping everything around it
+    ifftshift_2d(filt.raw_vals, filt.height, filt.width, filt.stride);
+
+}
+
+
+
+void fft_image(const struct image_s img_in, struct image_s img_fft){
+
+    // Out-of-place complex transforms leave the input intact, so no copy is needed
+    execute_fft_2d(img_in.raw_vals, img_fft.raw_vals, img_in.height, img_in.width, img_in.stride, FFTW_FORWARD);
+
+}
+
+
+
+// Real input takes half the memory and half the work to transform
+void fft_image_real(const struct image_real_s img_in, struct image_s img_fft){
+
+    execute_fft_2d_r2c(img_in.raw_vals, img_fft.raw_vals, img_in.height, img_in.width, img_in.stride, img_fft.stride);
+
+}
+
+
+
+void fft_image_real_split(const struct image_real_s img_in, struct image_split_s img_fft){
+
+    execute_fft_2d_r2c_split(img_in.raw_vals, img_fft.re, img_fft.im, img_in.height, img_in.width, img_in.stride, img_fft.stride);
+
+}
+
+
+
+void fft_filter(const struct filter_s filt_in, struct filter_s filt_fft){
+
+    // Shift the filter straight into the output, then transform it in place
+    struct array_op_s op;
+    op.in = filt_in.raw_vals;
+    op.out = filt_fft.raw_vals;
+    op.height = filt_in.height;
+    op.width = filt_in.width;
+    op.stride = filt_in.stride;
+    parallel_for_rows(filt_in.height, filt_in.width, shift_rows, &op);
+
+    execute_fft_2d(filt_fft.raw_vals, filt_fft.raw_vals, filt_fft.height, filt_fft.width, filt_fft.stride, FFTW_FORWARD);
+
+}
+
+
+
+// Same result as fft_filter(), but the filter is transformed where it sits and
+// recentered afterwards: shifting by half the size is a (-1)^(u+v) sign on the spectrum.
+// Only even sizes have an exact half, odd ones take the fft_filter() path.
+void fft_filter_phase(const struct filter_s filt_in, struct filter_s filt_fft){
+
+    if (filt_in.height % 2 != 0 || filt_in.width % 2 != 0){
+        fft_filter(filt_in, filt_fft);
+        return;
+    }
+
+    // Out-of-place complex transforms leave the input intact
+    execute_fft_2d(filt_in.raw_vals, filt_fft.raw_vals, filt_in.height, filt_in.width, filt_in.stride, FFTW_FORWARD);
+
+    struct array_op_s op;
+    op.out = filt_fft.raw_vals;
+    op.height = filt_fft.height;
+    op.width = filt_fft.width;
+    op.stride = filt_fft.stride;
+    parallel_for_rows(filt_fft.height, filt_fft.width, alternate_sign_rows, &op);
+
+}
+
+
+
+// The back half of a frequency domain convolution.
+// Lets a caller transform the image once and reuse the spectrum for many filters.
+void convolve_spectrum(const struct image_s img_fft, struct image_s img_out, const struct filter_s filt_fft){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+
+    struct array_op_s op;
+    op.out = img_out.raw_vals;
+    op.in = img_fft.raw_vals;
+    op.filt = filt_fft.raw_vals;
+    op.divisor = height*width;
+
+    // Same sizes have the same stride, and the padding is zero in every array,
+    // so whole rows, padding included, can be run through as one flat loop
+    unsigned int count = height*img_out.stride;
+
+    // Perform pointwise multiplication straight into the output
+    parallel_for(count, multiply_range, &op);
+
+    // Execute the inverse transform in place
+    execute_fft_2d(img_out.raw_vals, img_out.raw_vals, height, width, img_out.stride, FFTW_BACKWARD);
+
+    // Normalize
+    parallel_for(count, normalize_range, &op);
+
+}
+
+
+
+// Same as convolve_spectrum(), but only the filter's passband is touched.
+// Everything outside the stored spans is zero, so the rest of the output spectrum is just cleared.
+void convolve_spectrum_sparse(const struct image_s img_fft, struct image_s img_out, const struct sparse_spectrum_s filt_fft){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+
+    struct array_op_s op;
+    op.out = img_out.raw_vals;
+    op.in = img_fft.raw_vals;
+    op.sparse = filt_fft;
+    op.divisor = height*width;
+    op.height = height;
+    op.width = width;
+    op.stride = img_out.stride;
+
+    // Clear the output spectrum
+    parallel_for(height*img_out.stride, clear_range, &op);
+
+    // Multiply inside the passband only
+    parallel_for_rows(filt_fft.num_spans, filt_fft.num_vals/(filt_fft.num_spans + 1), multiply_spans, &op);
+
+    // Execute the inverse transform in place
+    execute_fft_2d(img_out.raw_vals, img_out.raw_vals, height, width, img_out.stride, FFTW_BACKWARD);
+
+    // Normalize
+    parallel_for(height*img_out.stride, normalize_range, &op);
+
+}
+
+
+
+// Bytes of batch buffer convolve_spectrum_sparse_batch() needs for count filters
+size_t convolve_batch_size(const unsigned int height, const unsigned int width, const unsigned int count){
+
+    return WORKSPACE_ROUND((size_t)count*height*padded_row_stride(width, sizeof(complex_t))*sizeof(complex_t));
+
+}
+
+
+
+// Same as convolve_spectrum_sparse() for count filters at once, one output image each.
+// The products go into the batch buffer, are inverse transformed there by a single batched
+// plan, and are normalized on the way out into img_out.
+void convolve_spectrum_sparse_batch(const struct image_s img_fft, struct image_s* img_out, const struct sparse_spectrum_s* filt_fft, const unsigned int count, complex_t* batch){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+    unsigned int stride = img_fft.stride;
+    size_t dist = (size_t)height*stride;
+
+    struct array_op_s op;
+    op.out = batch;
+    op.in = img_fft.raw_vals;
+    op.filters = filt_fft;
+    op.count = count;
+    op.divisor = height*width;
+    op.height = height;
+    op.width = width;
+    op.stride = stride;
+
+    parallel_for_rows(height, count*width, multiply_batch_rows, &op);
+
+    execute_fft_2d_batch(batch, count, height, width, stride, FFTW_BACKWARD);
+
+    for (unsigned int k = 0; k < count; k++){
+        op.out = img_out[k].raw_vals;
+        op.in = batch + dist*k;
+        parallel_for(dist, normalize_copy_range, &op);
+    }
+
+}
+
+
+
+// Same as convolve_spectrum_sparse(), but img_out is the smaller subband grid.
+// Each passband bin is moved to its offset from the band center, wrapped into the small grid,
+// so the inverse transform yields every decimation-th sample of the response, demodulated by the center.
+void convolve_spectrum_decimated(const struct image_s img_fft, struct image_s img_out, const struct sparse_spectrum_s filt_fft, const struct subband_s band){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+
+    struct array_op_s op;
+    op.out = img_out.raw_vals;
+    op.divisor = height*width;
+
+    // Clear the output spectrum
+    parallel_for(img_out.height*img_out.stride, clear_range, &op);
+
+    // Multiply inside the passband, scattering into the small grid
+    const complex_t* filt_vals = filt_fft.vals;
+    for (unsigned int s = 0; s < filt_fft.num_spans; s++){
+
+        struct spectrum_span_s span = filt_fft.spans[s];
+        const complex_t* img_row = img_fft.vals[span.row] + span.start;
+        complex_t* out_row = img_out.vals[(span.row + height - band.center_y) % img_out.height];
+        unsigned int out_col = (span.start + width - band.center_x) % img_out.width;
+
+        for (unsigned int j = 0; j < span.length; j++){
+            out_row[out_col] = img_row[j] * filt_vals[j];
+            out_col++;
+            if (out_col == img_out.width){
+                out_col = 0;
+            }
+        }
+        filt_vals += span.length;
+
+    }
+
+    // Execute the inverse transform in place on the small grid
+    execute_fft_2d(img_out.raw_vals, img_out.raw_vals, img_out.height, img_out.width, img_out.stride, FFTW_BACKWARD);
+
+    // Normalize by the full size, the small grid is a subset of the full one
+    parallel_for(img_out.height*img_out.stride, normalize_range, &op);
+
+}
+
+
+
+// The convolve_spectrum*() functions again, for split image spectra and responses.
+// Filter spectra stay interleaved, they are shared with the interleaved path and the bank cache.
+
+
+void convolve_spectrum_split(const struct image_split_s img_fft, struct image_split_s img_out, const struct filter_s filt_fft){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+
+    struct array_op_s op;
+    op.out_re = img_out.re;
+    op.out_im = img_out.im;
+    op.in_re = img_fft.re;
+    op.in_im = img_fft.im;
+    op.filt = filt_fft.raw_vals;
+    op.divisor = height*width;
+    op.width = width;
+    op.stride = filt_fft.stride;
+    op.plane_stride = img_out.stride;
+
+    parallel_for_rows(height, width, multiply_split_rows, &op);
+
+    execute_fft_2d_split(img_out.re, img_out.im, img_out.re, img_out.im, height, width, img_out.stride, FFTW_BACKWARD);
+
+    parallel_for(height*img_out.stride, normalize_split_range, &op);
+
+}
+
+
+
+void convolve_spectrum_sparse_split(const struct image_split_s img_fft, struct image_split_s img_out, const struct sparse_spectrum_s filt_fft){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+
+    struct array_op_s op;
+    op.out_re = img_out.re;
+    op.out_im = img_out.im;
+    op.in_re = img_fft.re;
+    op.in_im = img_fft.im;
+    op.sparse = filt_fft;
+    op.divisor = height*width;
+    op.height = height;
+    op.width = width;
+    op.plane_stride = img_out.stride;
+
+    parallel_for(height*img_out.stride, clear_split_range, &op);
+
+    parallel_for_rows(filt_fft.num_spans, filt_fft.num_vals/(filt_fft.num_spans + 1), multiply_split_spans, &op);
+
+    execute_fft_2d_split(img_out.re, img_out.im, img_out.re, img_out.im, height, width, img_out.stride, FFTW_BACKWARD);
+
+    parallel_for(height*img_out.stride, normalize_split_range, &op);
+
+}
+
+
+
+void convolve_spectrum_decimated_split(const struct image_split_s img_fft, struct image_split_s img_out, const struct sparse_spectrum_s filt_fft, const struct subband_s band){
+
+    unsigned int height = img_fft.height;
+    unsigned int width = img_fft.width;
+
+    struct array_op_s op;
+    op.out_re = img_out.re;
+    op.out_im = img_out.im;
+    op.divisor = height*width;
+
+    parallel_for(img_out.height*img_out.stride, clear_split_range, &op);
+
+    // Multiply inside the passband, scattering into the small grid
+    const complex_t* filt_vals = filt_fft.vals;
+    for (unsigned int s = 0; s < filt_fft.num_spans; s++){
+
+        struct spectrum_span_s span = filt_fft.spans[s];
+        unsigned int first = img_fft.stride*span.row + span.start;
+        unsigned int out_row = img_out.stride*((span.row + height - band.center_y) % img_out.height);
+        unsigned int out_col = (span.start + width - band.center_x) % img_out.width;
+
+        for (unsigned int j = 0; j < span.length; j++){
+            real_t filt_re = CREAL(filt_vals[j]);
+            real_t filt_im = CIMAG(filt_vals[j]);
+            img_out.re[out_row + out_col] = img_fft.re[first + j]*filt_re - img_fft.im[first + j]*filt_im;
+            img_out.im[out_row + out_col] = img_fft.re[first + j]*filt_im + img_fft.im[first + j]*filt_re;
+            out_col++;
+            if (out_col == img_out.width){
+                out_col = 0;
+            }
+        }
+        filt_vals += span.length;
+
+    }
+
+    execute_fft_2d_split(img_out.re, img_out.im, img_out.re, img_out.im, img_out.height, img_out.width, img_out.stride, FFTW_BACKWARD);
+
+    parallel_for(img_out.height*img_out.stride, normalize_split_range, &op);
+
+}
+
+
+
+// Workspace bytes convolve_frequency_workspace() needs
+size_t convolve_workspace_size(const unsigned int height, const unsigned int width){
+
+    return image_block_size(height, width) + filter_block_size(height, width);
+
+}
+
+
+
+// Spectra come out of the workspace, which is left as it was found
+void convolve_frequency_workspace(const struct image_s img_in, struct image_s img_out, const struct filter_s filt, struct workspace_s* ws){
+
+    // get image dims
+    int height = img_in.height;
+    int width = img_in.width;
+
+    size_t mark = ws->used;
+
+    // Carve out the spectra
+    struct image_s img_fft = init_image_workspace(ws, height, width);
+    struct filter_s filt_fft = init_filter_workspace(ws, height, width);
+
+    // Execute the FFTs
+    fft_image(img_in, img_fft);
+    fft_filter(filt, filt_fft);
+
+    // Multiply and inverse transform
+    convolve_spectrum(img_fft, img_out, filt_fft);
+
+    // Hand the spectra back
+    ws->used = mark;
+
+}
+
+
+
+void convolve_frequency(const struct image_s img_in, struct image_s img_out, const struct filter_s filt){
+
+    struct workspace_s ws = init_workspace(convolve_workspace_size(img_in.height, img_in.width), 0);
+
+    convolve_frequency_workspace(img_in, img_out, filt, &ws);
+
+    free_workspace(&ws);
+
+}
+
+
+
+// Poles of a third order recursive Gaussian for sigma 2, from van Vliet, Young and Verbeek,
+// "Recursive Gaussian derivative filters" (1998), fitted for the least maximum error
+static const double complex recursive_gaussian_poles[3] = {1.40098 + 1.00236*(double complex)I, 1.40098 - 1.00236*(double complex)I, 1.85132};
+
+
+// Those poles scaled to another width, pole d goes to d^(1/q)
+static void scale_recursive_poles(const double q, double complex* poles){
+
+    for (int k = 0; k < 3; k++){
+        double complex d = recursive_gaussian_poles[k];
+        poles[k] = pow(cabs(d), 1/q)*cexp((double complex)I*carg(d)/q);
+    }
+
+}
+
+
+// Variance of the forward and backward passes with the given poles
+static double recursive_variance(const double complex* poles){
+
+    double complex var = 0;
+    for (int k = 0; k < 3; k++){
+        var += 2*poles[k]/((poles[k] - 1)*(poles[k] - 1));
+    }
+
+    return creal(var);
+
+}
+
+
+
+// A recursive Gaussian of the given sigma, times the carrier exp(i omega x). The carrier is folded into
+// the feedback: k samples back picks up exp(i k omega) going forwards and exp(-i k omega) going backwards,
+// which is the same as demodulating, smoothing and remodulating. gain is the sum of the kernel being
+// approximated, the Gaussian alone sums to one.
+struct recursive_filter_s init_recursive_gaussian(const double sigma, const double omega, const double gain){
+
+    // Scale the poles until the variance matches, it grows with q
+    double lo = 0.01;
+    double hi = 2*((sigma > 1) ? sigma : 1);
+    double complex poles[3];
+    for (int iter = 0; iter < 64; iter++){
+        double q = 0.5*(lo + hi);
+        scale_recursive_poles(q, poles);
+        if (recursive_variance(poles) < sigma*sigma){
+            lo = q;
+        }
+        else{
+            hi = q;
+        }
+    }
+    scale_recursive_poles(0.5*(lo + hi), poles);
+
+    // Expand 1/((1 - z^-1/d1)(1 - z^-1/d2)(1 - z^-1/d3)) into feedback coefficients, real as two poles are conjugate
+    double complex p1 = 1/poles[0], p2 = 1/poles[1], p3 = 1/poles[2];
+    double a[3];
+    a[0] = creal(p1 + p2 + p3);
+    a[1] = -creal(p1*p2 + p1*p3 + p2*p3);
+    a[2] = creal(p1*p2*p3);
+
+    struct recursive_filter_s filt;
+
+    // Unit DC gain per pass, the gain is shared between the two
+    filt.b = (1 - a[0] - a[1] - a[2])*sqrt(gain);
+
+    for (int k = 0; k < 3; k++){
+        filt.a_fwd[k] = a[k]*cexp((double complex)I*omega*(k + 1));
+        filt.a_bwd[k] = a[k]*cexp(-(double complex)I*omega*(k + 1));
+    }
+
+    // The Gaussian's spectrum at the carrier folded into (-pi, pi], which the poles only roughly match.
+    // Same closed form as init_gabor_spectrum_from_params().
+    double folded = carg(cexp((double complex)I*omega));
+    filt.dc = gain*exp(-0.5*sigma*sigma*folded*folded);
+
+    return filt;
+
+}
+
+
+
+static void matrix_multiply_3(double complex out[3][3], double complex x[3][3], double complex y[3][3]){
+
+    double complex prod[3][3];
+    for (int r = 0; r < 3; r++){
+        for (int c = 0; c < 3; c++){
+            prod[r][c] = x[r][0]*y[0][c] + x[r][1]*y[1][c] + x[r][2]*y[2][c];
+        }
+    }
+    memcpy(out, prod, sizeof(prod));
+
+}
+
+
+
+// Set up one direction of a recursive filter for periodic lines of length n
+static struct periodic_recursion_s init_periodic_recursion(const complex_t b, const complex_t* a, const unsigned int n){
+
+    struct periodic_recursion_s rec;
+    rec.weights[0] = b;
+    rec.weights[1] = a[0];
+    rec.weights[2] = a[1];
+    rec.weights[3] = a[2];
+
+    // Companion matrix, state (w[k-1], w[k-2], w[k-3]), and its nth power by squaring
+    double complex comp[3][3] = {{a[0], a[1], a[2]}, {1, 0, 0}, {0, 1, 0}};
+    double complex power[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    for (unsigned int e = n; e > 0; e >>= 1){
+        if (e & 1){
+            matrix_multiply_3(power, power, comp);
+        }
+        matrix_multiply_3(comp, comp, comp);
+    }
+
+    // Invert I - A^n through its adjugate, the poles are inside the unit circle so it is well conditioned
+    double complex m[3][3];
+    for (int r = 0; r < 3; r++){
+        for (int c = 0; c < 3; c++){
+            m[r][c] = (r == c) - power[r][c];
+        }
+    }
+    double complex det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                       - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                       + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    for (int r = 0; r < 3; r++){
+        for (int c = 0; c < 3; c++){
+            // Cofactor of m[c][r]
+            int r0 = (c + 1) % 3, r1 = (c + 2) % 3;
+            int c0 = (r + 1) % 3, c1 = (r + 2) % 3;
+            rec.start[r][c] = (m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0])/det;
+        }
+    }
+
+    return rec;
+
+}
+
+
+
+// One recursive pass along a line of n values step apart, in place, from the given state
+// (the three outputs before the first one). Returns the last three outputs as the next state.
+static void run_recursion_line(complex_t* line, const long step, const unsigned int n, const complex_t* weights, complex_t state[3], const int write){
+
+    complex_t w1 = state[0], w2 = state[1], w3 = state[2];
+    for (unsigned int k = 0; k < n; k++){
+        complex_t w = weights[0]*line[step*(long)k] + weights[1]*w1 + weights[2]*w2 + weights[3]*w3;
+        if (write){
+            line[step*(long)k] = w;
+        }
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+    }
+    state[0] = w1;
+    state[1] = w2;
+    state[2] = w3;
+
+}
+
+
+// Both passes along one periodic line: once from zero to find the state it wraps round to, then for real
+static void recursive_line(complex_t* line, const long step, const unsigned int n, const struct periodic_recursion_s* rec){
+
+    complex_t state[3] = {0, 0, 0};
+    run_recursion_line(line, step, n, rec->weights, state, 0);
+
+    complex_t start[3];
+    for (int r = 0; r < 3; r++){
+        start[r] = rec->start[r][0]*state[0] + rec->start[r][1]*state[1] + rec->start[r][2]*state[2];
+    }
+    run_recursion_line(line, step, n, rec->weights, start, 1);
+
+}
+
+
+// Over rows, forward then backward recursion along each row of out, read first from in or the
+// real rows in_re, in_stride apart, less offset. Each row is a serial recurrence, rows are independent.
+static void recursive_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+
+    for (unsigned int i = begin; i < end; i++){
+
+        complex_t* row = op->out + op->stride*i;
+        if (op->in == NULL){
+            for (unsigned int j = 0; j < op->width; j++){
+                row[j] = op->in_re[(size_t)op->in_stride*i + j] - op->offset;
+            }
+        }
+        else{
+            const complex_t* in_row = op->in + op->stride*i;
+            for (unsigned int j = 0; j < op->width; j++){
+                row[j] = in_row[j] - op->offset;
+            }
+        }
+
+        recursive_line(row, 1, op->width, op->forward);
+        recursive_line(row + op->width - 1, -1, op->width, op->backward);
+
+    }
+}
+
+
+// One direction down the columns [begin, end) of out, rows step apart, whole rows at a time so the
+// recurrence runs across the width in vectors. rows holds six scratch rows of end - begin values.
+static void recursive_column_pass(const struct array_op_s* op, const unsigned int begin, const unsigned int end, const int reverse, const struct periodic_recursion_s* rec, complex_t* rows){
+
+    unsigned int height = op->height;
+    unsigned int n = end - begin;
+    complex_t* warm[3] = {rows, rows + n, rows + 2*n};
+    complex_t* start[3] = {rows + 3*n, rows + 4*n, rows + 5*n};
+
+    // Row k of the pass, counting from whichever end it starts at
+    #define PASS_ROW(k) (op->out + op->stride*(reverse ? height - 1 - (k) : (k)) + begin)
+
+    // From zero, keeping the last three outputs in rotation
+    for (unsigned int t = 0; t < 3*n; t++){
+        rows[t] = 0;
+    }
+    for (unsigned int k = 0; k < height; k++){
+        const complex_t* ins[4] = {PASS_ROW(k), warm[(k + 2) % 3], warm[(k + 1) % 3], warm[k % 3]};
+        complex_weighted_sum(warm[k % 3], ins, rec->weights, 4, n);
+    }
+
+    // The state the periodic columns start with
+    const complex_t* last[3] = {warm[(height - 1) % 3], warm[(height + 1) % 3], warm[height % 3]};
+    for (int r = 0; r < 3; r++){
+        complex_weighted_sum(start[r], last, rec->start[r], 3, n);
+    }
+
+    // For real, in place, with the rows before the first taken from the start state
+    for (unsigned int k = 0; k < height; k++){
+        const complex_t* ins[4];
+        ins[0] = PASS_ROW(k);
+        for (unsigned int j = 1; j <= 3; j++){
+            ins[j] = (k >= j) ? PASS_ROW(k - j) : start[j - k - 1];
+        }
+        complex_weighted_sum(PASS_ROW(k), ins, rec->weights, 4, n);
+    }
+
+    #undef PASS_ROW
+
+}
+
+
+// Columns the vertical recursion carries down the image at once, small enough for its state to sit on the stack
+#define RECURSIVE_COLUMN_CHUNK 64
+
+
+// Over columns, forward then backward recursion down every column in [begin, end)
+static void recursive_columns(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+
+    complex_t rows[6*RECURSIVE_COLUMN_CHUNK];
+
+    for (unsigned int first = begin; first < end; first += RECURSIVE_COLUMN_CHUNK){
+        unsigned int last = (end - first > RECURSIVE_COLUMN_CHUNK) ? first + RECURSIVE_COLUMN_CHUNK : end;
+        recursive_column_pass(op, first, last, 0, op->forward, rows);
+        recursive_column_pass(op, first, last, 1, op->backward, rows);
+    }
+}
+
+
+// Adds offset to every value of out
+static void add_offset_rows(void* arg, const unsigned int begin, const unsigned int end){
+    struct array_op_s* op = (struct array_op_s*)arg;
+
+    for (unsigned int i = begin; i < end; i++){
+        complex_t* row = op->out + op->stride*i;
+        for (unsigned int j = 0; j < op->width; j++){
+            row[j] += op->offset;
+        }
+    }
+}
+
+
+// Rows then columns of a convolve_recursive*() call, op has in or in_re, out and the image mean in offset set.
+// The recursion only sees the image less its mean, the poles fit the Gaussian's tails poorly and would
+// leak DC through any axis without a carrier. The mean goes back in at the exact DC gain, row_filt.dc*col_filt.dc.
+static void recursive_passes(struct array_op_s* op, const struct recursive_filter_s row_filt, const struct recursive_filter_s col_filt){
+
+    struct periodic_recursion_s forward = init_periodic_recursion(row_filt.b, row_filt.a_fwd, op->width);
+    struct periodic_recursion_s backward = init_periodic_recursion(row_filt.b, row_filt.a_bwd, op->width);
+    op->forward = &forward;
+    op->backward = &backward;
+    parallel_for_rows(op->height, 16*op->width, recursive_rows, op);
+
+    forward = init_periodic_recursion(col_filt.b, col_filt.a_fwd, op->height);
+    backward = init_periodic_recursion(col_filt.b, col_filt.a_bwd, op->height);
+    parallel_for(op->width, recursive_columns, op);
+
+    op->offset *= row_filt.dc*col_filt.dc;
+    parallel_for_rows(op->height, op->width, add_offset_rows, op);
+
+}
+
+
+
+// Serially and in double, so the result doesn't depend on the thread count
+static complex_t image_mean(const struct image_s img){
+
+    double complex sum = 0;
+    for (unsigned int i = 0; i < img.height; i++){
+        for (unsigned int j = 0; j < img.width; j++){
+            sum += (double complex)img.vals[i][j];
+        }
+    }
+
+    return (complex_t)(sum/((double)img.height*img.width));
+
+}
+
+
+
+static real_t image_real_mean(const struct image_real_s img){
+
+    double sum = 0;
+    for (unsigned int i = 0; i < img.height; i++){
+        for (unsigned int j = 0; j < img.width; j++){
+            sum += (double)img.vals[i][j];
+        }
+    }
+
+    return (real_t)(sum/((double)img.height*img.width));
+
+}
+
+
+
+// Convolution with the outer product of two recursive filters, one along the rows and one down
+// the columns, wrapping around the edges like the frequency domain paths. Each pixel costs the same
+// few multiply-adds whatever the width of the Gaussians. img_out may be img_in.
+void convolve_recursive(const struct image_s img_in, struct image_s img_out, const struct recursive_filter_s row_filt, const struct recursive_filter_s col_filt){
+
+    struct array_op_s op;
+    op.in = img_in.raw_vals;
+    op.out = img_out.raw_vals;
+    op.height = img_in.height;
+    op.width = img_in.width;
+    op.stride = img_out.stride;
+    op.offset = image_mean(img_in);
+
+    recursive_passes(&op, row_filt, col_filt);
+
+}
+
+
+
+// Same as convolve_recursive(), for a real image
+void convolve_recursive_real(const struct image_real_s img_in, struct image_s img_out, const struct recursive_filter_s row_filt, const struct recursive_filter_s col_filt){
+
+    struct array_op_s op;
+    op.in = NULL;
+    op.in_re = img_in.raw_vals;
+    op.in_stride = img_in.stride;
+    op.out = img_out.raw_vals;
+    op.height = img_in.height;
+    op.width = img_in.width;
+    op.stride = img_out.stride;
+    op.offset = image_real_mean(img_in);
+
+    recursive_passes(&op, row_filt, col_filt);
+
+}
+
+
+
+// The second, column, pass of convolve_separable(), the rows are already in tmp
+static void convolve_separable_columns(const struct image_s tmp, struct image_s img_out, const struct separable_filter_s filt){
+
+    struct array_op_s op;
+    op.in = tmp.raw_vals;
+    op.out = img_out.raw_vals;
+    op.taps = filt.col;
+    op.radius = filt.radius_y;
+    op.height = img_out.height;
+    op.width = img_out.width;
+    op.stride = img_out.stride;
+    op.in_stride = tmp.stride;
+
+    parallel_for_rows(img_out.height, img_out.width*(2*filt.radius_y + 1), convolve_columns, &op);
+
+}
+
+
+// The row pass extends each row in place in tmp, so it needs 2*radius_x columns more than the image
+static void check_separable_tmp(const unsigned int height, const unsigned int width, const struct separable_filter_s filt, const struct image_s tmp){
+
+    if (tmp.height < height || tmp.width < width + 2*filt.radius_x){
+        fprintf(stderr, "Separable convolution needs a %ux%u tmp image\n", height, width + 2*filt.radius_x);
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+
+
+// Spatial convolution with a separable filter, wrapping around the edges the way the frequency
+// domain paths do. One 1D pass along the rows into tmp, then one down the columns into img_out,
+// so each pixel costs 2*(radius_x + radius_y + 1) multiply-adds instead of a whole 2D window.
+// tmp is as tall as the image and 2*filt.radius_x wider, the room the row pass works in, so
+// nothing is allocated here.
+void convolve_separable(const struct image_s img_in, struct image_s img_out, const struct separable_filter_s filt, struct image_s tmp){
+
+    check_separable_tmp(img_in.height, img_in.width, filt, tmp);
+
+    struct array_op_s op;
+    op.in = img_in.raw_vals;
+    op.out = tmp.raw_vals;
+    op.taps = filt.row;
+    op.radius = filt.radius_x;
+    op.height = img_in.height;
+    op.width = img_in.width;
+    op.stride = tmp.stride;
+    op.in_stride = img_in.stride;
+
+    parallel_for_rows(img_in.height, img_in.width*(2*filt.radius_x + 1), convolve_rows, &op);
+
+    convolve_separable_columns(tmp, img_out, filt);
+
+}
+
+
+
+// Same as convolve_separable(), for a real image
+void convolve_separable_real(const struct image_real_s img_in, struct image_s img_out, const struct separable_filter_s filt, struct image_s tmp){
+
+    check_separable_tmp(img_in.height, img_in.width, filt, tmp);
+
+    struct array_op_s op;
+    op.in = NULL;
+    op.in_re = img_in.raw_vals;
+    op.out = tmp.raw_vals;
+    op.taps = filt.row;
+    op.radius = filt.radius_x;
+    op.height = img_in.height;
+    op.width = img_in.width;
+    op.stride = tmp.stride;
+    op.in_stride = img_in.stride;
+
+    parallel_for_rows(img_in.height, img_in.width*(2*filt.radius_x + 1), convolve_rows, &op);
+
+    convolve_separable_columns(tmp, img_out, filt);
+
+}
+
+
+
+// This is as unoptomized as the American Congress.
+// Reference for the other paths: the whole filter window at every pixel, wrapping around the edges.
 void convolve_spatial(const struct image_s img_in, struct image_s img_out, const struct filter_s filt){
 
     // Find the center pixel
@@ -127,7 +1727,6 @@ void convolve_spatial(const struct image_s img_in, struct image_s img_out, const
 
     // iterate over each image pixel
     for (unsigned int i = 0; i < img_in.height; i++){
-        printf("%u\n", i);
         for (unsigned int j = 0; j < img_in.width; j++){
 
             img_out.vals[i][j] = 0;
@@ -136,10 +1735,10 @@ void convolve_spatial(const struct image_s img_in, struct image_s img_out, const
             for (unsigned int m = 0; m < filt.height; m++){
                 for (unsigned int n = 0; n < filt.width; n++){
 
-                    // Convolve
-                    int img_x = ((n - center_x) + j) % img_in.width;
-                    int img_y = ((m - center_y) + i) % img_in.height;
-                    img_out.vals[i][j] += img_in.vals[img_x][img_y] * filt.vals[m][n];
+                    // Convolve, wrapping around the edges
+                    int img_x = (((int)j - ((int)n - center_x)) % (int)img_in.width + (int)img_in.width) % (int)img_in.width;
+                    int img_y = (((int)i - ((int)m - center_y)) % (int)img_in.height + (int)img_in.height) % (int)img_in.height;
+                    img_out.vals[i][j] += img_in.vals[img_y][img_x] * filt.vals[m][n];
 
                 }
             }
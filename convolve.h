@@ -3,12 +3,87 @@
 
 #include "types.h"
 
+// Wisdom is per precision, so the two builds keep separate files
+#ifdef GABOR_SINGLE
+#define DEFAULT_WISDOM_PATH "gabor_single.wisdom"
+#else
+#define DEFAULT_WISDOM_PATH "gabor.wisdom"
+#endif
+
+void execute_fft_2d(complex_t* in, complex_t* out, const unsigned int height, const unsigned int width, const unsigned int stride, const int direction);
+
+void execute_fft_2d_batch(complex_t* vals, const unsigned int count, const unsigned int height, const unsigned int width, const unsigned int stride, const int direction);
+
+void execute_fft_2d_r2c(real_t* in, complex_t* out, const unsigned int height, const unsigned int width, const unsigned int in_stride, const unsigned int stride);
+
+void execute_fft_2d_r2c_batch(real_t* in, complex_t* out, const unsigned int count, const unsigned int height, const unsigned int width, const unsigned int in_stride, const unsigned int stride);
+
+void execute_fft_2d_split(real_t* in_re, real_t* in_im, real_t* out_re, real_t* out_im, const unsigned int height, const unsigned int width, const unsigned int stride, const int direction);
+
+void execute_fft_2d_r2c_split(real_t* in, real_t* out_re, real_t* out_im, const unsigned int height, const unsigned int width, const unsigned int in_stride, const unsigned int stride);
+
+void fftshift_2d(complex_t* vals, const unsigned int height, const unsigned int width, const unsigned int stride);
+
+void ifftshift_2d(complex_t* vals, const unsigned int height, const unsigned int width, const unsigned int stride);
+
 void shift_filter(struct filter_s filt);
 
+void fft_image(const struct image_s img_in, struct image_s img_fft);
+
+void fft_image_real(const struct image_real_s img_in, struct image_s img_fft);
+
+void fft_image_real_split(const struct image_real_s img_in, struct image_split_s img_fft);
+
+void fft_filter(const struct filter_s filt_in, struct filter_s filt_fft);
+
+void fft_filter_phase(const struct filter_s filt_in, struct filter_s filt_fft);
+
+void convolve_spectrum(const struct image_s img_fft, struct image_s img_out, const struct filter_s filt_fft);
+
+void convolve_spectrum_sparse(const struct image_s img_fft, struct image_s img_out, const struct sparse_spectrum_s filt_fft);
+
+size_t convolve_batch_size(const unsigned int height, const unsigned int width, const unsigned int count);
+
+void convolve_spectrum_sparse_batch(const struct image_s img_fft, struct image_s* img_out, const struct sparse_spectrum_s* filt_fft, const unsigned int count, complex_t* batch);
+
+void convolve_spectrum_decimated(const struct image_s img_fft, struct image_s img_out, const struct sparse_spectrum_s filt_fft, const struct subband_s band);
+
+void convolve_spectrum_split(const struct image_split_s img_fft, struct image_split_s img_out, const struct filter_s filt_fft);
+
+void convolve_spectrum_sparse_split(const struct image_split_s img_fft, struct image_split_s img_out, const struct sparse_spectrum_s filt_fft);
+
+void convolve_spectrum_decimated_split(const struct image_split_s img_fft, struct image_split_s img_out, const struct sparse_spectrum_s filt_fft, const struct subband_s band);
+
+size_t convolve_workspace_size(const unsigned int height, const unsigned int width);
+
+void convolve_frequency_workspace(const struct image_s img_in, struct image_s img_out, const struct filter_s filt, struct workspace_s* ws);
+
 void convolve_frequency(const struct image_s img_in, struct image_s img_out, const struct filter_s filt);
 
+void set_transform_threads(const unsigned int num_threads);
+
+void set_plan_rigor(const unsigned int rigor);
+
+int parse_plan_rigor(const char* const name, unsigned int* rigor);
+
+int load_fftw_wisdom(const char* const path);
+
+int save_fftw_wisdom(const char* const path);
+
+void prepare_fft_plans(const unsigned int height, const unsigned int width);
+
 void cleanup_fftw();
 
+void convolve_separable(const struct image_s img_in, struct image_s img_out, const struct separable_filter_s filt, struct image_s tmp);
+
+void convolve_separable_real(const struct image_real_s img_in, struct image_s img_out, const struct separable_filter_s filt, struct image_s tmp);
+
+struct recursive_filter_s init_recursive_gaussian(const double sigma, const double omega, const double gain);
+
+void convolve_recursive(const struct image_s img_in, struct image_s img_out, const struct recursive_filter_s row_filt, const struct recursive_filter_s col_filt);
+
+void convolve_recursive_real(const struct image_real_s img_in, struct image_s img_out, const struct recursive_filter_s row_filt, const struct recursive_filter_s col_filt);
+
 void convolve_spatial(struct image_s img_in, struct image_s img_out, struct filter_s filt);
 
 #endif
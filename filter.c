@@ -1,5 +1,6 @@
 #include "filter.h"
 #include "types.h"
+#include "workspace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,29 +8,36 @@
 #include <complex.h>
 #include <fftw3.h>
 
-struct filter_s init_filter_empty(const unsigned int height, const unsigned int width){
+// Bytes for a filter, padded rows included, and its row pointers, which share one block
+size_t filter_block_size(const unsigned int height, const unsigned int width){
+
+    return WORKSPACE_ROUND(padded_row_stride(width, sizeof(complex_t))*height*sizeof(complex_t)) + WORKSPACE_ROUND(height*sizeof(complex_t*));
+
+}
+
+
+
+static struct filter_s wrap_filter(void* block, const unsigned int height, const unsigned int width){
 
     struct filter_s filt;
 
     filt.width = width;
     filt.height = height;
+    filt.stride = padded_row_stride(width, sizeof(complex_t));
 
-
-    // Allocate the filter array
-    filt.raw_vals = (double complex*)fftw_malloc(width*height*sizeof(double complex));
-    if (filt.raw_vals == NULL){
-        fprintf(stderr, "Malloc failed\n");
-        exit(EXIT_FAILURE);
-    }
+    filt.raw_vals = (complex_t*)block;
 
     // Make an array of pointers into each row for 2d indexing
-    filt.vals = (double complex**)malloc(height*sizeof(double complex*));
-    if (filt.vals == NULL){
-        fprintf(stderr, "Malloc failed\n");
-        exit(EXIT_FAILURE);
+    filt.vals = (complex_t**)((char*)block + WORKSPACE_ROUND(filt.stride*height*sizeof(complex_t)));
+    for (unsigned int i = 0; i < height; i++){
+        filt.vals[i] = filt.raw_vals + filt.stride*i;
     }
+
+    // Padding is never written, keep it zero so whole row loops can include it
     for (unsigned int i = 0; i < height; i++){
-        filt.vals[i] = filt.raw_vals + filt.width*i;
+        for (unsigned int j = width; j < filt.stride; j++){
+            filt.vals[i][j] = 0;
+        }
     }
 
     return filt;
@@ -38,6 +46,30 @@ struct filter_s init_filter_empty(const unsigned int height, const unsigned int
 
 
 
+struct filter_s init_filter_empty(const unsigned int height, const unsigned int width){
+
+    // Allocate the filter array, with the row pointers after it
+    void* block = FFTW(malloc)(filter_block_size(height, width));
+    if (block == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return wrap_filter(block, height, width);
+
+}
+
+
+
+// Lives until the workspace is reset, don't free_filter() it
+struct filter_s init_filter_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width){
+
+    return wrap_filter(workspace_alloc(ws, filter_block_size(height, width)), height, width);
+
+}
+
+
+
 
 
 struct filter_s init_filter_gaussian(const unsigned int height, const unsigned int width, const double sigma){
@@ -63,14 +95,16 @@ struct filter_s init_filter_gaussian(const unsigned int height, const unsigned i
             // Build the filter
             filt.vals[i][j] = cexp(-1 * (pow(x, 2) + pow(y,2))/(2 * pow(sigma, 2)));
 
-            sum += filt.vals[i][j];
+            sum += (double)CREAL(filt.vals[i][j]);
 
         }
     }
 
     // Normalize the filter
-    for (int i = 0; i < filt.height * filt.width; i++){
-        filt.raw_vals[i] /= sum;
+    for (int i = 0; i < filt.height; i++){
+        for (int j = 0; j < filt.width; j++){
+            filt.vals[i][j] /= (real_t)sum;
+        }
     }
 
     return filt;
@@ -83,11 +117,169 @@ struct filter_s init_filter_gaussian(const unsigned int height, const unsigned i
 
 void free_filter(struct filter_s filt){
 
-    fftw_free(filt.raw_vals);
-    free(filt.vals);
+    FFTW(free)(filt.raw_vals);
     filt.raw_vals = NULL;
     filt.vals = NULL;
 
 }
 
 
+
+
+
+// Bytes for the taps of a separable filter, column then row
+size_t separable_filter_block_size(const unsigned int radius_y, const unsigned int radius_x){
+
+    return WORKSPACE_ROUND((2*radius_y + 1)*sizeof(complex_t)) + WORKSPACE_ROUND((2*radius_x + 1)*sizeof(complex_t));
+
+}
+
+
+
+static struct separable_filter_s wrap_separable_filter(void* block, const unsigned int radius_y, const unsigned int radius_x){
+
+    struct separable_filter_s filt;
+
+    filt.radius_y = radius_y;
+    filt.radius_x = radius_x;
+    filt.col = (complex_t*)block;
+    filt.row = (complex_t*)((char*)block + WORKSPACE_ROUND((2*radius_y + 1)*sizeof(complex_t)));
+
+    for (unsigned int t = 0; t < 2*radius_y + 1; t++){
+        filt.col[t] = 0;
+    }
+    for (unsigned int t = 0; t < 2*radius_x + 1; t++){
+        filt.row[t] = 0;
+    }
+
+    return filt;
+
+}
+
+
+
+// The radii are the most taps it holds, they can be lowered afterwards
+struct separable_filter_s init_separable_filter_empty(const unsigned int radius_y, const unsigned int radius_x){
+
+    void* block = malloc(separable_filter_block_size(radius_y, radius_x));
+    if (block == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return wrap_separable_filter(block, radius_y, radius_x);
+
+}
+
+
+
+// Lives until the workspace is reset, don't free_separable_filter() it
+struct separable_filter_s init_separable_filter_workspace(struct workspace_s* ws, const unsigned int radius_y, const unsigned int radius_x){
+
+    return wrap_separable_filter(workspace_alloc(ws, separable_filter_block_size(radius_y, radius_x)), radius_y, radius_x);
+
+}
+
+
+
+void free_separable_filter(struct separable_filter_s filt){
+
+    free(filt.col);
+    filt.col = NULL;
+    filt.row = NULL;
+
+}
+
+
+
+
+
+// Keep only the bins of a spectrum whose magnitude is above threshold*peak.
+// Gabor spectra are compact Gaussians, so this is usually a small fraction of the plane.
+struct sparse_spectrum_s init_sparse_spectrum(const struct filter_s filt_fft, const double threshold){
+
+    struct sparse_spectrum_s spec;
+
+    spec.height = filt_fft.height;
+    spec.width = filt_fft.width;
+
+    // Find the peak
+    real_t max_val = 0;
+    for (unsigned int i = 0; i < filt_fft.height; i++){
+        for (unsigned int j = 0; j < filt_fft.width; j++){
+            if (CABS(filt_fft.vals[i][j]) > max_val){
+                max_val = CABS(filt_fft.vals[i][j]);
+            }
+        }
+    }
+    real_t cutoff = (real_t)threshold*max_val;
+
+    // Count the spans and kept bins
+    spec.num_spans = 0;
+    spec.num_vals = 0;
+    for (unsigned int i = 0; i < filt_fft.height; i++){
+        int in_span = 0;
+        for (unsigned int j = 0; j < filt_fft.width; j++){
+            int keep = CABS(filt_fft.vals[i][j]) > cutoff;
+            if (keep && !in_span){
+                spec.num_spans++;
+            }
+            spec.num_vals += keep;
+            in_span = keep;
+        }
+    }
+
+    // One spare entry each so an all-zero spectrum still gets valid pointers
+    spec.spans = (struct spectrum_span_s*)malloc((spec.num_spans + 1)*sizeof(struct spectrum_span_s));
+    if (spec.spans == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    spec.vals = (complex_t*)FFTW(malloc)((spec.num_vals + 1)*sizeof(complex_t));
+    if (spec.vals == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Record the spans and pack their values
+    unsigned int s = 0;
+    unsigned int v = 0;
+    for (unsigned int i = 0; i < filt_fft.height; i++){
+        int in_span = 0;
+        for (unsigned int j = 0; j < filt_fft.width; j++){
+            int keep = CABS(filt_fft.vals[i][j]) > cutoff;
+            if (keep){
+                if (!in_span){
+                    spec.spans[s].row = i;
+                    spec.spans[s].start = j;
+                    spec.spans[s].length = 0;
+                    spec.spans[s].offset = v;
+                    s++;
+                }
+                spec.spans[s-1].length++;
+                spec.vals[v] = filt_fft.vals[i][j];
+                v++;
+            }
+            in_span = keep;
+        }
+    }
+
+    return spec;
+
+}
+
+
+
+
+
+
+void free_sparse_spectrum(struct sparse_spectrum_s spec){
+
+    FFTW(free)(spec.vals);
+    free(spec.spans);
+    spec.vals = NULL;
+    spec.spans = NULL;
+
+}
+
+
@@ -3,11 +3,27 @@
 
 #include "types.h"
 
+size_t filter_block_size(const unsigned int height, const unsigned int width);
+
 struct filter_s init_filter_empty(const unsigned int height, const unsigned int width);
 
+struct filter_s init_filter_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width);
+
 struct filter_s init_filter_gaussian(const unsigned int height, const unsigned int width, const double sigma);
 
 void free_filter(struct filter_s filt);
 
+size_t separable_filter_block_size(const unsigned int radius_y, const unsigned int radius_x);
+
+struct separable_filter_s init_separable_filter_empty(const unsigned int radius_y, const unsigned int radius_x);
+
+struct separable_filter_s init_separable_filter_workspace(struct workspace_s* ws, const unsigned int radius_y, const unsigned int radius_x);
+
+void free_separable_filter(struct separable_filter_s filt);
+
+struct sparse_spectrum_s init_sparse_spectrum(const struct filter_s filt_fft, const double threshold);
+
+void free_sparse_spectrum(struct sparse_spectrum_s spec);
+
 
 #endif
@@ -1,11 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "gabor.h"
 #include "convolve.h"
 #include "filter.h"
 #include "image.h"
+#include "threadpool.h"
+#include "bankcache.h"
+#include "workspace.h"
+#include "kernels.h"
 
 #include <FreeImage.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <complex.h>
 #include <fftw3.h>
@@ -23,6 +30,20 @@ struct gabor_filter_bank_s init_gabor_filter_bank_default(const unsigned int hei
     bank.height = height;
     bank.width = width;
     bank.num_filters = num_filters;
+    bank.spectrum_threshold = 1e-6;
+    bank.spectra = NULL;
+    bank.subbands = NULL;
+    bank.decimate = 0;
+    bank.phase_shift = 0;
+    bank.split = 0;
+    bank.block_size = 1;
+    bank.spatial_sigmas = 4;
+    bank.spatial_max_radius = 0;
+    bank.recursive_min_sigma = 0;
+    bank.engines = NULL;
+    bank.pool = NULL;
+    bank.cache_map = NULL;
+    bank.cache_size = 0;
 
     // Allocate the arrays within the filter bank
     bank.angles = (double*)malloc(num_filters*sizeof(double));
@@ -90,6 +111,20 @@ struct gabor_filter_bank_s init_gabor_filter_bank_exhaustive(const unsigned int
     bank.height = height;
     bank.width = width;
     bank.num_filters = num_filters;
+    bank.spectrum_threshold = 1e-6;
+    bank.spectra = NULL;
+    bank.subbands = NULL;
+    bank.decimate = 0;
+    bank.phase_shift = 0;
+    bank.split = 0;
+    bank.block_size = 1;
+    bank.spatial_sigmas = 4;
+    bank.spatial_max_radius = 0;
+    bank.recursive_min_sigma = 0;
+    bank.engines = NULL;
+    bank.pool = NULL;
+    bank.cache_map = NULL;
+    bank.cache_size = 0;
 
     // Allocate the arrays within the filter bank
     bank.angles = (double*)malloc(num_filters*sizeof(double));
@@ -153,6 +188,8 @@ struct gabor_responses_s init_gabor_responses_empty(const unsigned int height, c
 
     struct gabor_responses_s resps;
     resps.num_channels = num_filters;
+    resps.subbands = NULL;
+    resps.split_channels = NULL;
 
     resps.channels = (struct image_s*)malloc(num_filters*sizeof(struct image_s));
         if (resps.channels == NULL){
@@ -173,62 +210,123 @@ struct gabor_responses_s init_gabor_responses_empty(const unsigned int height, c
 
 
 
-struct gabor_responses_s apply_gabor_filter_bank(struct image_s img, struct gabor_filter_bank_s bank){
+// Find the smallest grid, with dimensions dividing the image, that holds a passband without aliasing.
+// Distances are measured around the peak bin with wraparound, so passbands crossing the edges are fine.
+static unsigned int find_decimation(const unsigned int size, const unsigned int max_dist){
 
-    struct gabor_responses_s resps;
+    unsigned int decimation = 1;
 
-    resps = init_gabor_responses_empty(bank.height, bank.width, bank.num_filters);
+    for (unsigned int d = 1; d <= size; d++){
+        if (size % d == 0 && size/d >= 2*max_dist + 1){
+            decimation = d;
+        }
+    }
 
+    return decimation;
 
-    for (unsigned int i = 0; i < bank.num_filters; i++){
+}
 
-        struct filter_s filt = init_gabor_filter_from_bank(bank, i);
 
-        convolve_frequency(img, resps.channels[i], filt);
+static struct subband_s init_subband_from_spectrum(const struct sparse_spectrum_s spec){
 
-        free_filter(filt);
+    struct subband_s band;
 
+    band.full_height = spec.height;
+    band.full_width = spec.width;
+    band.center_y = 0;
+    band.center_x = 0;
+
+    // Find the peak bin
+    real_t max_val = -1;
+    unsigned int v = 0;
+    for (unsigned int s = 0; s < spec.num_spans; s++){
+        for (unsigned int j = 0; j < spec.spans[s].length; j++){
+            if (CABS(spec.vals[v]) > max_val){
+                max_val = CABS(spec.vals[v]);
+                band.center_y = spec.spans[s].row;
+                band.center_x = spec.spans[s].start + j;
+            }
+            v++;
+        }
     }
 
-    return resps;
+    // Find how far the passband reaches from it
+    unsigned int max_dist_y = 0;
+    unsigned int max_dist_x = 0;
+    for (unsigned int s = 0; s < spec.num_spans; s++){
+        for (unsigned int j = 0; j < spec.spans[s].length; j++){
+
+            unsigned int dist_y = (spec.spans[s].row + spec.height - band.center_y) % spec.height;
+            unsigned int dist_x = (spec.spans[s].start + j + spec.width - band.center_x) % spec.width;
+            if (dist_y > spec.height/2){
+                dist_y = spec.height - dist_y;
+            }
+            if (dist_x > spec.width/2){
+                dist_x = spec.width - dist_x;
+            }
+
+            if (dist_y > max_dist_y){
+                max_dist_y = dist_y;
+            }
+            if (dist_x > max_dist_x){
+                max_dist_x = dist_x;
+            }
+
+        }
+    }
+
+    band.decimation_y = find_decimation(spec.height, max_dist_y);
+    band.decimation_x = find_decimation(spec.width, max_dist_x);
+
+    return band;
 
 }
 
 
 
+static void compile_filter_task(void* arg, const unsigned int f, const unsigned int thread_num){
 
+    struct gabor_filter_bank_s* bank = (struct gabor_filter_bank_s*)arg;
 
+    struct filter_s filt_fft = init_gabor_spectrum_from_bank(*bank, f);
 
-struct filter_s init_gabor_filter_from_params(const double freq, const double angle, const double sigma, const unsigned int filt_height, const unsigned int filt_width){
+    // Only the passband is kept
+    bank->spectra[f] = init_sparse_spectrum(filt_fft, bank->spectrum_threshold);
+    bank->subbands[f] = init_subband_from_spectrum(bank->spectra[f]);
 
-    struct filter_s filt;
+    free_filter(filt_fft);
 
-    // Initialize the filter
-    filt = init_filter_empty(filt_height, filt_width);
+}
 
-    // Find the center pixel
-    int center_x = filt.width/2;
-    int center_y = filt.height/2;
 
-    // Populate the filter with proper values (http://en.wikipedia.org/wiki/Gabor_filter)
-    for (int i = 0; i < filt.height; i++){
-        for (int j = 0; j < filt.width; j++){
 
-            double x_shift = j - center_x;
-            double y_shift = i - center_y;
+// Build every filter's spectrum once so that applying the bank only multiplies and inverse transforms.
+// The spectra are generated analytically, so this costs no FFTs and banks can be swapped cheaply.
+// The bank keeps a pool of num_threads workers, which later applications of the bank also use.
+struct gabor_filter_bank_s compile_gabor_filter_bank(struct gabor_filter_bank_s bank, const unsigned int num_threads){
 
-            double x = x_shift*cos(angle) + y_shift*sin(angle);
-            double y = y_shift*cos(angle) - x_shift*sin(angle);
+    if (bank.spectra != NULL){
+        return bank;
+    }
 
-            // Build the filter
-            //filt.vals[i][j] = pow(freq*sqrt(PI)/(3*sqrt(log(2))),2)*cexp(-1 * (pow(x, 2) + pow(y,2))/(2 * pow(sigma, 2))) * cexp((double complex)I*2*PI*freq*x);
-            filt.vals[i][j] = (1/pow(sigma,2))*cexp(-1 * (pow(x, 2) + pow(y,2))/(2 * pow(sigma, 2))) * cexp((double complex)I*2*PI*freq*x);
-            //filt.vals[i][j] = cexp((double complex)I*2*PI*freq*x);
+    bank.spectra = (struct sparse_spectrum_s*)malloc(bank.num_filters*sizeof(struct sparse_spectrum_s));
+    if (bank.spectra == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    bank.subbands = (struct subband_s*)malloc(bank.num_filters*sizeof(struct subband_s));
+    if (bank.subbands == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-        }
+    if (num_threads > 1 && bank.pool == NULL){
+        bank.pool = init_thread_pool(num_threads);
     }
 
-    return filt;
+    run_thread_pool(bank.pool, bank.num_filters, compile_filter_task, &bank);
+
+    return bank;
 
 }
 
@@ -237,184 +335,1562 @@ struct filter_s init_gabor_filter_from_params(const double freq, const double an
 
 
 
-struct filter_s init_gabor_filter_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num){
+// Taps either side of the centre for a kernel truncated at num_sigmas, no more than fit in size
+static unsigned int separable_radius(const double sigma, const double num_sigmas, const unsigned int size){
 
-    return init_gabor_filter_from_params(bank.freqs[filter_num], bank.angles[filter_num], bank.sigmas[filter_num], bank.height, bank.width);
+    unsigned int radius = (unsigned int)ceil(num_sigmas*sigma);
+    unsigned int max_radius = (size > 0) ? (size - 1)/2 : 0;
+
+    return (radius < max_radius) ? radius : max_radius;
 
 }
 
 
 
+// The Gabor in init_gabor_filter_from_params() is a Gaussian envelope times a plane wave.
+// Both factor over x and y, so it is the outer product of two 1D complex kernels:
+//     (1/sigma^2) exp(-x^2/2sigma^2) exp(i 2pi freq cos(angle) x)  along a row
+//     exp(-y^2/2sigma^2) exp(i 2pi freq sin(angle) y)              down the columns
+// Fills as many taps as filt's radii say.
+static void set_gabor_separable_taps(const double freq, const double angle, const double sigma, const struct separable_filter_s filt){
 
+    for (int t = 0; t < 2*(int)filt.radius_y + 1; t++){
+        double y = t - (int)filt.radius_y;
+        filt.col[t] = exp(-(y*y)/(2*sigma*sigma)) * cexp((double complex)I*2*PI*freq*sin(angle)*y);
+    }
 
-struct image_s reconstruct_image_from_responses(struct gabor_responses_s resps){
+    for (int t = 0; t < 2*(int)filt.radius_x + 1; t++){
+        double x = t - (int)filt.radius_x;
+        filt.row[t] = (1/(sigma*sigma)) * exp(-(x*x)/(2*sigma*sigma)) * cexp((double complex)I*2*PI*freq*cos(angle)*x);
+    }
 
-    struct image_s img;
+}
 
-    unsigned int height = resps.channels[0].height;
-    unsigned int width = resps.channels[0].width;
 
 
-    img = init_image_empty(height, width);
+// Spatial filters need the image at full resolution and interleaved, and sit outside batched blocks
+static int is_spatial(const struct gabor_filter_bank_s bank, const unsigned int i){
+
+    if (bank.split || (bank.decimate && bank.spectra != NULL) || (bank.block_size > 1 && bank.spectra != NULL)){
+        return 0;
+    }
+
+    if (bank.engines != NULL){
+        return bank.engines[i] == GABOR_ENGINE_SEPARABLE;
+    }
+
+    return bank.spatial_max_radius > 0 && ceil(bank.spatial_sigmas*bank.sigmas[i]) <= bank.spatial_max_radius;
+
+}
+
+
+
+// Wide filters: recursive Gaussians, under the same conditions as the spatial path.
+// Narrow filters are better off spatial, the recursive fit is poor below a sigma of a few pixels.
+static int is_recursive(const struct gabor_filter_bank_s bank, const unsigned int i){
+
+    if (bank.split || (bank.decimate && bank.spectra != NULL) || (bank.block_size > 1 && bank.spectra != NULL)){
+        return 0;
+    }
+
+    if (bank.engines != NULL){
+        return bank.engines[i] == GABOR_ENGINE_RECURSIVE;
+    }
+
+    return bank.recursive_min_sigma > 0 && !is_spatial(bank, i) && bank.sigmas[i] >= bank.recursive_min_sigma;
+
+}
 
-    // Zero out the image
-    for (unsigned int i = 0; i < height; i++){
-        for (unsigned int j = 0; j < width; j++){
-            img.vals[j][i] = 0;
+
+
+// The row and column recursive filters whose outer product approximates filter i.
+// Each gain is the sum of that 1D factor of the Gabor from set_gabor_separable_taps().
+static void set_gabor_recursive(const struct gabor_filter_bank_s bank, const unsigned int i, struct recursive_filter_s* row_filt, struct recursive_filter_s* col_filt){
+
+    double sigma = bank.sigmas[i];
+    *row_filt = init_recursive_gaussian(sigma, 2*PI*bank.freqs[i]*cos(bank.angles[i]), sqrt(2*PI)/sigma);
+    *col_filt = init_recursive_gaussian(sigma, 2*PI*bank.freqs[i]*sin(bank.angles[i]), sqrt(2*PI)*sigma);
+
+}
+
+
+
+// Whether any filter goes spatially, and whether any still needs the image spectrum
+static int has_spatial(const struct gabor_filter_bank_s bank){
+
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        if (is_spatial(bank, i)){
+            return 1;
         }
     }
 
+    return 0;
 
-    // Sum each channel into the image
-    for (unsigned int c = 0; c < resps.num_channels; c++){
+}
 
-        for (unsigned int i = 0; i < height; i++){
-            for (unsigned int j = 0; j < width; j++){
-                img.vals[j][i] += creal(resps.channels[c].vals[j][i]);
-            }
+
+// Taps every spatial filter fits in, along either axis
+static unsigned int spatial_taps_radius(const struct gabor_filter_bank_s bank){
+
+    unsigned int radius = 0;
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        if (is_spatial(bank, i)){
+            unsigned int radius_y = separable_radius(bank.sigmas[i], bank.spatial_sigmas, bank.height);
+            unsigned int radius_x = separable_radius(bank.sigmas[i], bank.spatial_sigmas, bank.width);
+            radius = (radius_y > radius) ? radius_y : radius;
+            radius = (radius_x > radius) ? radius_x : radius;
         }
+    }
+
+    return radius;
+
+}
+
 
+static int needs_spectrum(const struct gabor_filter_bank_s bank){
+
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        if (!is_spatial(bank, i) && !is_recursive(bank, i)){
+            return 1;
+        }
     }
 
-    return img;
+    return 0;
 
 }
 
 
 
+// Spectrum of filter i of an uncompiled bank, into filt_fft
+static void build_filter_spectrum(const struct gabor_filter_bank_s bank, const unsigned int i, struct filter_s filt_fft){
 
+    struct filter_s filt = init_gabor_filter_from_bank(bank, i);
+    if (bank.phase_shift){
+        fft_filter_phase(filt, filt_fft);
+    }
+    else{
+        fft_filter(filt, filt_fft);
+    }
+    free_filter(filt);
 
+}
 
 
 
+// Everything a thread needs to produce one response channel
+struct apply_job_s{
+    struct image_s img_fft;
+    struct gabor_filter_bank_s bank;
+    struct gabor_responses_s resps;
+    const struct image_real_s* img;     // The image itself for filters convolved spatially, NULL if only the spectrum is known
+    struct filter_s* scratch;           // One filter spectrum per thread, only for uncompiled banks
+    complex_t** batches;                // One batch buffer per thread, only when batching
+    struct separable_filter_s* taps;    // Per thread taps and row pass output, only when some filters are spatial
+    struct image_s* spatial_tmp;
+};
 
-void disp_gabor_filter_bank(struct gabor_filter_bank_s bank, const char* const prefix){
 
-    FILE* fid = fopen("filterdata.csv", "w");
+static void apply_filter_task(void* arg, const unsigned int i, const unsigned int thread_num){
 
-    // get image dims
-    const unsigned int height = 512;
-    const unsigned int width = 512;
+    struct apply_job_s* job = (struct apply_job_s*)arg;
+    struct gabor_filter_bank_s bank = job->bank;
 
-    // Allocate all needed images
-    struct image_s img = init_image_empty(height, width);
-    struct filter_s filt = init_filter_empty(height, width);
-    struct filter_s filt_fft = init_filter_empty(height, width);
+    // Small kernels: two 1D passes over the image itself
+    if (job->img != NULL && is_spatial(bank, i)){
 
-    fftw_plan filt_plan = fftw_plan_dft_2d(height, width, filt.raw_vals, filt_fft.raw_vals, FFTW_FORWARD, FFTW_MEASURE);
+        // The thread's taps have room for the widest spatial filter
+        struct separable_filter_s taps = job->taps[thread_num];
+        taps.radius_y = separable_radius(bank.sigmas[i], bank.spatial_sigmas, bank.height);
+        taps.radius_x = separable_radius(bank.sigmas[i], bank.spatial_sigmas, bank.width);
+        set_gabor_separable_taps(bank.freqs[i], bank.angles[i], bank.sigmas[i], taps);
 
-    char filtname[200];
+        convolve_separable_real(*job->img, job->resps.channels[i], taps, job->spatial_tmp[thread_num]);
 
-    for (unsigned int f = 0; f < bank.num_filters; f++){
+    }
+    // Wide kernels: forward and backward recursions over the image, whatever the sigma
+    else if (job->img != NULL && is_recursive(bank, i)){
 
-        double max_val = DBL_MIN;
+        struct recursive_filter_s row_filt, col_filt;
+        set_gabor_recursive(bank, i, &row_filt, &col_filt);
 
-        fprintf(fid, "%u,%f,%f,%f\n",f, bank.freqs[f], bank.angles[f], bank.sigmas[f]);
+        convolve_recursive_real(*job->img, job->resps.channels[i], row_filt, col_filt);
 
-        // initialize a temporary filter
-        struct filter_s temp_filt = init_gabor_filter_from_params(bank.freqs[f], bank.angles[f], bank.sigmas[f], height, width);
+    }
+    // Critically sampled: crop the passband and inverse transform on the smaller grid
+    else if (job->resps.subbands != NULL){
 
-        // Load it in
-        for (unsigned int i = 0; i < width*height; i++){
-            filt.raw_vals[i] = creal(temp_filt.raw_vals[i]);
-        }
+        convolve_spectrum_decimated(job->img_fft, job->resps.channels[i], bank.spectra[i], bank.subbands[i]);
 
-        snprintf(filtname, 200, "%s_%u", prefix, f);
-        save_image_autoscale(*((struct image_s*)&filt), filtname);
+    }
+    // Multiply and inverse transform straight into the response channel
+    else if (bank.spectra != NULL){
 
-        // Shift the filter
-        shift_filter(filt);
+        convolve_spectrum_sparse(job->img_fft, job->resps.channels[i], bank.spectra[i]);
 
-        // Execute the plan
-        fftw_execute(filt_plan);
+    }
+    // Build the filter on the fly if the bank was never compiled
+    else{
 
-        for (unsigned int i = 0; i < width*height; i++){
-            if (abs(filt_fft.raw_vals[i]) > max_val){
-                max_val = abs(filt_fft.raw_vals[i]);
-            }
-        }
+        build_filter_spectrum(bank, i, job->scratch[thread_num]);
 
-        // add the filter to the image response
-        for (unsigned int i = 0; i < width*height; i++){
-            img.raw_vals[i] += filt_fft.raw_vals[i]/max_val;
+        convolve_spectrum(job->img_fft, job->resps.channels[i], job->scratch[thread_num]);
+
+    }
+
+}
+
+
+
+// Decimated output needs the passbands from a compiled bank
+static int is_decimating(const struct gabor_filter_bank_s bank){
+
+    return bank.decimate && bank.spectra != NULL;
+
+}
+
+
+
+// Batching needs compiled spectra and full resolution interleaved channels
+static int is_batching(const struct gabor_filter_bank_s bank){
+
+    return bank.block_size > 1 && bank.spectra != NULL && !is_decimating(bank) && !bank.split;
+
+}
+
+
+
+// Channels per batch, no more than the bank has
+static unsigned int batch_channels(const struct gabor_filter_bank_s bank){
+
+    return (bank.block_size < bank.num_filters) ? bank.block_size : bank.num_filters;
+
+}
+
+
+
+// Channels are taken batch_channels() at a time, the last block may be short
+static unsigned int num_blocks(const struct gabor_filter_bank_s bank){
+
+    return (bank.num_filters + batch_channels(bank) - 1)/batch_channels(bank);
+
+}
+
+
+
+// Multiply a block of channels and inverse transform them together in the thread's batch buffer
+static void apply_block_task(void* arg, const unsigned int b, const unsigned int thread_num){
+
+    struct apply_job_s* job = (struct apply_job_s*)arg;
+    struct gabor_filter_bank_s bank = job->bank;
+
+    unsigned int first = b*batch_channels(bank);
+    unsigned int count = bank.num_filters - first;
+    if (count > batch_channels(bank)){
+        count = batch_channels(bank);
+    }
+
+    convolve_spectrum_sparse_batch(job->img_fft, job->resps.channels + first, bank.spectra + first, count, job->batches[thread_num]);
+
+}
+
+
+
+// Workspace bytes for one image's responses, channel and subband tables included
+static size_t responses_workspace_size(const struct gabor_filter_bank_s bank){
+
+    // Split images take two planes instead of values and row pointers
+    size_t (*block_size)(const unsigned int, const unsigned int) = bank.split ? image_split_block_size : image_block_size;
+
+    size_t size = WORKSPACE_ROUND(bank.num_filters*(bank.split ? sizeof(struct image_split_s) : sizeof(struct image_s)));
+    size += WORKSPACE_ROUND(bank.num_filters*sizeof(struct subband_s));
+
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        if (is_decimating(bank)){
+            size += block_size(bank.height/bank.subbands[i].decimation_y, bank.width/bank.subbands[i].decimation_x);
+        }
+        else{
+            size += block_size(bank.height, bank.width);
         }
+    }
 
-        // Free the temporary filter
-        free_filter(temp_filt);
+    return size;
+
+}
+
+
+
+// Workspace bytes for the per-thread scratch spectra and batch buffers
+static size_t buffers_workspace_size(const struct gabor_filter_bank_s bank){
 
+    unsigned int num_threads = (bank.pool != NULL) ? bank.pool->num_threads : 1;
+    size_t size = 0;
+
+    // Scratch spectra for uncompiled banks
+    if (bank.spectra == NULL){
+        size += WORKSPACE_ROUND(num_threads*sizeof(struct filter_s));
+        size += num_threads*filter_block_size(bank.height, bank.width);
     }
 
-    // Future me, I am tired and I am SO SORRY for writing this line of code.
-    shift_filter(*((struct filter_s*)&img));
+    // Batch buffers
+    if (is_batching(bank)){
+        size += WORKSPACE_ROUND(num_threads*sizeof(complex_t*));
+        size += num_threads*convolve_batch_size(bank.height, bank.width, batch_channels(bank));
+    }
 
-    snprintf(filtname, 200, "%s_fourier", prefix);
-    save_image_autoscale(img, filtname);
+    // Taps and row pass output for spatial filters
+    if (has_spatial(bank)){
+        size += WORKSPACE_ROUND(num_threads*sizeof(struct separable_filter_s));
+        size += WORKSPACE_ROUND(num_threads*sizeof(struct image_s));
+        size += num_threads*separable_filter_block_size(spatial_taps_radius(bank), spatial_taps_radius(bank));
+        size += num_threads*image_block_size(bank.height, bank.width + 2*spatial_taps_radius(bank));
+    }
 
-    fclose(fid);
-    free_image(img);
-    free_filter(filt);
-    free_filter(filt_fft);
+    return size;
 
 }
 
 
 
+// Workspace bytes apply_gabor_filter_bank_real_workspace() needs per image,
+// the image itself not included
+size_t gabor_workspace_size(const struct gabor_filter_bank_s bank){
 
-void save_gabor_responses(struct gabor_responses_s resps, const char* const prefix){
+    // Image spectrum
+    size_t size = bank.split ? image_split_block_size(bank.height, bank.width) : image_block_size(bank.height, bank.width);
 
-    FILE* fid;
-    char filename[200];
+    return size + responses_workspace_size(bank) + buffers_workspace_size(bank);
 
-    snprintf(filename, 200, "%s.dat", prefix);
+}
 
-    fid = fopen(filename, "w");
 
-    unsigned int height = resps.channels[0].height;
-    unsigned int width = resps.channels[0].width;
 
-    fwrite(&height, sizeof(height), 1, fid);
-    fwrite(&width, sizeof(width), 1, fid);
-    fwrite(&resps.num_channels, sizeof(resps.num_channels), 1, fid);
+// Empty response channels for the bank, each the size of its subband when decimating.
+// From the workspace, or from the heap for free_gabor_responses() if ws is NULL.
+static struct gabor_responses_s init_bank_responses(const struct gabor_filter_bank_s bank, struct workspace_s* ws){
 
-    for (unsigned int i = 0; i < resps.num_channels; i++){
+    struct gabor_responses_s resps;
 
-        fwrite(resps.channels[i].raw_vals, sizeof(resps.channels[i].raw_vals[0]), width*height, fid);
+    if (ws == NULL && !is_decimating(bank)){
+        return init_gabor_responses_empty(bank.height, bank.width, bank.num_filters);
+    }
+
+    resps.num_channels = bank.num_filters;
+    resps.split_channels = NULL;
+    resps.subbands = NULL;
+
+    size_t table_size = bank.num_filters*sizeof(struct image_s);
+    resps.channels = (struct image_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+    if (resps.channels == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
 
+    if (is_decimating(bank)){
+        table_size = bank.num_filters*sizeof(struct subband_s);
+        resps.subbands = (struct subband_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+        if (resps.subbands == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    fclose(fid);
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        unsigned int height = bank.height;
+        unsigned int width = bank.width;
+        if (resps.subbands != NULL){
+            resps.subbands[i] = bank.subbands[i];
+            height /= bank.subbands[i].decimation_y;
+            width /= bank.subbands[i].decimation_x;
+        }
+        resps.channels[i] = (ws != NULL) ? init_image_workspace(ws, height, width) : init_image_empty(height, width);
+    }
+
+    return resps;
 
 }
 
 
 
+// Per-thread scratch spectra for building filters on the fly, and batch buffers,
+// from the workspace or from the heap for free_apply_buffers() if ws is NULL
+static void init_apply_buffers(struct apply_job_s* job, struct workspace_s* ws){
 
+    struct gabor_filter_bank_s bank = job->bank;
+    unsigned int num_threads = (bank.pool != NULL) ? bank.pool->num_threads : 1;
 
-void free_gabor_filter_bank(struct gabor_filter_bank_s bank){
+    job->scratch = NULL;
+    job->batches = NULL;
+    job->taps = NULL;
+    job->spatial_tmp = NULL;
 
-    free(bank.angles);
-    free(bank.freqs);
-    free(bank.sigmas);
+    if (bank.spectra == NULL){
+        size_t table_size = num_threads*sizeof(struct filter_s);
+        job->scratch = (struct filter_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+        if (job->scratch == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int t = 0; t < num_threads; t++){
+            job->scratch[t] = (ws != NULL) ? init_filter_workspace(ws, bank.height, bank.width) : init_filter_empty(bank.height, bank.width);
+        }
+    }
 
-    bank.height = 0;
-    bank.width = 0;
+    if (is_batching(bank)){
+        size_t table_size = num_threads*sizeof(complex_t*);
+        size_t batch_size = convolve_batch_size(bank.height, bank.width, batch_channels(bank));
+        job->batches = (complex_t**)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+        if (job->batches == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int t = 0; t < num_threads; t++){
+            job->batches[t] = (complex_t*)((ws != NULL) ? workspace_alloc(ws, batch_size) : FFTW(malloc)(batch_size));
+            if (job->batches[t] == NULL){
+                fprintf(stderr, "Malloc failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (job->img != NULL && has_spatial(bank)){
+        size_t taps_size = num_threads*sizeof(struct separable_filter_s);
+        size_t tmp_size = num_threads*sizeof(struct image_s);
+        job->taps = (struct separable_filter_s*)((ws != NULL) ? workspace_alloc(ws, taps_size) : malloc(taps_size));
+        job->spatial_tmp = (struct image_s*)((ws != NULL) ? workspace_alloc(ws, tmp_size) : malloc(tmp_size));
+        if (job->taps == NULL || job->spatial_tmp == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+        unsigned int radius = spatial_taps_radius(bank);
+        for (unsigned int t = 0; t < num_threads; t++){
+            job->taps[t] = (ws != NULL) ? init_separable_filter_workspace(ws, radius, radius) : init_separable_filter_empty(radius, radius);
+            // Room for the row pass to wrap the ends of each row on
+            job->spatial_tmp[t] = (ws != NULL) ? init_image_workspace(ws, bank.height, bank.width + 2*radius) : init_image_empty(bank.height, bank.width + 2*radius);
+        }
+    }
 
 }
 
 
 
+static void free_apply_buffers(struct apply_job_s* job){
 
+    unsigned int num_threads = (job->bank.pool != NULL) ? job->bank.pool->num_threads : 1;
 
+    if (job->scratch != NULL){
+        for (unsigned int t = 0; t < num_threads; t++){
+            free_filter(job->scratch[t]);
+        }
+        free(job->scratch);
+    }
+
+    if (job->batches != NULL){
+        for (unsigned int t = 0; t < num_threads; t++){
+            FFTW(free)(job->batches[t]);
+        }
+        free(job->batches);
+    }
+
+    if (job->taps != NULL){
+        for (unsigned int t = 0; t < num_threads; t++){
+            free_separable_filter(job->taps[t]);
+            free_image(job->spatial_tmp[t]);
+        }
+        free(job->taps);
+        free(job->spatial_tmp);
+    }
+
+}
+
+
+
+// Apply the bank given the image spectrum, and the image itself if filters may go spatially.
+// Everything comes from the workspace, or from the heap if ws is NULL.
+static struct gabor_responses_s apply_gabor_filter_bank_image(const struct image_s img_fft, const struct image_real_s* img, struct gabor_filter_bank_s bank, struct workspace_s* ws){
+
+    struct apply_job_s job;
+    job.img_fft = img_fft;
+    job.img = img;
+    job.bank = bank;
+    job.resps = init_bank_responses(bank, ws);
+
+    // Scratch goes after the responses so it can be handed straight back
+    size_t mark = (ws != NULL) ? ws->used : 0;
+
+    init_apply_buffers(&job, ws);
+
+    if (is_batching(bank)){
+        run_thread_pool(bank.pool, num_blocks(bank), apply_block_task, &job);
+    }
+    else{
+        run_thread_pool(bank.pool, bank.num_filters, apply_filter_task, &job);
+    }
+
+    if (ws != NULL){
+        ws->used = mark;
+    }
+    else{
+        free_apply_buffers(&job);
+    }
+
+    return job.resps;
+
+}
+
+
+
+// Apply the bank to an image that has already been transformed.
+// The image spectrum is shared by every filter, so it is only computed once per image.
+// Channels are spread over the bank's thread pool; each channel is computed the same way
+// whichever thread runs it, so the results are identical to a serial run.
+struct gabor_responses_s apply_gabor_filter_bank_spectrum(const struct image_s img_fft, struct gabor_filter_bank_s bank){
+
+    return apply_gabor_filter_bank_image(img_fft, NULL, bank, NULL);
+
+}
+
+
+
+// Same as apply_gabor_filter_bank_spectrum(), with the responses carved out of the workspace.
+// They stay valid until the workspace is reset, so don't free_gabor_responses() them.
+struct gabor_responses_s apply_gabor_filter_bank_spectrum_workspace(const struct image_s img_fft, struct gabor_filter_bank_s bank, struct workspace_s* ws){
+
+    return apply_gabor_filter_bank_image(img_fft, NULL, bank, ws);
+
+}
+
+
+
+// A batch of images sharing the bank and the per-thread buffers, one job each
+struct apply_batch_job_s{
+    struct apply_job_s* jobs;
+    unsigned int num_images;
+};
+
+
+// One filter applied to every image in the batch, while its spectrum is still in cache
+static void apply_filter_batch_task(void* arg, const unsigned int i, const unsigned int thread_num){
+
+    struct apply_batch_job_s* batch = (struct apply_batch_job_s*)arg;
+    struct gabor_filter_bank_s bank = batch->jobs[0].bank;
+
+    // Uncompiled banks build the filter once for the whole batch
+    if (bank.spectra == NULL && !is_spatial(bank, i) && !is_recursive(bank, i)){
+        struct filter_s filt_fft = batch->jobs[0].scratch[thread_num];
+        build_filter_spectrum(bank, i, filt_fft);
+        for (unsigned int n = 0; n < batch->num_images; n++){
+            convolve_spectrum(batch->jobs[n].img_fft, batch->jobs[n].resps.channels[i], filt_fft);
+        }
+    }
+    else{
+        for (unsigned int n = 0; n < batch->num_images; n++){
+            apply_filter_task(&batch->jobs[n], i, thread_num);
+        }
+    }
+
+}
+
+
+// One block of filters applied to every image in the batch
+static void apply_block_batch_task(void* arg, const unsigned int b, const unsigned int thread_num){
+
+    struct apply_batch_job_s* batch = (struct apply_batch_job_s*)arg;
+
+    for (unsigned int n = 0; n < batch->num_images; n++){
+        apply_block_task(&batch->jobs[n], b, thread_num);
+    }
+
+}
+
+
+
+// Workspace bytes apply_gabor_filter_bank_real_batch_workspace() needs for num_images images,
+// the images themselves not included
+size_t gabor_batch_workspace_size(const struct gabor_filter_bank_s bank, const unsigned int num_images){
+
+    // Split banks go an image at a time
+    if (bank.split){
+        return num_images*gabor_workspace_size(bank);
+    }
+
+    size_t size = num_images*responses_workspace_size(bank);
+
+    // Copy of the images back to back, their spectra and a job each
+    size += WORKSPACE_ROUND((size_t)num_images*bank.height*padded_row_stride(bank.width, sizeof(real_t))*sizeof(real_t));
+    size += WORKSPACE_ROUND(num_images*sizeof(struct image_s));
+    size += image_batch_block_size(num_images, bank.height, bank.width);
+    size += WORKSPACE_ROUND(num_images*sizeof(struct apply_job_s));
+
+    return size + buffers_workspace_size(bank);
+
+}
+
+
+
+// Apply the bank to num_images real images of the bank's size, writing resps[0..num_images).
+// The images are forward transformed together by one batched plan, then each filter (or block of
+// filters) is applied to every image in turn, so its spectrum is read from memory once per batch
+// instead of once per image. ws is NULL to use the heap.
+static void apply_gabor_filter_bank_batch(const struct image_real_s* imgs, const unsigned int num_images, struct gabor_filter_bank_s bank, struct gabor_responses_s* resps, struct workspace_s* ws){
+
+    if (num_images == 0){
+        return;
+    }
+
+    // Split banks have no batched path, go an image at a time
+    if (bank.split){
+        for (unsigned int n = 0; n < num_images; n++){
+            resps[n] = (ws != NULL) ? apply_gabor_filter_bank_real_workspace(imgs[n], bank, ws) : apply_gabor_filter_bank_real(imgs[n], bank);
+        }
+        return;
+    }
+
+    for (unsigned int n = 0; n < num_images; n++){
+        if (imgs[n].height != bank.height || imgs[n].width != bank.width){
+            fprintf(stderr, "Batched images must all be %ux%u, image %u is %ux%u\n", bank.height, bank.width, n, imgs[n].height, imgs[n].width);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Responses first, everything after the mark is handed back at the end
+    for (unsigned int n = 0; n < num_images; n++){
+        resps[n] = init_bank_responses(bank, ws);
+    }
+    size_t mark = (ws != NULL) ? ws->used : 0;
+
+    // The batched plan wants the images back to back, padded rows and all
+    unsigned int in_stride = padded_row_stride(bank.width, sizeof(real_t));
+    size_t image_size = (size_t)bank.height*in_stride;
+    size_t in_size = num_images*image_size*sizeof(real_t);
+    real_t* in = (real_t*)((ws != NULL) ? workspace_alloc(ws, in_size) : FFTW(malloc)(in_size));
+    if (in == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int n = 0; n < num_images; n++){
+        memcpy(in + image_size*n, imgs[n].raw_vals, image_size*sizeof(real_t));
+    }
+
+    size_t table_size = num_images*sizeof(struct image_s);
+    struct image_s* img_ffts = (struct image_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+    if (img_ffts == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ws != NULL){
+        init_image_batch_workspace(ws, img_ffts, num_images, bank.height, bank.width);
+    }
+    else{
+        init_image_batch_empty(img_ffts, num_images, bank.height, bank.width);
+    }
+
+    if (needs_spectrum(bank)){
+        execute_fft_2d_r2c_batch(in, img_ffts[0].raw_vals, num_images, bank.height, bank.width, in_stride, img_ffts[0].stride);
+    }
+
+    struct apply_batch_job_s batch;
+    batch.num_images = num_images;
+    table_size = num_images*sizeof(struct apply_job_s);
+    batch.jobs = (struct apply_job_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+    if (batch.jobs == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    batch.jobs[0].bank = bank;
+    batch.jobs[0].img = &imgs[0];
+    init_apply_buffers(&batch.jobs[0], ws);
+    for (unsigned int n = 0; n < num_images; n++){
+        batch.jobs[n] = batch.jobs[0];
+        batch.jobs[n].img = &imgs[n];
+        batch.jobs[n].img_fft = img_ffts[n];
+        batch.jobs[n].resps = resps[n];
+    }
+
+    if (is_batching(bank)){
+        run_thread_pool(bank.pool, num_blocks(bank), apply_block_batch_task, &batch);
+    }
+    else{
+        run_thread_pool(bank.pool, bank.num_filters, apply_filter_batch_task, &batch);
+    }
+
+    if (ws != NULL){
+        ws->used = mark;
+    }
+    else{
+        free_apply_buffers(&batch.jobs[0]);
+        free(batch.jobs);
+        free_image_batch(img_ffts);
+        free(img_ffts);
+        FFTW(free)(in);
+    }
+
+}
+
+
+
+// Batched apply_gabor_filter_bank_real(), free_gabor_responses() each of resps[0..num_images)
+void apply_gabor_filter_bank_real_batch(const struct image_real_s* imgs, const unsigned int num_images, struct gabor_filter_bank_s bank, struct gabor_responses_s* resps){
+
+    apply_gabor_filter_bank_batch(imgs, num_images, bank, resps, NULL);
+
+}
+
+
+
+// Batched apply_gabor_filter_bank_real_workspace(), the responses live until the workspace is reset.
+// gabor_batch_workspace_size() says how much room that takes.
+void apply_gabor_filter_bank_real_batch_workspace(const struct image_real_s* imgs, const unsigned int num_images, struct gabor_filter_bank_s bank, struct gabor_responses_s* resps, struct workspace_s* ws){
+
+    apply_gabor_filter_bank_batch(imgs, num_images, bank, resps, ws);
+
+}
+
+
+
+
+
+
+// Split layout: the image spectrum and every channel are kept as separate real and imaginary planes.
+// Only real images go this way, their transform writes the planes directly.
+struct apply_split_job_s{
+    struct image_split_s img_fft;
+    struct gabor_filter_bank_s bank;
+    struct gabor_responses_s resps;
+    struct filter_s* scratch;
+};
+
+
+static void apply_filter_split_task(void* arg, const unsigned int i, const unsigned int thread_num){
+
+    struct apply_split_job_s* job = (struct apply_split_job_s*)arg;
+    struct gabor_filter_bank_s bank = job->bank;
+
+    if (job->resps.subbands != NULL){
+
+        convolve_spectrum_decimated_split(job->img_fft, job->resps.split_channels[i], bank.spectra[i], bank.subbands[i]);
+
+    }
+    else if (bank.spectra != NULL){
+
+        convolve_spectrum_sparse_split(job->img_fft, job->resps.split_channels[i], bank.spectra[i]);
+
+    }
+    else{
+
+        build_filter_spectrum(bank, i, job->scratch[thread_num]);
+
+        convolve_spectrum_split(job->img_fft, job->resps.split_channels[i], job->scratch[thread_num]);
+
+    }
+
+}
+
+
+
+// Everything comes out of ws, or off the heap when ws is NULL
+static struct gabor_responses_s apply_gabor_filter_bank_split(const struct image_real_s img, struct gabor_filter_bank_s bank, struct workspace_s* ws){
+
+    struct apply_split_job_s job;
+    job.bank = bank;
+    job.scratch = NULL;
+
+    unsigned int num_threads = (bank.pool != NULL) ? bank.pool->num_threads : 1;
+
+    job.img_fft = (ws != NULL) ? init_image_split_workspace(ws, bank.height, bank.width) : init_image_split_empty(bank.height, bank.width);
+    fft_image_real_split(img, job.img_fft);
+
+    job.resps.num_channels = bank.num_filters;
+    job.resps.channels = NULL;
+    job.resps.subbands = NULL;
+
+    size_t table_size = bank.num_filters*sizeof(struct image_split_s);
+    job.resps.split_channels = (struct image_split_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+    if (job.resps.split_channels == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (is_decimating(bank)){
+        table_size = bank.num_filters*sizeof(struct subband_s);
+        job.resps.subbands = (struct subband_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+        if (job.resps.subbands == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        unsigned int height = bank.height;
+        unsigned int width = bank.width;
+        if (job.resps.subbands != NULL){
+            job.resps.subbands[i] = bank.subbands[i];
+            height /= bank.subbands[i].decimation_y;
+            width /= bank.subbands[i].decimation_x;
+        }
+        job.resps.split_channels[i] = (ws != NULL) ? init_image_split_workspace(ws, height, width) : init_image_split_empty(height, width);
+    }
+
+    // Scratch goes after the responses so it can be handed straight back
+    size_t mark = (ws != NULL) ? ws->used : 0;
+
+    if (bank.spectra == NULL){
+        table_size = num_threads*sizeof(struct filter_s);
+        job.scratch = (struct filter_s*)((ws != NULL) ? workspace_alloc(ws, table_size) : malloc(table_size));
+        if (job.scratch == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int t = 0; t < num_threads; t++){
+            job.scratch[t] = (ws != NULL) ? init_filter_workspace(ws, bank.height, bank.width) : init_filter_empty(bank.height, bank.width);
+        }
+    }
+
+    run_thread_pool(bank.pool, bank.num_filters, apply_filter_split_task, &job);
+
+    if (ws != NULL){
+        ws->used = mark;
+    }
+    else{
+        if (job.scratch != NULL){
+            for (unsigned int t = 0; t < num_threads; t++){
+                free_filter(job.scratch[t]);
+            }
+            free(job.scratch);
+        }
+        free_image_split(job.img_fft);
+    }
+
+    return job.resps;
+
+}
+
+
+
+
+
+
+struct gabor_responses_s apply_gabor_filter_bank(struct image_s img, struct gabor_filter_bank_s bank){
+
+    struct image_s img_fft = init_image_empty(bank.height, bank.width);
+
+    fft_image(img, img_fft);
+
+    struct gabor_responses_s resps = apply_gabor_filter_bank_spectrum(img_fft, bank);
+
+    free_image(img_fft);
+
+    return resps;
+
+}
+
+
+
+
+
+
+struct gabor_responses_s apply_gabor_filter_bank_real(struct image_real_s img, struct gabor_filter_bank_s bank){
+
+    if (bank.split){
+        return apply_gabor_filter_bank_split(img, bank, NULL);
+    }
+
+    struct image_s img_fft = init_image_empty(bank.height, bank.width);
+
+    // Not needed if every filter is convolved spatially
+    if (needs_spectrum(bank)){
+        fft_image_real(img, img_fft);
+    }
+
+    struct gabor_responses_s resps = apply_gabor_filter_bank_image(img_fft, &img, bank, NULL);
+
+    free_image(img_fft);
+
+    return resps;
+
+}
+
+
+
+// No heap allocations once the workspace is big enough, see gabor_workspace_size().
+// Everything, the image spectrum included, is released by resetting the workspace.
+struct gabor_responses_s apply_gabor_filter_bank_real_workspace(struct image_real_s img, struct gabor_filter_bank_s bank, struct workspace_s* ws){
+
+    if (bank.split){
+        return apply_gabor_filter_bank_split(img, bank, ws);
+    }
+
+    struct image_s img_fft = init_image_workspace(ws, bank.height, bank.width);
+
+    if (needs_spectrum(bank)){
+        fft_image_real(img, img_fft);
+    }
+
+    return apply_gabor_filter_bank_image(img_fft, &img, bank, ws);
+
+}
+
+
+
+
+
+
+struct filter_s init_gabor_filter_from_params(const double freq, const double angle, const double sigma, const unsigned int filt_height, const unsigned int filt_width){
+
+    struct filter_s filt;
+
+    // Initialize the filter
+    filt = init_filter_empty(filt_height, filt_width);
+
+    // Find the center pixel
+    int center_x = filt.width/2;
+    int center_y = filt.height/2;
+
+    // Populate the filter with proper values (http://en.wikipedia.org/wiki/Gabor_filter)
+    for (int i = 0; i < filt.height; i++){
+        for (int j = 0; j < filt.width; j++){
+
+            double x_shift = j - center_x;
+            double y_shift = i - center_y;
+
+            double x = x_shift*cos(angle) + y_shift*sin(angle);
+            double y = y_shift*cos(angle) - x_shift*sin(angle);
+
+            // Build the filter
+            //filt.vals[i][j] = pow(freq*sqrt(PI)/(3*sqrt(log(2))),2)*cexp(-1 * (pow(x, 2) + pow(y,2))/(2 * pow(sigma, 2))) * cexp((double complex)I*2*PI*freq*x);
+            filt.vals[i][j] = (1/pow(sigma,2))*cexp(-1 * (pow(x, 2) + pow(y,2))/(2 * pow(sigma, 2))) * cexp((double complex)I*2*PI*freq*x);
+            //filt.vals[i][j] = cexp((double complex)I*2*PI*freq*x);
+
+        }
+    }
+
+    return filt;
+
+}
+
+
+
+
+
+
+struct filter_s init_gabor_filter_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num){
+
+    return init_gabor_filter_from_params(bank.freqs[filter_num], bank.angles[filter_num], bank.sigmas[filter_num], bank.height, bank.width);
+
+}
+
+
+
+// Separable, truncated version of init_gabor_filter_from_params(), for convolve_separable().
+// The kernel stops num_sigmas out, or at the edge of a height x width image if that is closer.
+struct separable_filter_s init_gabor_separable_from_params(const double freq, const double angle, const double sigma, const double num_sigmas, const unsigned int height, const unsigned int width){
+
+    struct separable_filter_s filt = init_separable_filter_empty(separable_radius(sigma, num_sigmas, height), separable_radius(sigma, num_sigmas, width));
+
+    set_gabor_separable_taps(freq, angle, sigma, filt);
+
+    return filt;
+
+}
+
+
+
+struct separable_filter_s init_gabor_separable_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num){
+
+    return init_gabor_separable_from_params(bank.freqs[filter_num], bank.angles[filter_num], bank.sigmas[filter_num], bank.spatial_sigmas, bank.height, bank.width);
+
+}
+
+
+
+
+
+
+// Writes the filter's spectrum straight into the frequency grid, skipping the spatial filter and its FFT.
+// The spatial filter is a Gaussian times a plane wave, so its Fourier transform is a Gaussian
+// centered on the carrier frequency:
+//     G(u,v) = 2*pi * exp(-2*pi^2*sigma^2 * ((u - freq*cos(angle))^2 + (v - freq*sin(angle))^2))
+// The 2*pi comes from the 1/sigma^2 weighting in init_gabor_filter_from_params().
+// The phase matches a spatial filter that has been through shift_filter() (center at the origin),
+// which makes the spectrum purely real. Each bin uses the nearest alias of the carrier.
+struct filter_s init_gabor_spectrum_from_params(const double freq, const double angle, const double sigma, const unsigned int filt_height, const unsigned int filt_width){
+
+    struct filter_s filt_fft = init_filter_empty(filt_height, filt_width);
+
+    // Carrier frequency in cyc/px, along columns (x) and rows (y)
+    double freq_x = freq*cos(angle);
+    double freq_y = freq*sin(angle);
+
+    // The Gaussian is separable, so build one factor per row and one per column
+    double* row_vals = (double*)malloc(filt_height*sizeof(double));
+    if (row_vals == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    double* col_vals = (double*)malloc(filt_width*sizeof(double));
+    if (col_vals == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double scale = -2*pow(PI*sigma, 2);
+
+    for (unsigned int i = 0; i < filt_height; i++){
+        double dist = (double)i/filt_height - freq_y;
+        dist -= round(dist);
+        row_vals[i] = exp(scale*dist*dist);
+    }
+    for (unsigned int j = 0; j < filt_width; j++){
+        double dist = (double)j/filt_width - freq_x;
+        dist -= round(dist);
+        col_vals[j] = 2*PI*exp(scale*dist*dist);
+    }
+
+    for (unsigned int i = 0; i < filt_height; i++){
+        for (unsigned int j = 0; j < filt_width; j++){
+            filt_fft.vals[i][j] = row_vals[i]*col_vals[j];
+        }
+    }
+
+    free(row_vals);
+    free(col_vals);
+
+    return filt_fft;
+
+}
+
+
+
+
+
+
+struct filter_s init_gabor_spectrum_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num){
+
+    return init_gabor_spectrum_from_params(bank.freqs[filter_num], bank.angles[filter_num], bank.sigmas[filter_num], bank.height, bank.width);
+
+}
+
+
+
+
+
+// Full resolution values of one channel.
+// Decimated channels are band-limited, so zero-padding their spectrum back into place is exact.
+struct image_s upsample_gabor_response(struct gabor_responses_s resps, const unsigned int channel){
+
+    // Split channels are interleaved first
+    if (resps.split_channels != NULL){
+        struct image_s chan = init_image_from_split(resps.split_channels[channel]);
+        if (resps.subbands == NULL){
+            return chan;
+        }
+        struct gabor_responses_s interleaved = resps;
+        interleaved.channels = &chan;
+        interleaved.split_channels = NULL;
+        interleaved.subbands = resps.subbands + channel;
+        struct image_s img = upsample_gabor_response(interleaved, 0);
+        free_image(chan);
+        return img;
+    }
+
+    struct image_s chan = resps.channels[channel];
+
+    // Full resolution channels are just copied
+    if (resps.subbands == NULL){
+        struct image_s img = init_image_empty(chan.height, chan.width);
+        for (unsigned int i = 0; i < chan.height*chan.stride; i++){
+            img.raw_vals[i] = chan.raw_vals[i];
+        }
+        return img;
+    }
+
+    struct subband_s band = resps.subbands[channel];
+    struct image_s img = init_image_empty(band.full_height, band.full_width);
+    struct image_s chan_fft = init_image_empty(chan.height, chan.width);
+
+    fft_image(chan, chan_fft);
+
+    // Undo the 1/(full size) normalization and put each bin back around the center
+    real_t scale = (double)(chan.height*chan.width)/(band.full_height*band.full_width);
+    for (unsigned int i = 0; i < chan.height; i++){
+        int dist_y = (i < (chan.height+1)/2) ? (int)i : (int)i - (int)chan.height;
+        unsigned int y = (band.center_y + band.full_height + dist_y) % band.full_height;
+        for (unsigned int j = 0; j < chan.width; j++){
+            int dist_x = (j < (chan.width+1)/2) ? (int)j : (int)j - (int)chan.width;
+            unsigned int x = (band.center_x + band.full_width + dist_x) % band.full_width;
+            img.vals[y][x] = chan_fft.vals[i][j]/scale;
+        }
+    }
+
+    execute_fft_2d(img.raw_vals, img.raw_vals, img.height, img.width, img.stride, FFTW_BACKWARD);
+
+    complex_scale(img.raw_vals, img.raw_vals, (real_t)1/(img.height*img.width), img.height*img.stride);
+
+    free_image(chan_fft);
+
+    return img;
+
+}
 
-void free_gabor_responses(struct gabor_responses_s resps){
 
-    for (int i = 0; i < resps.num_channels; i++){
 
-        free_image(resps.channels[i]);
+
+
+
+struct image_s reconstruct_image_from_responses(struct gabor_responses_s resps){
+
+    struct image_s img;
+
+    unsigned int height = (resps.split_channels != NULL) ? resps.split_channels[0].height : resps.channels[0].height;
+    unsigned int width = (resps.split_channels != NULL) ? resps.split_channels[0].width : resps.channels[0].width;
+    if (resps.subbands != NULL){
+        height = resps.subbands[0].full_height;
+        width = resps.subbands[0].full_width;
+    }
+
+
+    // Comes back zeroed
+    img = init_image_empty(height, width);
+
+
+    // Sum each channel into the image
+    for (unsigned int c = 0; c < resps.num_channels; c++){
+
+        // Full resolution split channels only need their real plane read
+        if (resps.split_channels != NULL && resps.subbands == NULL){
+            const real_t* chan_re = resps.split_channels[c].re;
+            unsigned int chan_stride = resps.split_channels[c].stride;
+            for (unsigned int i = 0; i < height; i++){
+                for (unsigned int j = 0; j < width; j++){
+                    img.vals[i][j] += chan_re[chan_stride*i + j];
+                }
+            }
+            continue;
+        }
+
+        struct image_s chan = (resps.subbands != NULL) ? upsample_gabor_response(resps, c) : resps.channels[c];
+
+        // Same size, same stride, padding included
+        complex_accumulate_real(img.raw_vals, chan.raw_vals, height*img.stride);
+
+        if (resps.subbands != NULL){
+            free_image(chan);
+        }
+
+    }
+
+    return img;
+
+}
+
+
+
+
+
+
+
+
+
+void disp_gabor_filter_bank(struct gabor_filter_bank_s bank, const char* const prefix){
+
+    FILE* fid = fopen("filterdata.csv", "w");
+
+    // get image dims
+    const unsigned int height = 512;
+    const unsigned int width = 512;
+
+    // Allocate all needed images
+    struct image_s img = init_image_empty(height, width);
+    struct filter_s filt = init_filter_empty(height, width);
+    struct filter_s filt_fft = init_filter_empty(height, width);
+
+    char filtname[200];
+
+    for (unsigned int f = 0; f < bank.num_filters; f++){
+
+        real_t max_val = 0;
+
+        fprintf(fid, "%u,%f,%f,%f\n",f, bank.freqs[f], bank.angles[f], bank.sigmas[f]);
+
+        // initialize a temporary filter
+        struct filter_s temp_filt = init_gabor_filter_from_params(bank.freqs[f], bank.angles[f], bank.sigmas[f], height, width);
+
+        // Load it in
+        for (unsigned int i = 0; i < height*filt.stride; i++){
+            filt.raw_vals[i] = CREAL(temp_filt.raw_vals[i]);
+        }
+
+        // Saved through an image with the filter's layout
+        struct image_s filt_img;
+        filt_img.raw_vals = filt.raw_vals;
+        filt_img.vals = filt.vals;
+        filt_img.width = filt.width;
+        filt_img.height = filt.height;
+        filt_img.stride = filt.stride;
+
+        snprintf(filtname, 200, "%s_%u", prefix, f);
+        save_image_autoscale(filt_img, filtname);
+
+        // Shift the filter
+        shift_filter(filt);
+
+        // Execute the FFT
+        execute_fft_2d(filt.raw_vals, filt_fft.raw_vals, height, width, filt.stride, FFTW_FORWARD);
+
+        for (unsigned int i = 0; i < height*filt_fft.stride; i++){
+            if (CABS(filt_fft.raw_vals[i]) > max_val){
+                max_val = CABS(filt_fft.raw_vals[i]);
+            }
+        }
+
+        // add the filter to the image response
+        for (unsigned int i = 0; i < height*img.stride; i++){
+            img.raw_vals[i] += filt_fft.raw_vals[i]/max_val;
+        }
+
+        // Free the temporary filter
+        free_filter(temp_filt);
+
+    }
+
+    // Put the zero frequency in the middle for display
+    fftshift_2d(img.raw_vals, height, width, img.stride);
+
+    snprintf(filtname, 200, "%s_fourier", prefix);
+    save_image_autoscale(img, filtname);
+
+    fclose(fid);
+    free_image(img);
+    free_filter(filt);
+    free_filter(filt_fft);
+
+}
+
+
+
+
+// Channel dimensions, whichever layout the responses are in
+static unsigned int channel_height(const struct gabor_responses_s resps, const unsigned int i){
+    return (resps.split_channels != NULL) ? resps.split_channels[i].height : resps.channels[i].height;
+}
+
+
+static unsigned int channel_width(const struct gabor_responses_s resps, const unsigned int i){
+    return (resps.split_channels != NULL) ? resps.split_channels[i].width : resps.channels[i].width;
+}
+
+
+// Files always hold interleaved values, so split channels are interleaved a row at a time
+static void write_channel_values(FILE* fid, const struct gabor_responses_s resps, const unsigned int i){
+
+    unsigned int height = channel_height(resps, i);
+    unsigned int width = channel_width(resps, i);
+
+    // Rows go out without their padding
+    if (resps.split_channels == NULL){
+        for (unsigned int y = 0; y < height; y++){
+            fwrite(resps.channels[i].vals[y], sizeof(complex_t), width, fid);
+        }
+        return;
+    }
+
+    real_t* row = (real_t*)malloc(2*width*sizeof(real_t));
+    if (row == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct image_split_s chan = resps.split_channels[i];
+    for (unsigned int y = 0; y < height; y++){
+        for (unsigned int x = 0; x < width; x++){
+            row[2*x] = chan.re[chan.stride*y + x];
+            row[2*x + 1] = chan.im[chan.stride*y + x];
+        }
+        fwrite(row, sizeof(complex_t), width, fid);
+    }
+
+    free(row);
+
+}
+
+
+
+// Full resolution responses go to <prefix>.dat:
+//     height, width, num_channels, then each channel's values
+// Decimated responses go to <prefix>.sub:
+//     full height, full width, num_channels, then for each channel
+//     height, width, decimation_y, decimation_x, center_y, center_x and its values
+void save_gabor_responses(struct gabor_responses_s resps, const char* const prefix){
+
+    FILE* fid;
+    char filename[200];
+
+    if (resps.subbands != NULL){
+
+        snprintf(filename, 200, "%s.sub", prefix);
+
+        fid = fopen(filename, "w");
+
+        fwrite(&resps.subbands[0].full_height, sizeof(resps.subbands[0].full_height), 1, fid);
+        fwrite(&resps.subbands[0].full_width, sizeof(resps.subbands[0].full_width), 1, fid);
+        fwrite(&resps.num_channels, sizeof(resps.num_channels), 1, fid);
+
+        for (unsigned int i = 0; i < resps.num_channels; i++){
+
+            struct subband_s band = resps.subbands[i];
+            unsigned int height = channel_height(resps, i);
+            unsigned int width = channel_width(resps, i);
+
+            fwrite(&height, sizeof(height), 1, fid);
+            fwrite(&width, sizeof(width), 1, fid);
+            fwrite(&band.decimation_y, sizeof(band.decimation_y), 1, fid);
+            fwrite(&band.decimation_x, sizeof(band.decimation_x), 1, fid);
+            fwrite(&band.center_y, sizeof(band.center_y), 1, fid);
+            fwrite(&band.center_x, sizeof(band.center_x), 1, fid);
+
+            write_channel_values(fid, resps, i);
+
+        }
+
+        fclose(fid);
+
+        return;
+
+    }
+
+    snprintf(filename, 200, "%s.dat", prefix);
+
+    fid = fopen(filename, "w");
+
+    unsigned int height = channel_height(resps, 0);
+    unsigned int width = channel_width(resps, 0);
+
+    fwrite(&height, sizeof(height), 1, fid);
+    fwrite(&width, sizeof(width), 1, fid);
+    fwrite(&resps.num_channels, sizeof(resps.num_channels), 1, fid);
+
+    for (unsigned int i = 0; i < resps.num_channels; i++){
+
+        write_channel_values(fid, resps, i);
+
+    }
+
+    fclose(fid);
+
+}
+
+
+
+
+
+// Read a .dat written by save_gabor_responses() from either precision build.
+// The header doesn't say which, so the element size comes from the file size.
+static double complex* read_gabor_responses_dat(const char* const path, unsigned int* num_vals){
+
+    FILE* fid = fopen(path, "r");
+    if (fid == NULL){
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int header[3];
+    if (fread(header, sizeof(header[0]), 3, fid) != 3){
+        fprintf(stderr, "Could not read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    *num_vals = header[0]*header[1]*header[2];
+
+    fseek(fid, 0, SEEK_END);
+    long data_size = ftell(fid) - (long)sizeof(header);
+    fseek(fid, sizeof(header), SEEK_SET);
+
+    double complex* vals = (double complex*)malloc((*num_vals + 1)*sizeof(double complex));
+    if (vals == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < *num_vals; i++){
+        int ok;
+        if (data_size == (long)*num_vals*(long)sizeof(float complex)){
+            float complex val;
+            ok = fread(&val, sizeof(val), 1, fid);
+            vals[i] = val;
+        }
+        else{
+            ok = fread(&vals[i], sizeof(vals[i]), 1, fid);
+        }
+        if (!ok){
+            fprintf(stderr, "Could not read %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(fid);
+
+    return vals;
+
+}
+
+
+
+// Report the error of one response file against another, e.g. the single precision build against the double one.
+// Returns the largest error relative to the peak of the reference.
+double compare_gabor_responses(const char* const path_test, const char* const path_ref){
+
+    unsigned int num_test;
+    unsigned int num_ref;
+    double complex* test = read_gabor_responses_dat(path_test, &num_test);
+    double complex* ref = read_gabor_responses_dat(path_ref, &num_ref);
+
+    if (num_test != num_ref){
+        fprintf(stderr, "Response sizes differ\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double max_err = 0;
+    double sum_err = 0;
+    double max_ref = 0;
+    for (unsigned int i = 0; i < num_ref; i++){
+        double err = cabs(test[i] - ref[i]);
+        sum_err += err;
+        if (err > max_err){
+            max_err = err;
+        }
+        if (cabs(ref[i]) > max_ref){
+            max_ref = cabs(ref[i]);
+        }
+    }
+
+    double rel_err = (max_ref > 0) ? max_err/max_ref : max_err;
+    printf("max error %g, mean error %g, max error / peak %g\n", max_err, sum_err/num_ref, rel_err);
+
+    free(test);
+    free(ref);
+
+    return rel_err;
+
+}
+
+
+
+
+
+// Error of every filter of the bank when run through recursive Gaussians, against convolve_frequency()
+// with the full filter, on img. Errors are relative to the peak of the reference response.
+// The reference kernel stops at the image edges while the recursive one wraps forever, so filters
+// whose envelope is not well inside the image also show that difference.
+void check_gabor_recursive(struct gabor_filter_bank_s bank, const struct image_real_s img){
+
+    struct image_s img_cplx = init_image_empty(img.height, img.width);
+    struct image_s ref = init_image_empty(img.height, img.width);
+    struct image_s test = init_image_empty(img.height, img.width);
+
+    for (unsigned int i = 0; i < img.height; i++){
+        for (unsigned int j = 0; j < img.width; j++){
+            img_cplx.vals[i][j] = img.vals[i][j];
+        }
+    }
+
+    double worst = 0;
+
+    for (unsigned int f = 0; f < bank.num_filters; f++){
+
+        struct filter_s filt = init_gabor_filter_from_bank(bank, f);
+        convolve_frequency(img_cplx, ref, filt);
+        free_filter(filt);
+
+        struct recursive_filter_s row_filt, col_filt;
+        set_gabor_recursive(bank, f, &row_filt, &col_filt);
+        convolve_recursive_real(img, test, row_filt, col_filt);
+
+        double max_err = 0;
+        double sum_sq = 0;
+        double max_ref = 0;
+        for (unsigned int i = 0; i < img.height; i++){
+            for (unsigned int j = 0; j < img.width; j++){
+                double err = (double)CABS(test.vals[i][j] - ref.vals[i][j]);
+                sum_sq += err*err;
+                if (err > max_err){
+                    max_err = err;
+                }
+                if ((double)CABS(ref.vals[i][j]) > max_ref){
+                    max_ref = (double)CABS(ref.vals[i][j]);
+                }
+            }
+        }
+        max_err /= max_ref;
+        double rms_err = sqrt(sum_sq/(img.height*img.width))/max_ref;
+
+        printf("    filter %2u: sigma %7.3f freq %.4f angle %6.3f    max error / peak %.2e, rms / peak %.2e\n", f, bank.sigmas[f], bank.freqs[f], bank.angles[f], max_err, rms_err);
+
+        if (max_err > worst){
+            worst = max_err;
+        }
+
+    }
+
+    printf("    worst max error / peak %.2e\n", worst);
+
+    free_image(img_cplx);
+    free_image(ref);
+    free_image(test);
+
+}
+
+
+
+
+
+void free_gabor_filter_bank(struct gabor_filter_bank_s bank){
+
+    free(bank.angles);
+    free(bank.freqs);
+    free(bank.sigmas);
+    free(bank.engines);
+
+    // Spectra loaded from a cache file live in its mapping
+    if (bank.cache_map != NULL){
+        free(bank.spectra);
+        free(bank.subbands);
+        unmap_gabor_filter_bank_cache(bank);
+    }
+    else if (bank.spectra != NULL){
+        for (unsigned int i = 0; i < bank.num_filters; i++){
+            free_sparse_spectrum(bank.spectra[i]);
+        }
+        free(bank.spectra);
+        free(bank.subbands);
+    }
+
+    free_thread_pool(bank.pool);
+
+    bank.height = 0;
+    bank.width = 0;
+
+}
+
+
+
+
+
+
+void free_gabor_responses(struct gabor_responses_s resps){
+
+    for (int i = 0; i < resps.num_channels; i++){
+
+        if (resps.split_channels != NULL){
+            free_image_split(resps.split_channels[i]);
+        }
+        else{
+            free_image(resps.channels[i]);
+        }
 
     }
 
     free(resps.channels);
+    free(resps.split_channels);
+    free(resps.subbands);
 
 }
 
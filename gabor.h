@@ -7,19 +7,49 @@ struct gabor_filter_bank_s init_gabor_filter_bank_default(const unsigned int hei
 
 struct gabor_filter_bank_s init_gabor_filter_bank_exhaustive(const unsigned int height, const unsigned int width);
 
+struct gabor_filter_bank_s compile_gabor_filter_bank(struct gabor_filter_bank_s bank, const unsigned int num_threads);
+
 struct gabor_responses_s init_gabor_responses_empty(const unsigned int height, const unsigned int width, const unsigned int num_filters);
 
+size_t gabor_workspace_size(const struct gabor_filter_bank_s bank);
+
+struct gabor_responses_s apply_gabor_filter_bank_spectrum(const struct image_s img_fft, struct gabor_filter_bank_s bank);
+
+struct gabor_responses_s apply_gabor_filter_bank_spectrum_workspace(const struct image_s img_fft, struct gabor_filter_bank_s bank, struct workspace_s* ws);
+
 struct gabor_responses_s apply_gabor_filter_bank(struct image_s img, struct gabor_filter_bank_s bank);
 
+struct gabor_responses_s apply_gabor_filter_bank_real(struct image_real_s img, struct gabor_filter_bank_s bank);
+
+struct gabor_responses_s apply_gabor_filter_bank_real_workspace(struct image_real_s img, struct gabor_filter_bank_s bank, struct workspace_s* ws);
+
+size_t gabor_batch_workspace_size(const struct gabor_filter_bank_s bank, const unsigned int num_images);
+
+void apply_gabor_filter_bank_real_batch(const struct image_real_s* imgs, const unsigned int num_images, struct gabor_filter_bank_s bank, struct gabor_responses_s* resps);
+
+void apply_gabor_filter_bank_real_batch_workspace(const struct image_real_s* imgs, const unsigned int num_images, struct gabor_filter_bank_s bank, struct gabor_responses_s* resps, struct workspace_s* ws);
+
 struct filter_s init_gabor_filter_from_params(const double freq, const double angle, const double sigma, const unsigned int filt_height, const unsigned int filt_width);
 struct filter_s init_gabor_filter_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num);
 
+struct filter_s init_gabor_spectrum_from_params(const double freq, const double angle, const double sigma, const unsigned int filt_height, const unsigned int filt_width);
+struct filter_s init_gabor_spectrum_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num);
+
+struct separable_filter_s init_gabor_separable_from_params(const double freq, const double angle, const double sigma, const double num_sigmas, const unsigned int height, const unsigned int width);
+struct separable_filter_s init_gabor_separable_from_bank(struct gabor_filter_bank_s bank, const unsigned int filter_num);
+
+struct image_s upsample_gabor_response(struct gabor_responses_s resps, const unsigned int channel);
+
 struct image_s reconstruct_image_from_responses(struct gabor_responses_s resps);
 
 void disp_gabor_filter_bank(struct gabor_filter_bank_s bank, const char* const prefix);
 
 void save_gabor_responses(struct gabor_responses_s resps, const char* const prefix);
 
+double compare_gabor_responses(const char* const path_test, const char* const path_ref);
+
+void check_gabor_recursive(struct gabor_filter_bank_s bank, const struct image_real_s img);
+
 void free_gabor_responses(struct gabor_responses_s resps);
 void free_gabor_filter_bank(struct gabor_filter_bank_s bank);
 
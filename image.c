@@ -1,22 +1,24 @@
 #include "image.h"
+#include "threadpool.h"
+#include "workspace.h"
+#include "kernels.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <complex.h>
 #include <float.h>
+#include <pthread.h>
 #include <FreeImage.h>
 #include <fftw3.h>
 
 #define PI 3.1415926535897932384
 
-struct image_s init_image_from_path(const char* const filepath){
+// Read any format FreeImage understands and convert it to 8 bit grayscale
+static FIBITMAP* load_grayscale(const char* const filepath){
 
-    // Define structures for reading the image
-    struct image_s img;
     FIBITMAP* freeimg;
     FIBITMAP* grayimg;
-    FIBITMAP* compimg;
 
     // Find the image format from file
     FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
@@ -43,12 +45,28 @@ struct image_s init_image_from_path(const char* const filepath){
         exit(EXIT_FAILURE);
     }
 
-    // Convert the image to grayscale, double complex.
     grayimg = FreeImage_ConvertToGreyscale(freeimg);
+    FreeImage_Unload(freeimg);
+
+    return grayimg;
+
+}
+
+
+
+struct image_s init_image_from_path(const char* const filepath){
+
+    // Define structures for reading the image
+    struct image_s img;
+    FIBITMAP* grayimg;
+    FIBITMAP* compimg;
+
+    // Convert the image to grayscale, double complex.
+    grayimg = load_grayscale(filepath);
     compimg = FreeImage_ConvertToType(grayimg, FIT_COMPLEX, TRUE);
 
     // Initialize the image structure
-    img = init_image_empty(FreeImage_GetWidth(freeimg), FreeImage_GetHeight(freeimg));
+    img = init_image_empty(FreeImage_GetHeight(grayimg), FreeImage_GetWidth(grayimg));
 
     // Copy values into new image array
     for (unsigned int i = 0; i < img.height; i++){
@@ -59,7 +77,6 @@ struct image_s init_image_from_path(const char* const filepath){
     }
 
     // Free the image
-    FreeImage_Unload(freeimg);
     FreeImage_Unload(grayimg);
     FreeImage_Unload(compimg);
 
@@ -68,50 +85,281 @@ struct image_s init_image_from_path(const char* const filepath){
 
 
 
-struct image_s init_image_empty(const unsigned int height, const unsigned int width){
+// Copy a grayscale bitmap into a real image, as doubles
+static void copy_grayscale_real(FIBITMAP* grayimg, struct image_real_s img){
+
+    FIBITMAP* realimg = FreeImage_ConvertToType(grayimg, FIT_DOUBLE, TRUE);
+
+    // Copy values into new image array
+    for (unsigned int i = 0; i < img.height; i++){
+        double* line = (double*)FreeImage_GetScanLine(realimg, i);
+        for (unsigned int j = 0; j < img.width; j++){
+            img.vals[i][j] = line[j];
+        }
+    }
+
+    FreeImage_Unload(realimg);
+
+}
+
+
+
+struct image_real_s init_image_real_from_path(const char* const filepath){
+
+    // Convert the image to grayscale, double.
+    FIBITMAP* grayimg = load_grayscale(filepath);
+
+    // Initialize the image structure
+    struct image_real_s img = init_image_real_empty(FreeImage_GetHeight(grayimg), FreeImage_GetWidth(grayimg));
+
+    copy_grayscale_real(grayimg, img);
+
+    // Free the image
+    FreeImage_Unload(grayimg);
+
+    return img;
+}
+
+
+
+// Same, but the pixels go into the workspace instead of a new allocation.
+// An image too big for what is left of the workspace comes back with its
+// size and no pixels, for the caller to reject.
+struct image_real_s init_image_real_from_path_workspace(const char* const filepath, struct workspace_s* ws){
+
+    FIBITMAP* grayimg = load_grayscale(filepath);
+
+    unsigned int height = FreeImage_GetHeight(grayimg);
+    unsigned int width = FreeImage_GetWidth(grayimg);
+
+    if (ws->base == NULL || WORKSPACE_ROUND(ws->used) + image_real_block_size(height, width) > ws->capacity){
+        FreeImage_Unload(grayimg);
+        struct image_real_s img = {NULL, NULL, width, height, 0};
+        return img;
+    }
+
+    struct image_real_s img = init_image_real_workspace(ws, height, width);
+
+    copy_grayscale_real(grayimg, img);
+
+    FreeImage_Unload(grayimg);
+
+    return img;
+}
+
+
+
+// Bytes for an image, padded rows included, and its row pointers, which share one block
+size_t image_block_size(const unsigned int height, const unsigned int width){
+
+    return WORKSPACE_ROUND(padded_row_stride(width, sizeof(complex_t))*height*sizeof(complex_t)) + WORKSPACE_ROUND(height*sizeof(complex_t*));
+
+}
+
+
+
+// Lay an image out in a block from image_block_size(), values first then row pointers
+static struct image_s wrap_image(void* block, const unsigned int height, const unsigned int width){
 
-    // Create the structure
     struct image_s img;
 
     // Set height and width
     img.height = height;
     img.width = width;
+    img.stride = padded_row_stride(width, sizeof(complex_t));
+
+    img.raw_vals = (complex_t*)block;
+
+    // Make an array of pointers into each row for 2d indexing
+    img.vals = (complex_t**)((char*)block + WORKSPACE_ROUND(img.stride*height*sizeof(complex_t)));
+    for (unsigned int i = 0; i < height; i++){
+        img.vals[i] = img.raw_vals + img.stride*i;
+    }
+
+    // Zero the image, padding too, so loops over whole rows can treat it as data
+    for (unsigned int i = 0; i < height*img.stride; i++){
+
+        img.raw_vals[i] = 0;
+
+    }
+
+    return img;
 
-    // Allocate the filter array
-    img.raw_vals = (double complex*)fftw_malloc(width*height*sizeof(double complex));
-    if (img.raw_vals == NULL){
+}
+
+
+
+struct image_s init_image_empty(const unsigned int height, const unsigned int width){
+
+    void* block = FFTW(malloc)(image_block_size(height, width));
+    if (block == NULL){
         fprintf(stderr, "Malloc failed\n");
         exit(EXIT_FAILURE);
     }
 
-    // Make an array of pointers into each row for 2d indexing
-    img.vals = (double complex**)malloc(height*sizeof(double complex*));
-    if (img.vals == NULL){
+    return wrap_image(block, height, width);
+
+}
+
+
+
+// Lives until the workspace is reset, don't free_image() it
+struct image_s init_image_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width){
+
+    return wrap_image(workspace_alloc(ws, image_block_size(height, width)), height, width);
+
+}
+
+
+
+void free_image(struct image_s img){
+
+    FFTW(free)(img.raw_vals);
+    img.raw_vals = NULL;
+    img.vals = NULL;
+
+}
+
+
+
+
+// Bytes for count images that share one block, their values back to back so they can
+// go through one batched transform, then all the row pointers
+size_t image_batch_block_size(const unsigned int count, const unsigned int height, const unsigned int width){
+
+    return WORKSPACE_ROUND((size_t)count*padded_row_stride(width, sizeof(complex_t))*height*sizeof(complex_t)) + WORKSPACE_ROUND((size_t)count*height*sizeof(complex_t*));
+
+}
+
+
+
+// Lay count images out in a block from image_batch_block_size(), each height*stride after the last
+static void wrap_image_batch(void* block, struct image_s* imgs, const unsigned int count, const unsigned int height, const unsigned int width){
+
+    unsigned int stride = padded_row_stride(width, sizeof(complex_t));
+    complex_t** rows = (complex_t**)((char*)block + WORKSPACE_ROUND((size_t)count*stride*height*sizeof(complex_t)));
+
+    for (unsigned int k = 0; k < count; k++){
+
+        imgs[k].height = height;
+        imgs[k].width = width;
+        imgs[k].stride = stride;
+        imgs[k].raw_vals = (complex_t*)block + (size_t)stride*height*k;
+        imgs[k].vals = rows + (size_t)height*k;
+
+        for (unsigned int i = 0; i < height; i++){
+            imgs[k].vals[i] = imgs[k].raw_vals + stride*i;
+        }
+
+    }
+
+    // Zero them, padding too
+    complex_t* vals = (complex_t*)block;
+    for (size_t i = 0; i < (size_t)count*height*stride; i++){
+        vals[i] = 0;
+    }
+
+}
+
+
+
+// Fills in imgs[0..count), free_image_batch() them together
+void init_image_batch_empty(struct image_s* imgs, const unsigned int count, const unsigned int height, const unsigned int width){
+
+    void* block = FFTW(malloc)(image_batch_block_size(count, height, width));
+    if (block == NULL){
         fprintf(stderr, "Malloc failed\n");
         exit(EXIT_FAILURE);
     }
+
+    wrap_image_batch(block, imgs, count, height, width);
+
+}
+
+
+
+// Lives until the workspace is reset, don't free_image_batch() it
+void init_image_batch_workspace(struct workspace_s* ws, struct image_s* imgs, const unsigned int count, const unsigned int height, const unsigned int width){
+
+    wrap_image_batch(workspace_alloc(ws, image_batch_block_size(count, height, width)), imgs, count, height, width);
+
+}
+
+
+
+// The first image's values start the block
+void free_image_batch(struct image_s* imgs){
+
+    FFTW(free)(imgs[0].raw_vals);
+
+}
+
+
+
+
+
+size_t image_real_block_size(const unsigned int height, const unsigned int width){
+
+    return WORKSPACE_ROUND(padded_row_stride(width, sizeof(real_t))*height*sizeof(real_t)) + WORKSPACE_ROUND(height*sizeof(real_t*));
+
+}
+
+
+
+static struct image_real_s wrap_image_real(void* block, const unsigned int height, const unsigned int width){
+
+    struct image_real_s img;
+
+    // Set height and width
+    img.height = height;
+    img.width = width;
+    img.stride = padded_row_stride(width, sizeof(real_t));
+
+    img.raw_vals = (real_t*)block;
+
+    // Make an array of pointers into each row for 2d indexing
+    img.vals = (real_t**)((char*)block + WORKSPACE_ROUND(img.stride*height*sizeof(real_t)));
     for (unsigned int i = 0; i < height; i++){
-        img.vals[i] = img.raw_vals + img.width*i;
+        img.vals[i] = img.raw_vals + img.stride*i;
+    }
+
+    // Zero the image, padding too
+    for (unsigned int i = 0; i < height*img.stride; i++){
+        img.raw_vals[i] = 0;
     }
 
+    return img;
 
-    // Zero the image!!!
-    for (unsigned int i = 0; i < height*width; i++){
+}
 
-        img.raw_vals[i] = 0;
 
+
+struct image_real_s init_image_real_empty(const unsigned int height, const unsigned int width){
+
+    void* block = FFTW(malloc)(image_real_block_size(height, width));
+    if (block == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
     }
 
-    return img;
+    return wrap_image_real(block, height, width);
 
 }
 
 
 
-void free_image(struct image_s img){
+// Lives until the workspace is reset, don't free_image_real() it
+struct image_real_s init_image_real_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width){
+
+    return wrap_image_real(workspace_alloc(ws, image_real_block_size(height, width)), height, width);
+
+}
+
+
+
+void free_image_real(struct image_real_s img){
 
-    fftw_free(img.raw_vals);
-    free(img.vals);
+    FFTW(free)(img.raw_vals);
     img.raw_vals = NULL;
     img.vals = NULL;
 
@@ -121,6 +369,92 @@ void free_image(struct image_s img){
 
 
 
+// Bytes for both planes of a split image, each plane starts aligned
+size_t image_split_block_size(const unsigned int height, const unsigned int width){
+
+    return 2*WORKSPACE_ROUND(padded_row_stride(width, sizeof(real_t))*height*sizeof(real_t));
+
+}
+
+
+
+static struct image_split_s wrap_image_split(void* block, const unsigned int height, const unsigned int width){
+
+    struct image_split_s img;
+
+    img.height = height;
+    img.width = width;
+    img.stride = padded_row_stride(width, sizeof(real_t));
+
+    img.re = (real_t*)block;
+    img.im = (real_t*)((char*)block + WORKSPACE_ROUND(img.stride*height*sizeof(real_t)));
+
+    // Zero both planes, padding too
+    for (unsigned int i = 0; i < height*img.stride; i++){
+        img.re[i] = 0;
+        img.im[i] = 0;
+    }
+
+    return img;
+
+}
+
+
+
+struct image_split_s init_image_split_empty(const unsigned int height, const unsigned int width){
+
+    void* block = FFTW(malloc)(image_split_block_size(height, width));
+    if (block == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return wrap_image_split(block, height, width);
+
+}
+
+
+
+// Lives until the workspace is reset, don't free_image_split() it
+struct image_split_s init_image_split_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width){
+
+    return wrap_image_split(workspace_alloc(ws, image_split_block_size(height, width)), height, width);
+
+}
+
+
+
+// Interleaved copy, for the consumers that want complex values
+struct image_s init_image_from_split(const struct image_split_s img_split){
+
+    struct image_s img = init_image_empty(img_split.height, img_split.width);
+
+    for (unsigned int i = 0; i < img.height; i++){
+        real_t* parts = (real_t*)img.vals[i];
+        for (unsigned int j = 0; j < img.width; j++){
+            parts[2*j] = img_split.re[img_split.stride*i + j];
+            parts[2*j + 1] = img_split.im[img_split.stride*i + j];
+        }
+    }
+
+    return img;
+
+}
+
+
+
+void free_image_split(struct image_split_s img){
+
+    FFTW(free)(img.re);
+    img.re = NULL;
+    img.im = NULL;
+
+}
+
+
+
+
+
 void save_image_scale(struct image_s img, const char* const prefix, double min_val, double max_val){
 
     uint8_t* out_img;
@@ -132,9 +466,9 @@ void save_image_scale(struct image_s img, const char* const prefix, double min_v
         exit(EXIT_FAILURE);
     }
 
-    // Copy the real and imaginary values in, scaling to fit in 8 bits
-    for (unsigned int i = 0; i < (img.height*img.width); i++){
-        out_img[i] = ((cabs(img.raw_vals[i]) - min_val) / (max_val - min_val))*255;
+    // Magnitudes, scaled to fit in 8 bits
+    for (unsigned int i = 0; i < img.height; i++){
+        complex_quantize_u8(out_img + img.width*i, img.vals[i], (real_t)min_val, (real_t)max_val, img.width);
     }
 
     // Create the FreeImage for writing
@@ -159,22 +493,55 @@ void save_image_noscale(struct image_s img, const char* const prefix){
 }
 
 
+// Running minimum and maximum magnitude, merged from each band of the scan
+struct min_max_s{
+    complex_t** vals;
+    unsigned int width;
+    real_t min;
+    real_t max;
+    pthread_mutex_t lock;
+};
+
+
+static void min_max_range(void* arg, const unsigned int begin, const unsigned int end){
+
+    struct min_max_s* scan = (struct min_max_s*)arg;
+
+    real_t band_min = REAL_MAX;
+    real_t band_max = 0;
+
+    for (unsigned int i = begin; i < end; i++){
+        complex_magnitude_min_max(scan->vals[i], scan->width, &band_min, &band_max);
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    if (band_min < scan->min){
+        scan->min = band_min;
+    }
+    if (band_max > scan->max){
+        scan->max = band_max;
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+}
+
+
+
 void save_image_autoscale(struct image_s img, const char* const prefix){
 
-    double img_min = DBL_MAX;
-    double img_max = DBL_MIN;
+    struct min_max_s scan;
+    scan.vals = img.vals;
+    scan.width = img.width;
+    scan.min = REAL_MAX;
+    scan.max = 0;
+    pthread_mutex_init(&scan.lock, NULL);
 
     // Find the minimum and maximum of each component
-    for (unsigned int i = 0; i < (img.height*img.width); i++){
-        if (cabs(img.raw_vals[i]) < img_min){
-            img_min = cabs(img.raw_vals[i]);
-        }
-        if (cabs(img.raw_vals[i]) > img_max){
-            img_max = cabs(img.raw_vals[i]);
-        }
-    }
+    parallel_for_rows(img.height, img.width, min_max_range, &scan);
+
+    pthread_mutex_destroy(&scan.lock);
 
     // Save the image
-    save_image_scale(img, prefix, img_min, img_max);
+    save_image_scale(img, prefix, scan.min, scan.max);
 
 }
@@ -3,12 +3,46 @@
 
 #include "types.h"
 
+size_t image_block_size(const unsigned int height, const unsigned int width);
+
 struct image_s init_image_empty(const unsigned int height, const unsigned int width);
 
+struct image_s init_image_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width);
+
 struct image_s init_image_from_path(const char* const filepath);
 
 void free_image(struct image_s img);
 
+size_t image_batch_block_size(const unsigned int count, const unsigned int height, const unsigned int width);
+
+void init_image_batch_empty(struct image_s* imgs, const unsigned int count, const unsigned int height, const unsigned int width);
+
+void init_image_batch_workspace(struct workspace_s* ws, struct image_s* imgs, const unsigned int count, const unsigned int height, const unsigned int width);
+
+void free_image_batch(struct image_s* imgs);
+
+size_t image_real_block_size(const unsigned int height, const unsigned int width);
+
+struct image_real_s init_image_real_empty(const unsigned int height, const unsigned int width);
+
+struct image_real_s init_image_real_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width);
+
+struct image_real_s init_image_real_from_path(const char* const filepath);
+
+struct image_real_s init_image_real_from_path_workspace(const char* const filepath, struct workspace_s* ws);
+
+void free_image_real(struct image_real_s img);
+
+size_t image_split_block_size(const unsigned int height, const unsigned int width);
+
+struct image_split_s init_image_split_empty(const unsigned int height, const unsigned int width);
+
+struct image_split_s init_image_split_workspace(struct workspace_s* ws, const unsigned int height, const unsigned int width);
+
+struct image_s init_image_from_split(const struct image_split_s img_split);
+
+void free_image_split(struct image_split_s img);
+
 void save_image_scale(struct image_s img, const char* const prefix, double min_val, double max_val);
 
 void save_image_autoscale(struct image_s img, const char* const prefix);
@@ -0,0 +1,844 @@
+#include "kernels.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// One set of kernels per instruction set
+struct kernel_table_s{
+    const char* name;
+    void (*multiply)(complex_t* out, const complex_t* a, const complex_t* b, const unsigned int n);
+    void (*multiply_accumulate)(complex_t* acc, const complex_t* a, const complex_t* b, const unsigned int n);
+    void (*scale)(complex_t* out, const complex_t* in, const real_t scale, const unsigned int n);
+    void (*weighted_sum)(complex_t* out, const complex_t* const* ins, const complex_t* weights, const unsigned int count, const unsigned int n);
+    void (*accumulate_real)(complex_t* acc, const complex_t* in, const unsigned int n);
+    void (*magnitude)(real_t* out, const complex_t* in, const unsigned int n);
+    void (*magnitude_min_max)(const complex_t* in, const unsigned int n, real_t* min_val, real_t* max_val);
+    void (*quantize_u8)(uint8_t* out, const complex_t* in, const real_t min_val, const real_t max_val, const unsigned int n);
+    void (*bilateral_accumulate)(real_t* sum_re, real_t* sum_im, real_t* weight, const real_t* in_re, const real_t* in_im, const real_t* mag, const real_t* center_mag, const real_t spatial_weight, const real_t range_scale, const unsigned int n);
+};
+
+
+// The scalar kernels are the reference the vector ones are checked against,
+// and finish off whatever is left over after the last full vector.
+// Magnitudes are sqrt(re^2 + im^2) rather than cabs() so every path rounds the same way.
+// Likewise the vector complex multiplies don't fuse, so an element comes out the same whichever
+// path it goes through, and splitting a loop across threads never changes the result.
+
+
+static void scalar_multiply(complex_t* out, const complex_t* a, const complex_t* b, const unsigned int n){
+    for (unsigned int i = 0; i < n; i++){
+        out[i] = a[i] * b[i];
+    }
+}
+
+
+static void scalar_multiply_accumulate(complex_t* acc, const complex_t* a, const complex_t* b, const unsigned int n){
+    for (unsigned int i = 0; i < n; i++){
+        acc[i] += a[i] * b[i];
+    }
+}
+
+
+static void scalar_scale(complex_t* out, const complex_t* in, const real_t scale, const unsigned int n){
+    for (unsigned int i = 0; i < n; i++){
+        out[i] = in[i] * scale;
+    }
+}
+
+
+// Starts at begin, so the vector versions can finish their tails with it
+static void scalar_weighted_sum_from(complex_t* out, const complex_t* const* ins, const complex_t* weights, const unsigned int count, const unsigned int begin, const unsigned int n){
+    for (unsigned int i = begin; i < n; i++){
+        complex_t sum = 0;
+        for (unsigned int t = 0; t < count; t++){
+            sum += ins[t][i] * weights[t];
+        }
+        out[i] = sum;
+    }
+}
+
+
+static void scalar_weighted_sum(complex_t* out, const complex_t* const* ins, const complex_t* weights, const unsigned int count, const unsigned int n){
+    scalar_weighted_sum_from(out, ins, weights, count, 0, n);
+}
+
+
+static void scalar_accumulate_real(complex_t* acc, const complex_t* in, const unsigned int n){
+    for (unsigned int i = 0; i < n; i++){
+        acc[i] += CREAL(in[i]);
+    }
+}
+
+
+static real_t scalar_abs(const complex_t z){
+    const real_t* parts = (const real_t*)&z;
+#ifdef GABOR_SINGLE
+    return sqrtf(parts[0]*parts[0] + parts[1]*parts[1]);
+#else
+    return sqrt(parts[0]*parts[0] + parts[1]*parts[1]);
+#endif
+}
+
+
+static void scalar_magnitude(real_t* out, const complex_t* in, const unsigned int n){
+    for (unsigned int i = 0; i < n; i++){
+        out[i] = scalar_abs(in[i]);
+    }
+}
+
+
+static void scalar_magnitude_min_max(const complex_t* in, const unsigned int n, real_t* min_val, real_t* max_val){
+    for (unsigned int i = 0; i < n; i++){
+        real_t mag = scalar_abs(in[i]);
+        if (mag < *min_val){
+            *min_val = mag;
+        }
+        if (mag > *max_val){
+            *max_val = mag;
+        }
+    }
+}
+
+
+// Levels per unit magnitude, a flat image maps to 0
+static real_t quantize_scale(const real_t min_val, const real_t max_val){
+    return (max_val > min_val) ? 255/(max_val - min_val) : 0;
+}
+
+
+static void scalar_quantize_u8(uint8_t* out, const complex_t* in, const real_t min_val, const real_t max_val, const unsigned int n){
+    const real_t scale = quantize_scale(min_val, max_val);
+    for (unsigned int i = 0; i < n; i++){
+        real_t level = (scalar_abs(in[i]) - min_val)*scale;
+        level = (level > 0) ? level : 0;
+        level = (level < 255) ? level : 255;
+        out[i] = (uint8_t)level;
+    }
+}
+
+
+// One tap of the bilateral filter for n neighbouring pixels: the weight falls off with the
+// squared difference between each pixel's magnitude and its center's
+static void scalar_bilateral_accumulate(real_t* sum_re, real_t* sum_im, real_t* weight, const real_t* in_re, const real_t* in_im, const real_t* mag, const real_t* center_mag, const real_t spatial_weight, const real_t range_scale, const unsigned int n){
+    for (unsigned int i = 0; i < n; i++){
+        real_t diff = mag[i] - center_mag[i];
+        real_t w = spatial_weight*(real_t)exp(-(double)(diff*diff*range_scale));
+        weight[i] += w;
+        sum_re[i] += w*in_re[i];
+        sum_im[i] += w*in_im[i];
+    }
+}
+
+
+// exp(r) for |r| <= ln(2)/2 is its Taylor series to here, which leaves under
+// an ulp of error, the vector exp below scales it by a power of two
+#ifdef GABOR_SINGLE
+#define EXP_DEGREE 7
+#else
+#define EXP_DEGREE 12
+#endif
+
+static const real_t exp_taylor[13] = {
+    (real_t)1.0, (real_t)1.0, (real_t)(1.0/2), (real_t)(1.0/6), (real_t)(1.0/24), (real_t)(1.0/120), (real_t)(1.0/720),
+    (real_t)(1.0/5040), (real_t)(1.0/40320), (real_t)(1.0/362880), (real_t)(1.0/3628800), (real_t)(1.0/39916800), (real_t)(1.0/479001600)
+};
+
+
+static const struct kernel_table_s scalar_kernels = {
+    "scalar",
+    scalar_multiply,
+    scalar_multiply_accumulate,
+    scalar_scale,
+    scalar_weighted_sum,
+    scalar_accumulate_real,
+    scalar_magnitude,
+    scalar_magnitude_min_max,
+    scalar_quantize_u8,
+    scalar_bilateral_accumulate
+};
+
+
+
+
+
+
+#ifdef KERNELS_X86
+
+// SSE2, part of every x86-64 CPU
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+#define KISA "sse2"
+#define KNAME(op) sse2_ ## op
+
+#ifdef GABOR_SINGLE
+
+#define KVEC __m128
+#define KWIDTH 4
+#define KLOAD(p) _mm_loadu_ps(p)
+#define KSTORE(p, v) _mm_storeu_ps(p, v)
+#define KADD(a, b) _mm_add_ps(a, b)
+#define KSUB(a, b) _mm_sub_ps(a, b)
+#define KMUL(a, b) _mm_mul_ps(a, b)
+#define KMIN(a, b) _mm_min_ps(a, b)
+#define KMAX(a, b) _mm_max_ps(a, b)
+#define KSQRT(a) _mm_sqrt_ps(a)
+#define KSET1(x) _mm_set1_ps(x)
+#define KREAL(v) _mm_and_ps(v, _mm_castsi128_ps(_mm_set_epi32(0, -1, 0, -1)))
+#define KPOW2(v) _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(v), 23))
+
+static inline __m128 sse2_cmul(const __m128 a, const __m128 b){
+    __m128 b_re = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128 b_im = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128 a_swap = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 cross = _mm_xor_ps(_mm_mul_ps(a_swap, b_im), _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f));
+    return _mm_add_ps(_mm_mul_ps(a, b_re), cross);
+}
+
+static inline __m128 sse2_mag(const __m128 x, const __m128 y){
+    __m128 sx = _mm_mul_ps(x, x);
+    __m128 sy = _mm_mul_ps(y, y);
+    __m128 re = _mm_shuffle_ps(sx, sy, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 im = _mm_shuffle_ps(sx, sy, _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_sqrt_ps(_mm_add_ps(re, im));
+}
+
+#else
+
+#define KVEC __m128d
+#define KWIDTH 2
+#define KLOAD(p) _mm_loadu_pd(p)
+#define KSTORE(p, v) _mm_storeu_pd(p, v)
+#define KADD(a, b) _mm_add_pd(a, b)
+#define KSUB(a, b) _mm_sub_pd(a, b)
+#define KMUL(a, b) _mm_mul_pd(a, b)
+#define KMIN(a, b) _mm_min_pd(a, b)
+#define KMAX(a, b) _mm_max_pd(a, b)
+#define KSQRT(a) _mm_sqrt_pd(a)
+#define KSET1(x) _mm_set1_pd(x)
+#define KREAL(v) _mm_and_pd(v, _mm_castsi128_pd(_mm_set_epi64x(0, -1)))
+#define KPOW2(v) _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(v), 52))
+
+static inline __m128d sse2_cmul(const __m128d a, const __m128d b){
+    __m128d b_re = _mm_unpacklo_pd(b, b);
+    __m128d b_im = _mm_unpackhi_pd(b, b);
+    __m128d a_swap = _mm_shuffle_pd(a, a, 1);
+    __m128d cross = _mm_xor_pd(_mm_mul_pd(a_swap, b_im), _mm_set_pd(0.0, -0.0));
+    return _mm_add_pd(_mm_mul_pd(a, b_re), cross);
+}
+
+static inline __m128d sse2_mag(const __m128d x, const __m128d y){
+    __m128d sx = _mm_mul_pd(x, x);
+    __m128d sy = _mm_mul_pd(y, y);
+    return _mm_sqrt_pd(_mm_add_pd(_mm_unpacklo_pd(sx, sy), _mm_unpackhi_pd(sx, sy)));
+}
+
+#endif
+
+#define KCMUL(a, b) sse2_cmul(a, b)
+#define KMAG(x, y) sse2_mag(x, y)
+
+#include "kernels_simd.h"
+
+#undef KISA
+#undef KNAME
+#undef KVEC
+#undef KWIDTH
+#undef KLOAD
+#undef KSTORE
+#undef KADD
+#undef KSUB
+#undef KMUL
+#undef KMIN
+#undef KMAX
+#undef KSQRT
+#undef KSET1
+#undef KREAL
+#undef KPOW2
+#undef KCMUL
+#undef KMAG
+
+#pragma GCC pop_options
+
+
+
+
+
+
+// AVX2, Haswell and later. No FMA, a fused complex multiply would round differently from the scalar one
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define KISA "avx2"
+#define KNAME(op) avx2_ ## op
+
+#ifdef GABOR_SINGLE
+
+#define KVEC __m256
+#define KWIDTH 8
+#define KLOAD(p) _mm256_loadu_ps(p)
+#define KSTORE(p, v) _mm256_storeu_ps(p, v)
+#define KADD(a, b) _mm256_add_ps(a, b)
+#define KSUB(a, b) _mm256_sub_ps(a, b)
+#define KMUL(a, b) _mm256_mul_ps(a, b)
+#define KMIN(a, b) _mm256_min_ps(a, b)
+#define KMAX(a, b) _mm256_max_ps(a, b)
+#define KSQRT(a) _mm256_sqrt_ps(a)
+#define KSET1(x) _mm256_set1_ps(x)
+#define KREAL(v) _mm256_blend_ps(v, _mm256_setzero_ps(), 0xAA)
+#define KPOW2(v) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_castps_si256(v), 23))
+
+static inline __m256 avx2_cmul(const __m256 a, const __m256 b){
+    __m256 a_swap = _mm256_permute_ps(a, 0xB1);
+    return _mm256_addsub_ps(_mm256_mul_ps(a, _mm256_moveldup_ps(b)), _mm256_mul_ps(a_swap, _mm256_movehdup_ps(b)));
+}
+
+// hadd works within 128 bit lanes, leaving pairs in the order x0 x1 y0 y1 x2 x3 y2 y3
+static inline __m256 avx2_mag(const __m256 x, const __m256 y){
+    __m256 sums = _mm256_hadd_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+    sums = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sums), 0xD8));
+    return _mm256_sqrt_ps(sums);
+}
+
+#else
+
+#define KVEC __m256d
+#define KWIDTH 4
+#define KLOAD(p) _mm256_loadu_pd(p)
+#define KSTORE(p, v) _mm256_storeu_pd(p, v)
+#define KADD(a, b) _mm256_add_pd(a, b)
+#define KSUB(a, b) _mm256_sub_pd(a, b)
+#define KMUL(a, b) _mm256_mul_pd(a, b)
+#define KMIN(a, b) _mm256_min_pd(a, b)
+#define KMAX(a, b) _mm256_max_pd(a, b)
+#define KSQRT(a) _mm256_sqrt_pd(a)
+#define KSET1(x) _mm256_set1_pd(x)
+#define KREAL(v) _mm256_blend_pd(v, _mm256_setzero_pd(), 0xA)
+#define KPOW2(v) _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(v), 52))
+
+static inline __m256d avx2_cmul(const __m256d a, const __m256d b){
+    __m256d a_swap = _mm256_permute_pd(a, 0x5);
+    return _mm256_addsub_pd(_mm256_mul_pd(a, _mm256_movedup_pd(b)), _mm256_mul_pd(a_swap, _mm256_permute_pd(b, 0xF)));
+}
+
+// hadd leaves the sums in the order x0 y0 x1 y1
+static inline __m256d avx2_mag(const __m256d x, const __m256d y){
+    __m256d sums = _mm256_hadd_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y));
+    return _mm256_sqrt_pd(_mm256_permute4x64_pd(sums, 0xD8));
+}
+
+#endif
+
+#define KCMUL(a, b) avx2_cmul(a, b)
+#define KMAG(x, y) avx2_mag(x, y)
+
+#include "kernels_simd.h"
+
+#undef KISA
+#undef KNAME
+#undef KVEC
+#undef KWIDTH
+#undef KLOAD
+#undef KSTORE
+#undef KADD
+#undef KSUB
+#undef KMUL
+#undef KMIN
+#undef KMAX
+#undef KSQRT
+#undef KSET1
+#undef KREAL
+#undef KPOW2
+#undef KCMUL
+#undef KMAG
+
+#pragma GCC pop_options
+
+
+
+
+
+
+// AVX-512 foundation, Skylake-X and later
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+#define KISA "avx512"
+#define KNAME(op) avx512_ ## op
+
+#ifdef GABOR_SINGLE
+
+#define KVEC __m512
+#define KWIDTH 16
+#define KLOAD(p) _mm512_loadu_ps(p)
+#define KSTORE(p, v) _mm512_storeu_ps(p, v)
+#define KADD(a, b) _mm512_add_ps(a, b)
+#define KSUB(a, b) _mm512_sub_ps(a, b)
+#define KMUL(a, b) _mm512_mul_ps(a, b)
+#define KMIN(a, b) _mm512_min_ps(a, b)
+#define KMAX(a, b) _mm512_max_ps(a, b)
+#define KSQRT(a) _mm512_sqrt_ps(a)
+#define KSET1(x) _mm512_set1_ps(x)
+#define KREAL(v) _mm512_maskz_mov_ps(0x5555, v)
+#define KPOW2(v) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_castps_si512(v), 23))
+
+// No addsub in AVX-512, the real lanes are subtracted over the sums
+static inline __m512 avx512_cmul(const __m512 a, const __m512 b){
+    __m512 a_swap = _mm512_permute_ps(a, 0xB1);
+    __m512 x = _mm512_mul_ps(a, _mm512_moveldup_ps(b));
+    __m512 y = _mm512_mul_ps(a_swap, _mm512_movehdup_ps(b));
+    return _mm512_mask_sub_ps(_mm512_add_ps(x, y), 0x5555, x, y);
+}
+
+static inline __m512 avx512_mag(const __m512 x, const __m512 y){
+    const __m512i evens = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i odds = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1);
+    __m512 sx = _mm512_mul_ps(x, x);
+    __m512 sy = _mm512_mul_ps(y, y);
+    __m512 re = _mm512_permutex2var_ps(sx, evens, sy);
+    __m512 im = _mm512_permutex2var_ps(sx, odds, sy);
+    return _mm512_sqrt_ps(_mm512_add_ps(re, im));
+}
+
+#else
+
+#define KVEC __m512d
+#define KWIDTH 8
+#define KLOAD(p) _mm512_loadu_pd(p)
+#define KSTORE(p, v) _mm512_storeu_pd(p, v)
+#define KADD(a, b) _mm512_add_pd(a, b)
+#define KSUB(a, b) _mm512_sub_pd(a, b)
+#define KMUL(a, b) _mm512_mul_pd(a, b)
+#define KMIN(a, b) _mm512_min_pd(a, b)
+#define KMAX(a, b) _mm512_max_pd(a, b)
+#define KSQRT(a) _mm512_sqrt_pd(a)
+#define KSET1(x) _mm512_set1_pd(x)
+#define KREAL(v) _mm512_maskz_mov_pd(0x55, v)
+#define KPOW2(v) _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(v), 52))
+
+static inline __m512d avx512_cmul(const __m512d a, const __m512d b){
+    __m512d a_swap = _mm512_permute_pd(a, 0x55);
+    __m512d x = _mm512_mul_pd(a, _mm512_movedup_pd(b));
+    __m512d y = _mm512_mul_pd(a_swap, _mm512_permute_pd(b, 0xFF));
+    return _mm512_mask_sub_pd(_mm512_add_pd(x, y), 0x55, x, y);
+}
+
+static inline __m512d avx512_mag(const __m512d x, const __m512d y){
+    const __m512i evens = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i odds = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+    __m512d sx = _mm512_mul_pd(x, x);
+    __m512d sy = _mm512_mul_pd(y, y);
+    __m512d re = _mm512_permutex2var_pd(sx, evens, sy);
+    __m512d im = _mm512_permutex2var_pd(sx, odds, sy);
+    return _mm512_sqrt_pd(_mm512_add_pd(re, im));
+}
+
+#endif
+
+#define KCMUL(a, b) avx512_cmul(a, b)
+#define KMAG(x, y) avx512_mag(x, y)
+
+#include "kernels_simd.h"
+
+#undef KISA
+#undef KNAME
+#undef KVEC
+#undef KWIDTH
+#undef KLOAD
+#undef KSTORE
+#undef KADD
+#undef KSUB
+#undef KMUL
+#undef KMIN
+#undef KMAX
+#undef KSQRT
+#undef KSET1
+#undef KREAL
+#undef KPOW2
+#undef KCMUL
+#undef KMAG
+
+#pragma GCC pop_options
+
+#endif
+
+
+
+
+
+
+// Every table this build has, best last, and whether the CPU can run it
+static int isa_supported(const struct kernel_table_s* table){
+
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (table == &avx512_kernels){
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (table == &avx2_kernels){
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+
+    return 1;
+
+}
+
+
+static const struct kernel_table_s* const all_kernels[] = {
+    &scalar_kernels,
+#ifdef KERNELS_X86
+    &sse2_kernels,
+    &avx2_kernels,
+    &avx512_kernels,
+#endif
+};
+
+#define NUM_KERNEL_TABLES (sizeof(all_kernels)/sizeof(all_kernels[0]))
+
+static const struct kernel_table_s* active_kernels = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+
+// The widest the CPU runs, unless GABOR_KERNELS names another
+static void pick_kernels(){
+
+    const char* forced = getenv("GABOR_KERNELS");
+
+    for (unsigned int k = 0; k < NUM_KERNEL_TABLES; k++){
+        if (isa_supported(all_kernels[k])){
+            active_kernels = all_kernels[k];
+            if (forced != NULL && strcmp(forced, all_kernels[k]->name) == 0){
+                return;
+            }
+        }
+    }
+
+}
+
+
+static const struct kernel_table_s* kernels(){
+
+    pthread_once(&kernels_once, pick_kernels);
+
+    return active_kernels;
+
+}
+
+
+
+
+
+
+void complex_multiply(complex_t* out, const complex_t* a, const complex_t* b, const unsigned int n){
+    kernels()->multiply(out, a, b, n);
+}
+
+
+void complex_multiply_accumulate(complex_t* acc, const complex_t* a, const complex_t* b, const unsigned int n){
+    kernels()->multiply_accumulate(acc, a, b, n);
+}
+
+
+void complex_scale(complex_t* out, const complex_t* in, const real_t scale, const unsigned int n){
+    kernels()->scale(out, in, scale, n);
+}
+
+
+// out[i] = sum of weights[t]*ins[t][i] over the count arrays, a 1D convolution given shifted
+// pointers into a row or pointers to neighbouring rows. Each out[i] is written after every ins[t][i]
+// is read, in order, so out may be one of ins or start before all of them in the same array,
+// but must not overlap them any other way.
+void complex_weighted_sum(complex_t* out, const complex_t* const* ins, const complex_t* weights, const unsigned int count, const unsigned int n){
+    kernels()->weighted_sum(out, ins, weights, count, n);
+}
+
+
+// acc += Re(in), what reconstruction sums channels with
+void complex_accumulate_real(complex_t* acc, const complex_t* in, const unsigned int n){
+    kernels()->accumulate_real(acc, in, n);
+}
+
+
+void complex_magnitude(real_t* out, const complex_t* in, const unsigned int n){
+    kernels()->magnitude(out, in, n);
+}
+
+
+// Widens *min_val and *max_val to cover the magnitudes, so bands can be folded together
+void complex_magnitude_min_max(const complex_t* in, const unsigned int n, real_t* min_val, real_t* max_val){
+    kernels()->magnitude_min_max(in, n, min_val, max_val);
+}
+
+
+// Magnitudes mapped linearly from [min_val, max_val] onto 0..255, clamped, truncated
+void complex_quantize_u8(uint8_t* out, const complex_t* in, const real_t min_val, const real_t max_val, const unsigned int n){
+    kernels()->quantize_u8(out, in, min_val, max_val, n);
+}
+
+
+// One tap of the brute force bilateral filter along a row: with
+// w = spatial_weight*exp(-(mag[i] - center_mag[i])^2*range_scale),
+// weight[i] += w and (sum_re[i], sum_im[i]) += w*(in_re[i], in_im[i]).
+// The vector paths evaluate exp to within an ulp or two.
+void bilateral_accumulate(real_t* sum_re, real_t* sum_im, real_t* weight, const real_t* in_re, const real_t* in_im, const real_t* mag, const real_t* center_mag, const real_t spatial_weight, const real_t range_scale, const unsigned int n){
+    kernels()->bilateral_accumulate(sum_re, sum_im, weight, in_re, in_im, mag, center_mag, spatial_weight, range_scale, n);
+}
+
+
+const char* kernel_isa_name(){
+    return kernels()->name;
+}
+
+
+// Switch to the named kernels, returns 0 if this build or CPU doesn't have them.
+// Call it before anything else uses the kernels.
+int select_kernel_isa(const char* const name){
+
+    kernels();
+
+    for (unsigned int k = 0; k < NUM_KERNEL_TABLES; k++){
+        if (strcmp(name, all_kernels[k]->name) == 0 && isa_supported(all_kernels[k])){
+            active_kernels = all_kernels[k];
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+
+
+
+
+
+// Largest difference between two real arrays, relative to the largest value in the reference
+static double max_relative_error_real(const real_t* test, const real_t* ref, const unsigned int n){
+
+    double err = 0;
+    double peak = 0;
+    for (unsigned int i = 0; i < n; i++){
+        double diff = fabs((double)test[i] - (double)ref[i]);
+        err = (diff > err) ? diff : err;
+        peak = (fabs((double)ref[i]) > peak) ? fabs((double)ref[i]) : peak;
+    }
+
+    return (peak > 0) ? err/peak : err;
+
+}
+
+
+struct multiply_check_s{
+    complex_t* out;
+    const complex_t* a;
+    const complex_t* b;
+};
+
+
+static void multiply_check_range(void* arg, const unsigned int begin, const unsigned int end){
+    struct multiply_check_s* op = (struct multiply_check_s*)arg;
+    complex_multiply(op->out + begin, op->a + begin, op->b + begin, end - begin);
+}
+
+
+// A multiply split across the loop pool against the same multiply in one call, bit for bit.
+// The count is odd and the thread numbers vary, so band edges fall in the middle of vectors
+// and different elements go through the scalar tails. Leaves the loop pool off.
+static int check_parallel_multiply(){
+
+    const unsigned int count = 100003;
+
+    complex_t* a = (complex_t*)malloc(count*sizeof(complex_t));
+    complex_t* b = (complex_t*)malloc(count*sizeof(complex_t));
+    complex_t* serial = (complex_t*)malloc(count*sizeof(complex_t));
+    complex_t* threaded = (complex_t*)malloc(count*sizeof(complex_t));
+    if (a == NULL || b == NULL || serial == NULL || threaded == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < count; i++){
+        real_t* a_parts = (real_t*)&a[i];
+        real_t* b_parts = (real_t*)&b[i];
+        a_parts[0] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+        a_parts[1] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+        b_parts[0] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+        b_parts[1] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+    }
+
+    complex_multiply(serial, a, b, count);
+
+    struct multiply_check_s op;
+    op.out = threaded;
+    op.a = a;
+    op.b = b;
+
+    int same = 1;
+    for (unsigned int t = 2; t <= 5; t++){
+        set_loop_threads(t);
+        memset(threaded, 0, count*sizeof(complex_t));
+        parallel_for(count, multiply_check_range, &op);
+        same &= memcmp(serial, threaded, count*sizeof(complex_t)) == 0;
+    }
+    set_loop_threads(1);
+
+    printf("threaded %s  multiply over 2 to 5 threads %s the serial one\n", same ? "ok  " : "FAIL", same ? "matches" : "DIFFERS from");
+
+    free(a);
+    free(b);
+    free(serial);
+    free(threaded);
+
+    return !same;
+
+}
+
+
+// Run every vector path the CPU supports against the scalar reference, on lengths
+// that leave every possible tail, then the active kernels split across threads. Prints a line per check, returns the failures.
+int check_kernels(){
+
+    const unsigned int max_n = 259;
+#ifdef GABOR_SINGLE
+    const double tolerance = 1e-6;
+#else
+    const double tolerance = 1e-14;
+#endif
+
+    complex_t* a = (complex_t*)malloc(max_n*sizeof(complex_t));
+    complex_t* b = (complex_t*)malloc(max_n*sizeof(complex_t));
+    complex_t* ref = (complex_t*)malloc(max_n*sizeof(complex_t));
+    complex_t* test = (complex_t*)malloc(max_n*sizeof(complex_t));
+    real_t* ref_real = (real_t*)malloc(max_n*sizeof(real_t));
+    real_t* test_real = (real_t*)malloc(max_n*sizeof(real_t));
+    uint8_t* ref_u8 = (uint8_t*)malloc(max_n);
+    uint8_t* test_u8 = (uint8_t*)malloc(max_n);
+    // Real and imaginary parts of a, magnitudes of a and b, then the bilateral sums for each side
+    real_t* planes = (real_t*)malloc(10*max_n*sizeof(real_t));
+    if (a == NULL || b == NULL || ref == NULL || test == NULL || ref_real == NULL || test_real == NULL || ref_u8 == NULL || test_u8 == NULL || planes == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(12345);
+    for (unsigned int i = 0; i < max_n; i++){
+        real_t* a_parts = (real_t*)&a[i];
+        real_t* b_parts = (real_t*)&b[i];
+        a_parts[0] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+        a_parts[1] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+        b_parts[0] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+        b_parts[1] = (real_t)(rand()/(double)RAND_MAX - 0.5);
+    }
+
+    real_t* a_re = planes;
+    real_t* a_im = planes + max_n;
+    real_t* a_mag = planes + 2*max_n;
+    real_t* b_mag = planes + 3*max_n;
+    real_t* ref_sums = planes + 4*max_n;
+    real_t* test_sums = planes + 7*max_n;
+    for (unsigned int i = 0; i < max_n; i++){
+        a_re[i] = CREAL(a[i]);
+        a_im[i] = CIMAG(a[i]);
+    }
+    scalar_kernels.magnitude(a_mag, a, max_n);
+    scalar_kernels.magnitude(b_mag, b, max_n);
+
+    int failures = 0;
+
+    for (unsigned int k = 1; k < NUM_KERNEL_TABLES; k++){
+
+        const struct kernel_table_s* table = all_kernels[k];
+        if (!isa_supported(table)){
+            printf("%-8s not supported by this CPU\n", table->name);
+            continue;
+        }
+
+        double worst = 0;
+        int exact = 1;
+
+        for (unsigned int n = 0; n <= max_n; n++){
+
+            scalar_kernels.multiply(ref, a, b, n);
+            table->multiply(test, a, b, n);
+            exact &= memcmp(ref, test, n*sizeof(complex_t)) == 0;
+
+            memcpy(ref, b, n*sizeof(complex_t));
+            memcpy(test, b, n*sizeof(complex_t));
+            scalar_kernels.multiply_accumulate(ref, a, b, n);
+            table->multiply_accumulate(test, a, b, n);
+            exact &= memcmp(ref, test, n*sizeof(complex_t)) == 0;
+
+            const complex_t* shifted[3] = {a, b, a + (n > 0)};
+            scalar_kernels.weighted_sum(ref, shifted, b + max_n - 3, n > 0 ? 3 : 0, n - (n > 0));
+            table->weighted_sum(test, shifted, b + max_n - 3, n > 0 ? 3 : 0, n - (n > 0));
+            exact &= memcmp(ref, test, (n - (n > 0))*sizeof(complex_t)) == 0;
+
+            scalar_kernels.scale(ref, a, (real_t)0.37, n);
+            table->scale(test, a, (real_t)0.37, n);
+            exact &= memcmp(ref, test, n*sizeof(complex_t)) == 0;
+
+            memcpy(ref, b, n*sizeof(complex_t));
+            memcpy(test, b, n*sizeof(complex_t));
+            scalar_kernels.accumulate_real(ref, a, n);
+            table->accumulate_real(test, a, n);
+            exact &= memcmp(ref, test, n*sizeof(complex_t)) == 0;
+
+            scalar_kernels.magnitude(ref_real, a, n);
+            table->magnitude(test_real, a, n);
+            exact &= memcmp(ref_real, test_real, n*sizeof(real_t)) == 0;
+
+            real_t ref_min = 10, ref_max = -1, test_min = 10, test_max = -1;
+            scalar_kernels.magnitude_min_max(a, n, &ref_min, &ref_max);
+            table->magnitude_min_max(a, n, &test_min, &test_max);
+            exact &= (ref_min == test_min) && (ref_max == test_max);
+
+            scalar_kernels.quantize_u8(ref_u8, a, (real_t)0.1, (real_t)0.6, n);
+            table->quantize_u8(test_u8, a, (real_t)0.1, (real_t)0.6, n);
+            exact &= memcmp(ref_u8, test_u8, n) == 0;
+
+            // Two taps, the second with differences far enough out for the weights to underflow
+            memset(ref_sums, 0, 3*max_n*sizeof(real_t));
+            memset(test_sums, 0, 3*max_n*sizeof(real_t));
+            scalar_kernels.bilateral_accumulate(ref_sums, ref_sums + max_n, ref_sums + 2*max_n, a_re, a_im, a_mag, b_mag, (real_t)0.8, (real_t)40, n);
+            table->bilateral_accumulate(test_sums, test_sums + max_n, test_sums + 2*max_n, a_re, a_im, a_mag, b_mag, (real_t)0.8, (real_t)40, n);
+            scalar_kernels.bilateral_accumulate(ref_sums, ref_sums + max_n, ref_sums + 2*max_n, a_re, a_im, b_mag, a_mag, (real_t)0.3, (real_t)3000, n);
+            table->bilateral_accumulate(test_sums, test_sums + max_n, test_sums + 2*max_n, a_re, a_im, b_mag, a_mag, (real_t)0.3, (real_t)3000, n);
+            for (unsigned int s = 0; s < 3; s++){
+                worst = fmax(worst, max_relative_error_real(test_sums + s*max_n, ref_sums + s*max_n, n));
+            }
+
+        }
+
+        int passed = exact && worst <= tolerance;
+        failures += !passed;
+
+        printf("%-8s %s  bilateral error %.2e, other kernels %s\n", table->name, passed ? "ok  " : "FAIL", worst, exact ? "exact" : "DIFFER");
+
+    }
+
+    free(a);
+    free(b);
+    free(ref);
+    free(test);
+    free(ref_real);
+    free(test_real);
+    free(ref_u8);
+    free(test_u8);
+    free(planes);
+
+    failures += check_parallel_multiply();
+
+    return failures;
+
+}
@@ -0,0 +1,35 @@
+#ifndef kernels_h
+#define kernels_h
+
+#include "types.h"
+
+#include <stdint.h>
+
+// Elementwise loops over complex arrays, dispatched at runtime to the widest
+// instruction set the CPU has. Arrays may alias when they are the same array.
+
+void complex_multiply(complex_t* out, const complex_t* a, const complex_t* b, const unsigned int n);
+
+void complex_multiply_accumulate(complex_t* acc, const complex_t* a, const complex_t* b, const unsigned int n);
+
+void complex_scale(complex_t* out, const complex_t* in, const real_t scale, const unsigned int n);
+
+void complex_weighted_sum(complex_t* out, const complex_t* const* ins, const complex_t* weights, const unsigned int count, const unsigned int n);
+
+void complex_accumulate_real(complex_t* acc, const complex_t* in, const unsigned int n);
+
+void complex_magnitude(real_t* out, const complex_t* in, const unsigned int n);
+
+void complex_magnitude_min_max(const complex_t* in, const unsigned int n, real_t* min_val, real_t* max_val);
+
+void complex_quantize_u8(uint8_t* out, const complex_t* in, const real_t min_val, const real_t max_val, const unsigned int n);
+
+void bilateral_accumulate(real_t* sum_re, real_t* sum_im, real_t* weight, const real_t* in_re, const real_t* in_im, const real_t* mag, const real_t* center_mag, const real_t spatial_weight, const real_t range_scale, const unsigned int n);
+
+const char* kernel_isa_name();
+
+int select_kernel_isa(const char* const name);
+
+int check_kernels();
+
+#endif
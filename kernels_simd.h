@@ -0,0 +1,244 @@
+// Vector versions of the kernels in kernels.c, written once against the K* macros.
+// kernels.c includes this once per instruction set, with the macros defined for it:
+//   KNAME(op)         suffixes the function names
+//   KVEC, KWIDTH      vector type and the number of real_t lanes in it
+//   KLOAD, KSTORE     unaligned load and store of KWIDTH reals
+//   KADD, KSUB, KMUL, KMIN, KMAX, KSQRT, KSET1
+//   KCMUL(a, b)       complex multiply, KWIDTH/2 complex values per vector
+//   KREAL(v)          zero the imaginary lanes
+//   KMAG(x, y)        magnitudes of the KWIDTH complex values in x then y
+//   KPOW2(v)          2^k, for v holding k plus the exponent bias in the low bits of its mantissa
+
+
+static void KNAME(multiply)(complex_t* out, const complex_t* a, const complex_t* b, const unsigned int n){
+
+    const unsigned int step = KWIDTH/2;
+    unsigned int i = 0;
+
+    for (; i + step <= n; i += step){
+        KVEC va = KLOAD((const real_t*)(a + i));
+        KVEC vb = KLOAD((const real_t*)(b + i));
+        KSTORE((real_t*)(out + i), KCMUL(va, vb));
+    }
+
+    scalar_multiply(out + i, a + i, b + i, n - i);
+
+}
+
+
+static void KNAME(multiply_accumulate)(complex_t* acc, const complex_t* a, const complex_t* b, const unsigned int n){
+
+    const unsigned int step = KWIDTH/2;
+    unsigned int i = 0;
+
+    for (; i + step <= n; i += step){
+        KVEC va = KLOAD((const real_t*)(a + i));
+        KVEC vb = KLOAD((const real_t*)(b + i));
+        KVEC vacc = KLOAD((const real_t*)(acc + i));
+        KSTORE((real_t*)(acc + i), KADD(vacc, KCMUL(va, vb)));
+    }
+
+    scalar_multiply_accumulate(acc + i, a + i, b + i, n - i);
+
+}
+
+
+static void KNAME(scale)(complex_t* out, const complex_t* in, const real_t scale, const unsigned int n){
+
+    const unsigned int step = KWIDTH/2;
+    const KVEC vscale = KSET1(scale);
+    unsigned int i = 0;
+
+    for (; i + step <= n; i += step){
+        KSTORE((real_t*)(out + i), KMUL(KLOAD((const real_t*)(in + i)), vscale));
+    }
+
+    scalar_scale(out + i, in + i, scale, n - i);
+
+}
+
+
+static void KNAME(weighted_sum)(complex_t* out, const complex_t* const* ins, const complex_t* weights, const unsigned int count, const unsigned int n){
+
+    const unsigned int step = KWIDTH/2;
+    unsigned int i = 0;
+
+    if (count == 0){
+        scalar_weighted_sum(out, ins, weights, count, n);
+        return;
+    }
+
+    // Each weight repeated across a vector, so the sum for a vector of outputs stays in a register
+    complex_t repeated[count*step];
+    for (unsigned int t = 0; t < count; t++){
+        for (unsigned int l = 0; l < step; l++){
+            repeated[t*step + l] = weights[t];
+        }
+    }
+
+    for (; i + step <= n; i += step){
+        KVEC sum = KSET1(0);
+        for (unsigned int t = 0; t < count; t++){
+            KVEC vin = KLOAD((const real_t*)(ins[t] + i));
+            sum = KADD(sum, KCMUL(vin, KLOAD((const real_t*)(repeated + t*step))));
+        }
+        KSTORE((real_t*)(out + i), sum);
+    }
+
+    scalar_weighted_sum_from(out, ins, weights, count, i, n);
+
+}
+
+
+static void KNAME(accumulate_real)(complex_t* acc, const complex_t* in, const unsigned int n){
+
+    const unsigned int step = KWIDTH/2;
+    unsigned int i = 0;
+
+    for (; i + step <= n; i += step){
+        KVEC vacc = KLOAD((const real_t*)(acc + i));
+        KSTORE((real_t*)(acc + i), KADD(vacc, KREAL(KLOAD((const real_t*)(in + i)))));
+    }
+
+    scalar_accumulate_real(acc + i, in + i, n - i);
+
+}
+
+
+static void KNAME(magnitude)(real_t* out, const complex_t* in, const unsigned int n){
+
+    unsigned int i = 0;
+
+    for (; i + KWIDTH <= n; i += KWIDTH){
+        KVEC x = KLOAD((const real_t*)(in + i));
+        KVEC y = KLOAD((const real_t*)(in + i + KWIDTH/2));
+        KSTORE(out + i, KMAG(x, y));
+    }
+
+    scalar_magnitude(out + i, in + i, n - i);
+
+}
+
+
+static void KNAME(magnitude_min_max)(const complex_t* in, const unsigned int n, real_t* min_val, real_t* max_val){
+
+    KVEC vmin = KSET1(*min_val);
+    KVEC vmax = KSET1(*max_val);
+    unsigned int i = 0;
+
+    for (; i + KWIDTH <= n; i += KWIDTH){
+        KVEC x = KLOAD((const real_t*)(in + i));
+        KVEC y = KLOAD((const real_t*)(in + i + KWIDTH/2));
+        KVEC mag = KMAG(x, y);
+        vmin = KMIN(vmin, mag);
+        vmax = KMAX(vmax, mag);
+    }
+
+    // Fold the lanes together
+    real_t lanes_min[KWIDTH];
+    real_t lanes_max[KWIDTH];
+    KSTORE(lanes_min, vmin);
+    KSTORE(lanes_max, vmax);
+    for (unsigned int l = 0; l < KWIDTH; l++){
+        if (lanes_min[l] < *min_val){
+            *min_val = lanes_min[l];
+        }
+        if (lanes_max[l] > *max_val){
+            *max_val = lanes_max[l];
+        }
+    }
+
+    scalar_magnitude_min_max(in + i, n - i, min_val, max_val);
+
+}
+
+
+static void KNAME(quantize_u8)(uint8_t* out, const complex_t* in, const real_t min_val, const real_t max_val, const unsigned int n){
+
+    const real_t scale = quantize_scale(min_val, max_val);
+    const KVEC vmin = KSET1(min_val);
+    const KVEC vscale = KSET1(scale);
+    const KVEC vzero = KSET1(0);
+    const KVEC vtop = KSET1(255);
+    real_t levels[KWIDTH];
+    unsigned int i = 0;
+
+    for (; i + KWIDTH <= n; i += KWIDTH){
+        KVEC x = KLOAD((const real_t*)(in + i));
+        KVEC y = KLOAD((const real_t*)(in + i + KWIDTH/2));
+        KVEC level = KMUL(KSUB(KMAG(x, y), vmin), vscale);
+        KSTORE(levels, KMIN(KMAX(level, vzero), vtop));
+        for (unsigned int l = 0; l < KWIDTH; l++){
+            out[i + l] = (uint8_t)levels[l];
+        }
+    }
+
+    scalar_quantize_u8(out + i, in + i, min_val, max_val, n - i);
+
+}
+
+
+// exp(x) for x <= 0. x = k*ln(2) + r with |r| <= ln(2)/2, then exp(x) = 2^k*exp(r).
+// Adding 1.5*2^52 (2^23 for floats) rounds x/ln(2) to the integer k in the low bits of the mantissa,
+// the bias added along with it leaves them ready to shift into the exponent. Below the clamp
+// the result would leave the normal range, the callers' weights are long negligible by then.
+static inline KVEC KNAME(exp_neg)(KVEC x){
+
+#ifdef GABOR_SINGLE
+    const KVEC shift = KSET1(12582912.0f + 127);
+    const KVEC ln2_hi = KSET1(0.693359375f);
+    const KVEC ln2_lo = KSET1(-2.12194440e-4f);
+    x = KMAX(x, KSET1(-87.0f));
+    KVEC shifted = KADD(KMUL(x, KSET1(1.44269504f)), shift);
+#else
+    const KVEC shift = KSET1(6755399441055744.0 + 1023);
+    const KVEC ln2_hi = KSET1(6.93145751953125e-1);
+    const KVEC ln2_lo = KSET1(1.42860682030941723212e-6);
+    x = KMAX(x, KSET1(-708.0));
+    KVEC shifted = KADD(KMUL(x, KSET1(1.4426950408889634)), shift);
+#endif
+
+    KVEC k = KSUB(shifted, shift);
+    KVEC r = KSUB(KSUB(x, KMUL(k, ln2_hi)), KMUL(k, ln2_lo));
+
+    KVEC p = KSET1(exp_taylor[EXP_DEGREE]);
+    for (int t = EXP_DEGREE - 1; t >= 0; t--){
+        p = KADD(KMUL(p, r), KSET1(exp_taylor[t]));
+    }
+
+    return KMUL(p, KPOW2(shifted));
+
+}
+
+
+static void KNAME(bilateral_accumulate)(real_t* sum_re, real_t* sum_im, real_t* weight, const real_t* in_re, const real_t* in_im, const real_t* mag, const real_t* center_mag, const real_t spatial_weight, const real_t range_scale, const unsigned int n){
+
+    const KVEC vspatial = KSET1(spatial_weight);
+    const KVEC vscale = KSET1(-range_scale);
+    unsigned int i = 0;
+
+    for (; i + KWIDTH <= n; i += KWIDTH){
+        KVEC diff = KSUB(KLOAD(mag + i), KLOAD(center_mag + i));
+        KVEC w = KMUL(vspatial, KNAME(exp_neg)(KMUL(KMUL(diff, diff), vscale)));
+        KSTORE(weight + i, KADD(KLOAD(weight + i), w));
+        KSTORE(sum_re + i, KADD(KLOAD(sum_re + i), KMUL(w, KLOAD(in_re + i))));
+        KSTORE(sum_im + i, KADD(KLOAD(sum_im + i), KMUL(w, KLOAD(in_im + i))));
+    }
+
+    scalar_bilateral_accumulate(sum_re + i, sum_im + i, weight + i, in_re + i, in_im + i, mag + i, center_mag + i, spatial_weight, range_scale, n - i);
+
+}
+
+
+static const struct kernel_table_s KNAME(kernels) = {
+    KISA,
+    KNAME(multiply),
+    KNAME(multiply_accumulate),
+    KNAME(scale),
+    KNAME(weighted_sum),
+    KNAME(accumulate_real),
+    KNAME(magnitude),
+    KNAME(magnitude_min_max),
+    KNAME(quantize_u8),
+    KNAME(bilateral_accumulate)
+};
@@ -1,76 +1,561 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "types.h"
 #include "image.h"
 #include "gabor.h"
 #include "filter.h"
 #include "convolve.h"
 #include "bilateral.h"
+#include "pipeline.h"
+#include "bankcache.h"
+#include "tuner.h"
+#include "kernels.h"
+#include "workspace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <FreeImage.h>
 #include <complex.h>
+#include <math.h>
 #include <fftw3.h>
-#include <dirent.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// gabor wisdom [-r estimate|measure|patient|exhaustive] [-o file] <height>x<width> ...
+// Plan every transform for the given sizes and save the wisdom, so later runs start straight away
+static int generate_wisdom(int argc, char* argv[]){
+
+    const char* path = DEFAULT_WISDOM_PATH;
+    unsigned int rigor = FFTW_MEASURE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:o:")) != -1){
+        switch (opt){
+            case 'r':
+                if (!parse_plan_rigor(optarg, &rigor)){
+                    fprintf(stderr, "Unknown planning rigor %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s wisdom [-r estimate|measure|patient|exhaustive] [-o file] <height>x<width> ...\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
-int main(int argc, char* argv[]){
+    // Build on whatever is already there
+    load_fftw_wisdom(path);
+    set_plan_rigor(rigor);
 
-    // Path to process
-    char path[] = "/home/glenn/documents/schoolwork/grad/thesis/imgs/temp/";
+    for (int i = optind; i < argc; i++){
+
+        unsigned int height, width;
+        if (sscanf(argv[i], "%ux%u", &height, &width) != 2){
+            fprintf(stderr, "Sizes look like 800x800, not %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        prepare_fft_plans(height, width);
+
+    }
+
+    int saved = save_fftw_wisdom(path);
+    cleanup_fftw();
+
+    return saved ? 0 : EXIT_FAILURE;
+
+}
 
-    // Initialize the image IO library
-    FreeImage_Initialise(FALSE);
 
-    // Structures for Gabor Transform
-    struct image_s img;
-    struct gabor_filter_bank_s bank;
-    struct gabor_responses_s resps;
 
-    // Structures for directory parsing
-    struct dirent *entry;
-    DIR *dp;
+// Images per second for one bank applied to num_images copies of a synthetic image at a time,
+// blocks of block_size channels
+static double time_gabor_filter_bank(struct gabor_filter_bank_s bank, const struct image_real_s img, const unsigned int num_images, const unsigned int block_size, const unsigned int reps){
 
-    // Open the directory
-    dp = opendir(path);
-    if (dp == NULL) {
+    bank.block_size = block_size;
+
+    struct image_real_s* imgs = (struct image_real_s*)malloc(num_images*sizeof(struct image_real_s));
+    struct gabor_responses_s* resps = (struct gabor_responses_s*)malloc(num_images*sizeof(struct gabor_responses_s));
+    if (imgs == NULL || resps == NULL){
+        fprintf(stderr, "Malloc failed\n");
         exit(EXIT_FAILURE);
     }
+    for (unsigned int n = 0; n < num_images; n++){
+        imgs[n] = img;
+    }
 
-    //bank = init_gabor_filter_bank_exhaustive(800, 800);
-    bank = init_gabor_filter_bank_default(800, 800);
-    disp_gabor_filter_bank(bank, "aaa");
+    struct workspace_s ws = init_workspace(gabor_batch_workspace_size(bank, num_images), 0);
 
-    // Process each file in the directory
-    while((entry = readdir(dp))){
-        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")){
+    // Warm up, so planning is not timed
+    apply_gabor_filter_bank_real_batch_workspace(imgs, num_images, bank, resps, &ws);
+    reset_workspace(&ws);
 
-            printf("%s\n",(entry->d_name));
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-            char image_path[300];
-            image_path[0] = '\0';
+    for (unsigned int r = 0; r < reps; r++){
+        apply_gabor_filter_bank_real_batch_workspace(imgs, num_images, bank, resps, &ws);
+        reset_workspace(&ws);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (double)(stop.tv_sec - start.tv_sec) + 1e-9*(double)(stop.tv_nsec - start.tv_nsec);
 
-            strncat(image_path, path, 300);
-            strncat(image_path, entry->d_name, 300);
+    free_workspace(&ws);
+    free(imgs);
+    free(resps);
 
-            img = init_image_from_path(image_path);
+    return (seconds > 0) ? reps*num_images/seconds : 0.0;
 
-            resps = apply_gabor_filter_bank(img, bank);
+}
 
-            save_gabor_responses(resps, entry->d_name);
 
-            free_gabor_responses(resps);
-            free_image(img);
 
+// gabor benchmark [-n reps] [-N images] [-R spatial_radius] [-G recursive_sigma] [-A tolerance] <height>x<width> <block size> ...
+// Throughput of the default and exhaustive banks for each number of channels per batched inverse transform,
+// taking the images N at a time
+static int benchmark_block_sizes(int argc, char* argv[]){
+
+    unsigned int reps = 10;
+    unsigned int num_images = 1;
+    unsigned int spatial_radius = 0;
+    double recursive_sigma = 0;
+    double tolerance = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:N:R:G:A:")) != -1){
+        switch (opt){
+            case 'n':
+                reps = atoi(optarg);
+                break;
+            case 'N':
+                num_images = atoi(optarg);
+                break;
+            case 'R':
+                spatial_radius = atoi(optarg);
+                break;
+            case 'G':
+                recursive_sigma = atof(optarg);
+                break;
+            case 'A':
+                tolerance = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s benchmark [-n reps] [-N images] [-R spatial_radius] [-G recursive_sigma] [-A tolerance] <height>x<width> <block size> ...\n", argv[0]);
+                exit(EXIT_FAILURE);
         }
     }
 
-    free_gabor_filter_bank(bank);
+    unsigned int height, width;
+    if (optind >= argc || sscanf(argv[optind], "%ux%u", &height, &width) != 2 || reps == 0 || num_images == 0){
+        fprintf(stderr, "Usage: %s benchmark [-n reps] [-N images] [-R spatial_radius] [-G recursive_sigma] [-A tolerance] <height>x<width> <block size> ...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Something with edges in every direction
+    struct image_real_s img = init_image_real_empty(height, width);
+    for (unsigned int i = 0; i < height; i++){
+        for (unsigned int j = 0; j < width; j++){
+            img.vals[i][j] = (real_t)((i*7 + j*13) % 256) + (real_t)(((i/16 + j/16) % 2)*64);
+        }
+    }
+
+    unsigned int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    struct gabor_filter_bank_s banks[2];
+    banks[0] = compile_gabor_filter_bank(init_gabor_filter_bank_default(height, width), num_threads);
+    banks[1] = compile_gabor_filter_bank(init_gabor_filter_bank_exhaustive(height, width), num_threads);
+    const char* names[2] = {"default", "exhaustive"};
+    banks[0].spatial_max_radius = spatial_radius;
+    banks[1].spatial_max_radius = spatial_radius;
+    banks[0].recursive_min_sigma = recursive_sigma;
+    banks[1].recursive_min_sigma = recursive_sigma;
+    for (unsigned int b = 0; b < 2 && tolerance > 0; b++){
+        banks[b] = tune_gabor_filter_bank(banks[b], tolerance);
+        disp_gabor_engine_plan(banks[b]);
+    }
+
+    for (unsigned int b = 0; b < 2; b++){
+        printf("%s bank, %u filters, %ux%u, %u threads, %u images at a time\n", names[b], banks[b].num_filters, height, width, num_threads, num_images);
+        for (int i = optind + 1; i < argc; i++){
+            unsigned int block_size = atoi(argv[i]);
+            if (block_size == 0){
+                block_size = 1;
+            }
+            printf("    K = %2u: %8.2f images/sec\n", block_size, time_gabor_filter_bank(banks[b], img, num_images, block_size, reps));
+        }
+        free_gabor_filter_bank(banks[b]);
+    }
+
+    free_image_real(img);
+    cleanup_fftw();
+
+    return 0;
+
+}
+
+
+
+// gabor check-recursive [<height>x<width>]
+// Error of the recursive path against the frequency domain one, for every filter of both banks
+static int check_recursive(int argc, char* argv[]){
+
+    unsigned int height = 256;
+    unsigned int width = 256;
+    if (argc >= 2 && sscanf(argv[1], "%ux%u", &height, &width) != 2){
+        fprintf(stderr, "Usage: %s check-recursive [<height>x<width>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Same test image as the benchmark
+    struct image_real_s img = init_image_real_empty(height, width);
+    for (unsigned int i = 0; i < height; i++){
+        for (unsigned int j = 0; j < width; j++){
+            img.vals[i][j] = (real_t)((i*7 + j*13) % 256) + (real_t)(((i/16 + j/16) % 2)*64);
+        }
+    }
+
+    struct gabor_filter_bank_s banks[2];
+    banks[0] = init_gabor_filter_bank_default(height, width);
+    banks[1] = init_gabor_filter_bank_exhaustive(height, width);
+    const char* names[2] = {"default", "exhaustive"};
+
+    for (unsigned int b = 0; b < 2; b++){
+        printf("%s bank, %u filters, %ux%u\n", names[b], banks[b].num_filters, height, width);
+        check_gabor_recursive(banks[b], img);
+        free_gabor_filter_bank(banks[b]);
+    }
+
+    free_image_real(img);
+    cleanup_fftw();
+
+    return 0;
+
+}
+
+
+
+// Largest single precision error allowed, relative to the peak of the double precision response
+#define PRECISION_TOLERANCE 1e-4
+
+// gabor check-precision [-r reference_prefix] [-e tolerance] [<height>x<width>]
+// Applies both banks to a synthetic image and saves the responses to <precision>_<bank>.dat.
+// Given the prefix a build of the other precision saved under, e.g. "-r double" in the single build,
+// also reports the error against those, and fails if it is above the tolerance.
+static int check_precision(int argc, char* argv[]){
+
+    const char* reference = NULL;
+    double tolerance = PRECISION_TOLERANCE;
+    unsigned int height = 256;
+    unsigned int width = 256;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:e:")) != -1){
+        switch (opt){
+            case 'r':
+                reference = optarg;
+                break;
+            case 'e':
+                tolerance = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s check-precision [-r reference_prefix] [-e tolerance] [<height>x<width>]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc && sscanf(argv[optind], "%ux%u", &height, &width) != 2){
+        fprintf(stderr, "Usage: %s check-precision [-r reference_prefix] [-e tolerance] [<height>x<width>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef GABOR_SINGLE
+    const char* precision = "single";
+#else
+    const char* precision = "double";
+#endif
+
+    // Same test image as the benchmark
+    struct image_real_s img = init_image_real_empty(height, width);
+    for (unsigned int i = 0; i < height; i++){
+        for (unsigned int j = 0; j < width; j++){
+            img.vals[i][j] = (real_t)((i*7 + j*13) % 256) + (real_t)(((i/16 + j/16) % 2)*64);
+        }
+    }
+
+    struct gabor_filter_bank_s banks[2];
+    banks[0] = init_gabor_filter_bank_default(height, width);
+    banks[1] = init_gabor_filter_bank_exhaustive(height, width);
+    const char* names[2] = {"default", "exhaustive"};
+
+    int failures = 0;
+
+    for (unsigned int b = 0; b < 2; b++){
+
+        banks[b] = compile_gabor_filter_bank(banks[b], sysconf(_SC_NPROCESSORS_ONLN));
+        struct gabor_responses_s resps = apply_gabor_filter_bank_real(img, banks[b]);
+
+        char prefix[200];
+        snprintf(prefix, 200, "%s_%s", precision, names[b]);
+        save_gabor_responses(resps, prefix);
+        printf("%s bank, %u filters, %ux%u: saved %s.dat\n", names[b], banks[b].num_filters, height, width, prefix);
+
+        if (reference != NULL){
+            char path_test[210];
+            char path_ref[210];
+            snprintf(path_test, 210, "%s.dat", prefix);
+            snprintf(path_ref, 210, "%s_%s.dat", reference, names[b]);
+            printf("    against %s: ", path_ref);
+            double err = compare_gabor_responses(path_test, path_ref);
+            if (err > tolerance){
+                printf("    FAIL, above the tolerance of %g\n", tolerance);
+                failures++;
+            }
+        }
+
+        free_gabor_responses(resps);
+        free_gabor_filter_bank(banks[b]);
+
+    }
+
+    free_image_real(img);
+    cleanup_fftw();
+
+    return failures > 0;
+
+}
+
+
+
+// gabor check-bilateral [<height>x<width> [<sigma spatial> <sigma range>]]
+// Error and time of the bilateral grid and the exact filter against the brute force reference
+static int check_bilateral(int argc, char* argv[]){
+
+    unsigned int height = 256;
+    unsigned int width = 256;
+    double sigma_spatial = 5;
+    double sigma_range = 40;
+    if ((argc >= 2 && sscanf(argv[1], "%ux%u", &height, &width) != 2) ||
+        (argc >= 4 && (sscanf(argv[2], "%lf", &sigma_spatial) != 1 || sscanf(argv[3], "%lf", &sigma_range) != 1))){
+        fprintf(stderr, "Usage: %s check-bilateral [<height>x<width> [<sigma spatial> <sigma range>]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Smooth shading, hard edges and a little texture, in 8 bit counts
+    struct image_s img = init_image_empty(height, width);
+    for (unsigned int i = 0; i < height; i++){
+        for (unsigned int j = 0; j < width; j++){
+            img.vals[i][j] = (real_t)(100 + 60*sin(0.05*i)*cos(0.07*j) + ((i/32 + j/32) % 2)*80 + (i*131 + j*71) % 17);
+        }
+    }
+
+    struct image_s ref = init_image_empty(height, width);
+    struct image_s out = init_image_empty(height, width);
+    struct image_s exact = init_image_empty(height, width);
+
+    struct timespec start, middle, stop, exact_stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bilateral_filter_reference(img, ref, sigma_spatial, sigma_range);
+    clock_gettime(CLOCK_MONOTONIC, &middle);
+    bilateral_filter(img, out, sigma_spatial, sigma_range);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    bilateral_filter_exact(img, exact, sigma_spatial, sigma_range);
+    clock_gettime(CLOCK_MONOTONIC, &exact_stop);
+
+    double max_err = 0;
+    double sum_err = 0;
+    double max_exact_err = 0;
+    for (unsigned int i = 0; i < height; i++){
+        for (unsigned int j = 0; j < width; j++){
+            double err = cabs(out.vals[i][j] - ref.vals[i][j]);
+            sum_err += err;
+            max_err = (err > max_err) ? err : max_err;
+            double exact_err = cabs(exact.vals[i][j] - ref.vals[i][j]);
+            max_exact_err = (exact_err > max_exact_err) ? exact_err : max_exact_err;
+        }
+    }
+
+    double ref_seconds = (double)(middle.tv_sec - start.tv_sec) + 1e-9*(double)(middle.tv_nsec - start.tv_nsec);
+    double grid_seconds = (double)(stop.tv_sec - middle.tv_sec) + 1e-9*(double)(stop.tv_nsec - middle.tv_nsec);
+    double exact_seconds = (double)(exact_stop.tv_sec - stop.tv_sec) + 1e-9*(double)(exact_stop.tv_nsec - stop.tv_nsec);
+
+    printf("%ux%u, sigma spatial %g, sigma range %g, %s kernels\n", height, width, sigma_spatial, sigma_range, kernel_isa_name());
+    printf("    reference %.3f s, grid %.3f s, exact %.3f s\n", ref_seconds, grid_seconds, exact_seconds);
+    printf("    grid max error %g, mean error %g\n", max_err, sum_err/(height*width));
+    printf("    exact max error %g\n", max_exact_err);
+
     free_image(img);
-    free_gabor_responses(resps);
+    free_image(ref);
+    free_image(out);
+    free_image(exact);
 
-    closedir(dp);
+    // The exact filter only reorders rounding, in single precision that is a few float ulps of the counts
+#ifdef GABOR_SINGLE
+    return max_exact_err > 1e-3;
+#else
+    return max_exact_err > 1e-6;
+#endif
 
-    fftw_cleanup();
+}
+
+
+
+int main(int argc, char* argv[]){
+
+    // gabor wisdom ...
+    if (argc >= 2 && strcmp(argv[1], "wisdom") == 0){
+        return generate_wisdom(argc - 1, argv + 1);
+    }
+
+    // gabor benchmark ...
+    if (argc >= 2 && strcmp(argv[1], "benchmark") == 0){
+        return benchmark_block_sizes(argc - 1, argv + 1);
+    }
+
+    // gabor check-recursive ...
+    if (argc >= 2 && strcmp(argv[1], "check-recursive") == 0){
+        return check_recursive(argc - 1, argv + 1);
+    }
+
+    // gabor check-precision ...
+    if (argc >= 2 && strcmp(argv[1], "check-precision") == 0){
+        return check_precision(argc - 1, argv + 1);
+    }
+
+    // gabor check-bilateral ...
+    if (argc >= 2 && strcmp(argv[1], "check-bilateral") == 0){
+        return check_bilateral(argc - 1, argv + 1);
+    }
+
+    // gabor check-kernels [isa]
+    // Run each vector kernel the CPU supports against the scalar ones, then report which is used
+    if (argc >= 2 && strcmp(argv[1], "check-kernels") == 0){
+        int failures = check_kernels();
+        if (argc >= 3 && !select_kernel_isa(argv[2])){
+            fprintf(stderr, "Kernels %s not available\n", argv[2]);
+            return 1;
+        }
+        printf("using %s\n", kernel_isa_name());
+        return failures > 0;
+    }
+
+    // gabor compare <test.dat> <reference.dat> [tolerance]
+    // e.g. to check the single precision build against the double one, fails above the tolerance
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "compare") == 0){
+        double tolerance = (argc == 5) ? atof(argv[4]) : PRECISION_TOLERANCE;
+        return compare_gabor_responses(argv[2], argv[3]) > tolerance;
+    }
+
+    struct pipeline_config_s config = init_pipeline_config_default();
+    const char* wisdom_path = DEFAULT_WISDOM_PATH;
+    const char* cache_dir = DEFAULT_BANK_CACHE_DIR;
+
+    // -W <file> : wisdom to start from, and to save what is learned to
+    // -C <dir> : where compiled filter banks are cached between runs
+    // -T <n> : split each transform over n threads, for very large images
+    // -d/-t/-w <n> : threads for the decode, transform and write stages
+    // -q <n> : images allowed to wait between two stages
+    // -H : back per-image buffers with large pages
+    // -S : keep spectra and responses as separate real and imaginary planes
+    // -K <n> : inverse transform channels n at a time with one batched plan
+    // -R <n> : convolve filters whose kernel fits in radius n spatially, with two 1D passes
+    // -G <sigma> : run filters at least this wide through recursive Gaussians. Not exact: on the benchmark image at
+    //              128x128, gabor check-recursive measures 0.4-2.7% rms and up to 6.7% max error relative to the peak,
+    //              for every sigma and angle of both banks
+    // -A <tolerance> : time every engine on every filter and use the fastest within tolerance, overrides -R and -G.
+    //                  The choice is saved next to the wisdom, so only the first run for a bank pays for it.
+    int split = 0;
+    unsigned int block_size = 1;
+    unsigned int spatial_radius = 0;
+    double recursive_sigma = 0;
+    double tolerance = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "W:C:T:d:t:w:q:HSK:R:G:A:")) != -1){
+        switch (opt){
+            case 'S':
+                split = 1;
+                break;
+            case 'K':
+                block_size = atoi(optarg);
+                break;
+            case 'R':
+                spatial_radius = atoi(optarg);
+                break;
+            case 'G':
+                recursive_sigma = atof(optarg);
+                break;
+            case 'A':
+                tolerance = atof(optarg);
+                break;
+            case 'H':
+                config.huge_pages = 1;
+                break;
+            case 'C':
+                cache_dir = optarg;
+                break;
+            case 'W':
+                wisdom_path = optarg;
+                break;
+            case 'T':
+                set_transform_threads(atoi(optarg));
+                break;
+            case 'd':
+                config.decode_threads = atoi(optarg);
+                break;
+            case 't':
+                config.transform_threads = atoi(optarg);
+                break;
+            case 'w':
+                config.write_threads = atoi(optarg);
+                break;
+            case 'q':
+                config.queue_depth = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-W wisdom] [-C cache_dir] [-T transform_threads] [-d decode] [-t transform] [-w write] [-q queue_depth] [-H] [-S] [-K block_size] [-R spatial_radius] [-G recursive_sigma] [-A tolerance] <image dir>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc){
+        fprintf(stderr, "Usage: %s [-W wisdom] [-C cache_dir] [-T transform_threads] [-d decode] [-t transform] [-w write] [-q queue_depth] [-H] [-S] [-K block_size] [-R spatial_radius] [-G recursive_sigma] [-A tolerance] <image dir>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the image IO library
+    FreeImage_Initialise(FALSE);
+
+    load_fftw_wisdom(wisdom_path);
+
+    struct gabor_filter_bank_s bank;
+
+    //bank = init_gabor_filter_bank_exhaustive(800, 800);
+    bank = init_gabor_filter_bank_default(800, 800);
+    bank.split = split;
+    bank.block_size = (block_size > 0) ? block_size : 1;
+    bank.spatial_max_radius = spatial_radius;
+    bank.recursive_min_sigma = recursive_sigma;
+    disp_gabor_filter_bank(bank, "aaa");
+
+    // Build the filter spectra once, or map them from an earlier run, they are reused for every image
+    bank = compile_gabor_filter_bank_cached(bank, sysconf(_SC_NPROCESSORS_ONLN), cache_dir);
+
+    // Pick the engine of every filter, timed once per bank and machine
+    if (tolerance > 0){
+        bank = tune_gabor_filter_bank_cached(bank, tolerance, wisdom_path);
+        disp_gabor_engine_plan(bank);
+    }
+
+    // Decode, transform and write every file in the directory, overlapped
+    run_gabor_pipeline(argv[optind], bank, config);
+
+    free_gabor_filter_bank(bank);
+
+    save_fftw_wisdom(wisdom_path);
+    cleanup_fftw();
     FreeImage_DeInitialise();
 
 }
@@ -0,0 +1,366 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pipeline.h"
+#include "image.h"
+#include "gabor.h"
+#include "workspace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+// Batch mode as three stages joined by bounded queues:
+//   directory listing -> decode -> transform -> write
+// Each stage has its own threads, so decoding and writing overlap the FFTs.
+
+
+struct work_queue_s* init_work_queue(const unsigned int capacity){
+
+    struct work_queue_s* queue = (struct work_queue_s*)malloc(sizeof(struct work_queue_s));
+    if (queue == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    queue->capacity = (capacity > 0) ? capacity : 1;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+
+    queue->items = (void**)malloc(queue->capacity*sizeof(void*));
+    if (queue->items == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return queue;
+
+}
+
+
+
+void push_work_queue(struct work_queue_s* queue, void* item){
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == queue->capacity){
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+
+    pthread_mutex_unlock(&queue->lock);
+
+}
+
+
+
+// Returns NULL once the queue is closed and drained
+void* pop_work_queue(struct work_queue_s* queue){
+
+    void* item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == 0 && !queue->closed){
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    if (queue->count > 0){
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+
+}
+
+
+
+// No more pushes, wakes everyone waiting on an empty queue
+void close_work_queue(struct work_queue_s* queue){
+
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+
+}
+
+
+
+void free_work_queue(struct work_queue_s* queue){
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+
+    free(queue->items);
+    free(queue);
+
+}
+
+
+
+
+
+
+struct pipeline_config_s init_pipeline_config_default(){
+
+    struct pipeline_config_s config;
+
+    config.decode_threads = 1;
+    config.transform_threads = 2;
+    config.write_threads = 1;
+    config.queue_depth = 4;
+    config.huge_pages = 0;
+
+    return config;
+
+}
+
+
+
+
+
+
+// One image on its way through the pipeline. Items are made once and recycled,
+// each with its own workspace, so no stage allocates once they are all warm.
+struct pipeline_item_s{
+    char name[256];
+    char path[4096];
+    struct workspace_s ws;
+    struct image_real_s img;
+    struct gabor_responses_s resps;
+};
+
+
+// What every stage thread needs, the queues are shared by all stages
+struct pipeline_s{
+    struct gabor_filter_bank_s bank;
+    size_t workspace_size;
+    struct work_queue_s* free_items;
+    struct work_queue_s* paths;
+    struct work_queue_s* decoded;
+    struct work_queue_s* transformed;
+
+    pthread_mutex_t lock;
+    unsigned int num_skipped;   // Images not the bank's size, under lock
+};
+
+
+
+static void* decode_stage(void* arg){
+
+    struct pipeline_s* pipe = (struct pipeline_s*)arg;
+    struct pipeline_item_s* item;
+
+    while ((item = (struct pipeline_item_s*)pop_work_queue(pipe->paths)) != NULL){
+        reset_workspace(&item->ws);
+        reserve_workspace(&item->ws, pipe->workspace_size);
+        item->img = init_image_real_from_path_workspace(item->path, &item->ws);
+
+        // The spectra are only valid at the bank's size, anything else is left out
+        if (item->img.height != pipe->bank.height || item->img.width != pipe->bank.width){
+            fprintf(stderr, "Skipping %s, it is %ux%u and the bank is %ux%u\n", item->path, item->img.height, item->img.width, pipe->bank.height, pipe->bank.width);
+            pthread_mutex_lock(&pipe->lock);
+            pipe->num_skipped++;
+            pthread_mutex_unlock(&pipe->lock);
+            push_work_queue(pipe->free_items, item);
+            continue;
+        }
+
+        push_work_queue(pipe->decoded, item);
+    }
+
+    return NULL;
+
+}
+
+
+
+static void* transform_stage(void* arg){
+
+    struct pipeline_s* pipe = (struct pipeline_s*)arg;
+    struct pipeline_item_s* item;
+
+    while ((item = (struct pipeline_item_s*)pop_work_queue(pipe->decoded)) != NULL){
+        item->resps = apply_gabor_filter_bank_real_workspace(item->img, pipe->bank, &item->ws);
+        push_work_queue(pipe->transformed, item);
+    }
+
+    return NULL;
+
+}
+
+
+
+static void* write_stage(void* arg){
+
+    struct pipeline_s* pipe = (struct pipeline_s*)arg;
+    struct pipeline_item_s* item;
+
+    while ((item = (struct pipeline_item_s*)pop_work_queue(pipe->transformed)) != NULL){
+
+        save_gabor_responses(item->resps, item->name);
+        printf("%s\n", item->name);
+
+        // Back to the start, the workspace is reset when it is next decoded into
+        push_work_queue(pipe->free_items, item);
+
+    }
+
+    return NULL;
+
+}
+
+
+
+static pthread_t* start_stage(void* (*stage)(void*), struct pipeline_s* pipe, const unsigned int num_threads){
+
+    pthread_t* threads = (pthread_t*)malloc(num_threads*sizeof(pthread_t));
+    if (threads == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int t = 0; t < num_threads; t++){
+        if (pthread_create(&threads[t], NULL, stage, pipe) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return threads;
+
+}
+
+
+
+// Wait for a stage to drain its input, then tell the next stage nothing else is coming
+static void finish_stage(pthread_t* threads, const unsigned int num_threads, struct work_queue_s* output){
+
+    for (unsigned int t = 0; t < num_threads; t++){
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    close_work_queue(output);
+
+}
+
+
+
+// Run the bank over every file in dirpath, writing responses to the working directory.
+// Images in flight are capped at queue_depth plus one per stage thread, each with
+// its own workspace, and the directory listing waits for one to come free.
+// Images not the size of the bank are skipped with a message. Returns the number of images processed.
+unsigned int run_gabor_pipeline(const char* const dirpath, struct gabor_filter_bank_s bank, struct pipeline_config_s config){
+
+    DIR* dp = opendir(dirpath);
+    if (dp == NULL){
+        fprintf(stderr, "Could not open %s\n", dirpath);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.decode_threads == 0) config.decode_threads = 1;
+    if (config.transform_threads == 0) config.transform_threads = 1;
+    if (config.write_threads == 0) config.write_threads = 1;
+
+    unsigned int num_items = config.queue_depth + config.decode_threads + config.transform_threads + config.write_threads;
+
+    struct pipeline_s pipe;
+    pipe.bank = bank;
+    pipe.workspace_size = image_real_block_size(bank.height, bank.width) + gabor_workspace_size(bank);
+    pipe.free_items = init_work_queue(num_items);
+    pipe.paths = init_work_queue(num_items);
+    pipe.decoded = init_work_queue(num_items);
+    pipe.transformed = init_work_queue(num_items);
+    pthread_mutex_init(&pipe.lock, NULL);
+    pipe.num_skipped = 0;
+
+    // Workspaces start empty and are reserved at workspace_size, the bank's size, on first decode
+    struct pipeline_item_s* items = (struct pipeline_item_s*)malloc(num_items*sizeof(struct pipeline_item_s));
+    if (items == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < num_items; i++){
+        items[i].ws = init_workspace(0, config.huge_pages);
+        push_work_queue(pipe.free_items, &items[i]);
+    }
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t* decoders = start_stage(decode_stage, &pipe, config.decode_threads);
+    pthread_t* transformers = start_stage(transform_stage, &pipe, config.transform_threads);
+    pthread_t* writers = start_stage(write_stage, &pipe, config.write_threads);
+
+    // Feed the file names in, this blocks until an item comes free
+    unsigned int num_images = 0;
+    struct dirent* entry;
+    size_t dir_len = strlen(dirpath);
+    int add_slash = (dir_len > 0 && dirpath[dir_len-1] != '/');
+
+    while ((entry = readdir(dp))){
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")){
+
+            struct pipeline_item_s* item = (struct pipeline_item_s*)pop_work_queue(pipe.free_items);
+
+            snprintf(item->name, sizeof(item->name), "%s", entry->d_name);
+            if (snprintf(item->path, sizeof(item->path), "%s%s%s", dirpath, add_slash ? "/" : "", entry->d_name) >= (int)sizeof(item->path)){
+                fprintf(stderr, "Path too long: %s\n", entry->d_name);
+                exit(EXIT_FAILURE);
+            }
+
+            push_work_queue(pipe.paths, item);
+            num_images++;
+
+        }
+    }
+    closedir(dp);
+    close_work_queue(pipe.paths);
+
+    // Drain the stages in order
+    finish_stage(decoders, config.decode_threads, pipe.decoded);
+    finish_stage(transformers, config.transform_threads, pipe.transformed);
+    for (unsigned int t = 0; t < config.write_threads; t++){
+        pthread_join(writers[t], NULL);
+    }
+    free(writers);
+
+    // Every stage has joined, nothing else touches the count
+    num_images -= pipe.num_skipped;
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (double)(stop.tv_sec - start.tv_sec) + 1e-9*(double)(stop.tv_nsec - start.tv_nsec);
+
+    printf("%u images in %.2f s, %.2f images/sec\n", num_images, seconds, (seconds > 0) ? num_images/seconds : 0.0);
+
+    for (unsigned int i = 0; i < num_items; i++){
+        free_workspace(&items[i].ws);
+    }
+    free(items);
+
+    free_work_queue(pipe.free_items);
+    free_work_queue(pipe.paths);
+    free_work_queue(pipe.decoded);
+    free_work_queue(pipe.transformed);
+    pthread_mutex_destroy(&pipe.lock);
+
+    return num_images;
+
+}
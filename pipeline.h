@@ -0,0 +1,45 @@
+#ifndef pipeline_h
+#define pipeline_h
+
+#include "types.h"
+
+#include <pthread.h>
+
+// A fixed size FIFO of pointers. push blocks while it is full, which is what
+// keeps a fast stage from running arbitrarily far ahead of a slow one.
+struct work_queue_s{
+    void** items;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    int closed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+// Threads per stage, and how many images may wait between two stages
+struct pipeline_config_s{
+    unsigned int decode_threads;
+    unsigned int transform_threads;
+    unsigned int write_threads;
+    unsigned int queue_depth;
+    int huge_pages;     // Back each image's workspace with large pages
+};
+
+struct work_queue_s* init_work_queue(const unsigned int capacity);
+
+void push_work_queue(struct work_queue_s* queue, void* item);
+
+void* pop_work_queue(struct work_queue_s* queue);
+
+void close_work_queue(struct work_queue_s* queue);
+
+void free_work_queue(struct work_queue_s* queue);
+
+struct pipeline_config_s init_pipeline_config_default();
+
+unsigned int run_gabor_pipeline(const char* const dirpath, struct gabor_filter_bank_s bank, struct pipeline_config_s config);
+
+#endif
@@ -0,0 +1,352 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Pool for splitting the O(HW) loops around the transforms, NULL to run them serially
+static struct thread_pool_s* loop_pool = NULL;
+
+// Loops shorter than this aren't worth waking the pool for
+#define MIN_LOOP_CHUNK 16384
+
+// Work stealing: each thread starts with a contiguous share of the tasks and
+// takes them from the front of its own range. When it runs out it steals the
+// back half of another thread's range, so uneven tasks still balance out.
+
+
+// Take the next task from our own range, returns 0 if it is empty
+static int take_task(struct task_range_s* range, unsigned int* task_num){
+
+    int found = 0;
+
+    pthread_mutex_lock(&range->lock);
+    if (range->begin < range->end){
+        *task_num = range->begin;
+        range->begin++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&range->lock);
+
+    return found;
+
+}
+
+
+// Move the back half of some other thread's range into ours, returns 0 if everyone is out of work
+static int steal_tasks(struct thread_pool_s* pool, const unsigned int thread_num){
+
+    for (unsigned int i = 1; i < pool->num_threads; i++){
+
+        struct task_range_s* victim = &pool->ranges[(thread_num + i) % pool->num_threads];
+
+        pthread_mutex_lock(&victim->lock);
+        unsigned int remaining = victim->end - victim->begin;
+        unsigned int begin = victim->end - (remaining+1)/2;
+        unsigned int end = victim->end;
+        victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (remaining > 0){
+            struct task_range_s* own = &pool->ranges[thread_num];
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+
+    }
+
+    return 0;
+
+}
+
+
+static void run_tasks(struct thread_pool_s* pool, const unsigned int thread_num){
+
+    unsigned int task_num;
+
+    do{
+        while (take_task(&pool->ranges[thread_num], &task_num)){
+            pool->task(pool->arg, task_num, thread_num);
+        }
+    } while (steal_tasks(pool, thread_num));
+
+}
+
+
+struct worker_arg_s{
+    struct thread_pool_s* pool;
+    unsigned int thread_num;
+};
+
+
+static void* worker_main(void* arg){
+
+    struct worker_arg_s worker = *(struct worker_arg_s*)arg;
+    struct thread_pool_s* pool = worker.pool;
+    free(arg);
+
+    unsigned int seen = 0;
+
+    while (1){
+
+        // Wait for a new job, or for the pool to shut down
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen){
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown){
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, worker.thread_num);
+
+        // Report back
+        pthread_mutex_lock(&pool->lock);
+        pool->num_busy--;
+        if (pool->num_busy == 0){
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+    }
+
+    return NULL;
+
+}
+
+
+
+
+
+
+// The calling thread is always thread 0, so only num_threads-1 workers are spawned
+struct thread_pool_s* init_thread_pool(const unsigned int num_threads){
+
+    struct thread_pool_s* pool = (struct thread_pool_s*)malloc(sizeof(struct thread_pool_s));
+    if (pool == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pool->num_threads = (num_threads > 0) ? num_threads : 1;
+    pool->generation = 0;
+    pool->num_busy = 0;
+    pool->shutdown = 0;
+    pool->task = NULL;
+    pool->arg = NULL;
+
+    pthread_mutex_init(&pool->job_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->ranges = (struct task_range_s*)malloc(pool->num_threads*sizeof(struct task_range_s));
+    if (pool->ranges == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int t = 0; t < pool->num_threads; t++){
+        pool->ranges[t].begin = 0;
+        pool->ranges[t].end = 0;
+        pthread_mutex_init(&pool->ranges[t].lock, NULL);
+    }
+
+    pool->threads = (pthread_t*)malloc(pool->num_threads*sizeof(pthread_t));
+    if (pool->threads == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int t = 1; t < pool->num_threads; t++){
+
+        struct worker_arg_s* worker = (struct worker_arg_s*)malloc(sizeof(struct worker_arg_s));
+        if (worker == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+        worker->pool = pool;
+        worker->thread_num = t;
+
+        if (pthread_create(&pool->threads[t], NULL, worker_main, worker) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+    }
+
+    return pool;
+
+}
+
+
+
+
+
+
+// Run task(arg, n, thread) for n in [0, num_tasks) and wait for all of them.
+// A NULL pool, or one that is already running a job (e.g. when called from one
+// of its own tasks), runs everything on the calling thread, in order.
+void run_thread_pool(struct thread_pool_s* pool, const unsigned int num_tasks, thread_task_t task, void* arg){
+
+    if (pool == NULL || pool->num_threads == 1 || pthread_mutex_trylock(&pool->job_lock) != 0){
+        for (unsigned int n = 0; n < num_tasks; n++){
+            task(arg, n, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    // Split the tasks evenly to start with
+    for (unsigned int t = 0; t < pool->num_threads; t++){
+        pthread_mutex_lock(&pool->ranges[t].lock);
+        pool->ranges[t].begin = (unsigned int)(((unsigned long)num_tasks*t)/pool->num_threads);
+        pool->ranges[t].end = (unsigned int)(((unsigned long)num_tasks*(t+1))/pool->num_threads);
+        pthread_mutex_unlock(&pool->ranges[t].lock);
+    }
+
+    pool->task = task;
+    pool->arg = arg;
+    pool->num_busy = pool->num_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    // Pitch in
+    run_tasks(pool, 0);
+
+    // Wait for the workers to finish their last tasks
+    pthread_mutex_lock(&pool->lock);
+    while (pool->num_busy > 0){
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->job_lock);
+
+}
+
+
+
+
+
+
+void free_thread_pool(struct thread_pool_s* pool){
+
+    if (pool == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int t = 1; t < pool->num_threads; t++){
+        pthread_join(pool->threads[t], NULL);
+    }
+
+    for (unsigned int t = 0; t < pool->num_threads; t++){
+        pthread_mutex_destroy(&pool->ranges[t].lock);
+    }
+    pthread_mutex_destroy(&pool->job_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+
+    free(pool->ranges);
+    free(pool->threads);
+    free(pool);
+
+}
+
+
+
+
+
+
+// Threads used by parallel_for(), 1 (the default) runs loops serially
+void set_loop_threads(const unsigned int num_threads){
+
+    free_thread_pool(loop_pool);
+    loop_pool = NULL;
+
+    if (num_threads > 1){
+        loop_pool = init_thread_pool(num_threads);
+    }
+
+}
+
+
+
+struct loop_job_s{
+    range_task_t task;
+    void* arg;
+    unsigned int count;
+    unsigned int num_chunks;
+};
+
+
+static void loop_chunk_task(void* arg, const unsigned int chunk, const unsigned int thread_num){
+
+    struct loop_job_s* job = (struct loop_job_s*)arg;
+
+    unsigned int begin = (unsigned int)(((unsigned long)job->count*chunk)/job->num_chunks);
+    unsigned int end = (unsigned int)(((unsigned long)job->count*(chunk+1))/job->num_chunks);
+
+    job->task(job->arg, begin, end);
+
+}
+
+
+
+// Split [0, count) into bands of at least min_chunk across the loop pool
+static void split_loop(const unsigned int count, const unsigned int min_chunk, range_task_t task, void* arg){
+
+    if (loop_pool == NULL || count < 2*min_chunk){
+        task(arg, 0, count);
+        return;
+    }
+
+    struct loop_job_s job;
+    job.task = task;
+    job.arg = arg;
+    job.count = count;
+
+    // A few bands per thread so stealing can even out the load
+    job.num_chunks = 4*loop_pool->num_threads;
+    if (count/job.num_chunks < min_chunk){
+        job.num_chunks = count/min_chunk;
+    }
+
+    run_thread_pool(loop_pool, job.num_chunks, loop_chunk_task, &job);
+
+}
+
+
+
+// Run task over [0, count) split into bands across the loop pool.
+// Bands are independent, so task must not depend on the order they run in.
+void parallel_for(const unsigned int count, range_task_t task, void* arg){
+
+    split_loop(count, MIN_LOOP_CHUNK, task, arg);
+
+}
+
+
+
+// Same, for loops whose indices are rows of row_length elements each
+void parallel_for_rows(const unsigned int count, const unsigned int row_length, range_task_t task, void* arg){
+
+    unsigned int min_rows = (row_length >= MIN_LOOP_CHUNK) ? 1 : MIN_LOOP_CHUNK/(row_length > 0 ? row_length : 1);
+
+    split_loop(count, min_rows, task, arg);
+
+}
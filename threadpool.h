@@ -0,0 +1,53 @@
+#ifndef threadpool_h
+#define threadpool_h
+
+#include <pthread.h>
+
+// A task is called once per task number, on whichever thread got to it.
+// thread_num is in [0, num_threads) so tasks can index per-thread scratch space.
+typedef void (*thread_task_t)(void* arg, const unsigned int task_num, const unsigned int thread_num);
+
+// A loop body over the indices [begin, end)
+typedef void (*range_task_t)(void* arg, const unsigned int begin, const unsigned int end);
+
+// The tasks a thread still has to run, [begin, end)
+struct task_range_s{
+    unsigned int begin;
+    unsigned int end;
+    pthread_mutex_t lock;
+};
+
+struct thread_pool_s{
+    unsigned int num_threads;
+    pthread_t* threads;
+    struct task_range_s* ranges;
+
+    // Held for the whole of a job, so a busy pool can be detected
+    pthread_mutex_t job_lock;
+
+    // Hands jobs to the workers and waits for them to finish
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;
+    unsigned int num_busy;
+    int shutdown;
+
+    // The current job
+    thread_task_t task;
+    void* arg;
+};
+
+struct thread_pool_s* init_thread_pool(const unsigned int num_threads);
+
+void run_thread_pool(struct thread_pool_s* pool, const unsigned int num_tasks, thread_task_t task, void* arg);
+
+void free_thread_pool(struct thread_pool_s* pool);
+
+void set_loop_threads(const unsigned int num_threads);
+
+void parallel_for(const unsigned int count, range_task_t task, void* arg);
+
+void parallel_for_rows(const unsigned int count, const unsigned int row_length, range_task_t task, void* arg);
+
+#endif
@@ -0,0 +1,403 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tuner.h"
+#include "gabor.h"
+#include "bankcache.h"
+#include "convolve.h"
+#include "image.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "workspace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <complex.h>
+
+// Picks an engine for every filter of a bank by running each on synthetic images of the
+// bank's size. The frequency domain engine is the reference; the others are only allowed
+// if their error against it stays within the tolerance, see engine_error(). Plans are kept as one line per
+// bank in a text file next to the FFTW wisdom, as they are only as good as the machine
+// they were timed on:
+//
+//   <bank hash> <decimate> <split> <block size> <compiled> <spatial sigmas> <tolerance> <kernels> <threads> <engines>
+//
+// with one letter per filter, F, S or R, for frequency, separable and recursive.
+
+// Timed runs per engine, the fastest one counts
+#define TUNE_REPS 3
+
+static const char engine_letters[] = "FSR";
+
+
+static double elapsed_seconds(const struct timespec start, const struct timespec stop){
+
+    return (double)(stop.tv_sec - start.tv_sec) + 1e-9*(double)(stop.tv_nsec - start.tv_nsec);
+
+}
+
+
+
+// The one filter i of bank, as a bank of its own. Shares the arrays, never free it.
+static struct gabor_filter_bank_s single_filter_bank(const struct gabor_filter_bank_s bank, const unsigned int i, enum gabor_engine_e* engine){
+
+    struct gabor_filter_bank_s sub = bank;
+
+    sub.num_filters = 1;
+    sub.angles = bank.angles + i;
+    sub.sigmas = bank.sigmas + i;
+    sub.freqs = bank.freqs + i;
+    sub.spectra = (bank.spectra != NULL) ? bank.spectra + i : NULL;
+    sub.subbands = (bank.subbands != NULL) ? bank.subbands + i : NULL;
+    sub.engines = engine;
+
+    return sub;
+
+}
+
+
+
+// Response of the one filter of sub through its engine, lives until the workspace is reset
+static struct image_s run_engine(const struct gabor_filter_bank_s sub, const struct image_real_s img, const struct image_s img_fft, struct workspace_s* ws){
+
+    reset_workspace(ws);
+    reserve_workspace(ws, gabor_workspace_size(sub));
+
+    struct gabor_responses_s resps;
+    if (*sub.engines == GABOR_ENGINE_FREQUENCY){
+        resps = apply_gabor_filter_bank_spectrum_workspace(img_fft, sub, ws);
+    }
+    else{
+        resps = apply_gabor_filter_bank_real_workspace(img, sub, ws);
+    }
+
+    return resps.channels[0];
+
+}
+
+
+
+// Best time of the one filter of sub through its engine. The first run plans any transforms, so it isn't counted.
+static double time_engine(const struct gabor_filter_bank_s sub, const struct image_real_s img, const struct image_s img_fft, struct workspace_s* ws){
+
+    run_engine(sub, img, img_fft, ws);
+
+    double best = 0;
+    for (unsigned int r = 0; r < TUNE_REPS; r++){
+
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_engine(sub, img, img_fft, ws);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        if (r == 0 || elapsed_seconds(start, stop) < best){
+            best = elapsed_seconds(start, stop);
+        }
+
+    }
+
+    return best;
+
+}
+
+
+
+// Error of an engine as the L1 norm of its kernel's difference from the reference kernel ref,
+// relative to the L1 norm of ref. That bounds its error on any image relative to the largest
+// response any image could give, so the tolerance means the same whatever is filtered.
+static double engine_error(const struct gabor_filter_bank_s sub, const struct image_real_s impulse, const struct image_s impulse_fft, const struct image_s ref, struct workspace_s* ws){
+
+    struct image_s kernel = run_engine(sub, impulse, impulse_fft, ws);
+
+    double diff = 0;
+    double norm = 0;
+    for (unsigned int y = 0; y < ref.height; y++){
+        for (unsigned int x = 0; x < ref.width; x++){
+            diff += (double)CABS(kernel.vals[y][x] - ref.vals[y][x]);
+            norm += (double)CABS(ref.vals[y][x]);
+        }
+    }
+
+    return (norm > 0) ? diff/norm : 0;
+
+}
+
+
+
+// Time every engine on every filter and keep the fastest one within tolerance.
+// Filters only leave the frequency domain if that also pays for the image transform
+// they would save, or if the transform is needed for other filters anyway.
+struct gabor_filter_bank_s tune_gabor_filter_bank(struct gabor_filter_bank_s bank, const double tolerance){
+
+    free(bank.engines);
+    bank.engines = (enum gabor_engine_e*)malloc(bank.num_filters*sizeof(enum gabor_engine_e));
+    if (bank.engines == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        bank.engines[i] = GABOR_ENGINE_FREQUENCY;
+    }
+
+    // Split planes, critically sampled and batched channels only come out of the frequency domain
+    if (bank.split || (bank.decimate && bank.spectra != NULL) || (bank.block_size > 1 && bank.spectra != NULL)){
+        return bank;
+    }
+
+    // Timed on something with edges in every direction, errors come from the response to an impulse
+    struct image_real_s img = init_image_real_empty(bank.height, bank.width);
+    struct image_real_s impulse = init_image_real_empty(bank.height, bank.width);
+    for (unsigned int i = 0; i < bank.height; i++){
+        for (unsigned int j = 0; j < bank.width; j++){
+            img.vals[i][j] = (real_t)((i*7 + j*13) % 256) + (real_t)(((i/16 + j/16) % 2)*64);
+            impulse.vals[i][j] = 0;
+        }
+    }
+    impulse.vals[bank.height/2][bank.width/2] = 1;
+
+    struct image_s img_fft = init_image_empty(bank.height, bank.width);
+    struct image_s impulse_fft = init_image_empty(bank.height, bank.width);
+    struct image_s ref = init_image_empty(bank.height, bank.width);
+    struct workspace_s ws = init_workspace(0, 0);
+
+    fft_image_real(impulse, impulse_fft);
+
+    // The forward transform, shared by every filter left in the frequency domain
+    fft_image_real(img, img_fft);
+    double fft_time = 0;
+    for (unsigned int r = 0; r < TUNE_REPS; r++){
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fft_image_real(img, img_fft);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        if (r == 0 || elapsed_seconds(start, stop) < fft_time){
+            fft_time = elapsed_seconds(start, stop);
+        }
+    }
+
+    double freq_total = 0;      // Filters left in the frequency domain
+    double alt_total = 0;       // The same filters through their best other engine
+    int all_have_alt = 1;
+    enum gabor_engine_e* alt = (enum gabor_engine_e*)malloc(bank.num_filters*sizeof(enum gabor_engine_e));
+    if (alt == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+
+        enum gabor_engine_e engine = GABOR_ENGINE_FREQUENCY;
+        struct gabor_filter_bank_s sub = single_filter_bank(bank, i, &engine);
+
+        // The reference kernel
+        struct image_s kernel = run_engine(sub, impulse, impulse_fft, &ws);
+        for (unsigned int y = 0; y < bank.height; y++){
+            for (unsigned int x = 0; x < bank.width; x++){
+                ref.vals[y][x] = kernel.vals[y][x];
+            }
+        }
+
+        double freq_time = time_engine(sub, img, img_fft, &ws);
+
+        double best_time = freq_time;
+        double alt_time = 0;
+        alt[i] = GABOR_ENGINE_FREQUENCY;
+
+        for (engine = GABOR_ENGINE_SEPARABLE; engine <= GABOR_ENGINE_RECURSIVE; engine++){
+            if (engine_error(sub, impulse, impulse_fft, ref, &ws) > tolerance){
+                continue;
+            }
+            double time = time_engine(sub, img, img_fft, &ws);
+            if (time < best_time){
+                best_time = time;
+                bank.engines[i] = engine;
+            }
+            if (alt[i] == GABOR_ENGINE_FREQUENCY || time < alt_time){
+                alt_time = time;
+                alt[i] = engine;
+            }
+        }
+
+        if (bank.engines[i] == GABOR_ENGINE_FREQUENCY){
+            freq_total += freq_time;
+            alt_total += alt_time;
+            all_have_alt = all_have_alt && alt[i] != GABOR_ENGINE_FREQUENCY;
+        }
+
+    }
+
+    // The last few filters in the frequency domain may cost less elsewhere once the transform is counted
+    if (freq_total > 0 && all_have_alt && alt_total < freq_total + fft_time){
+        for (unsigned int i = 0; i < bank.num_filters; i++){
+            if (bank.engines[i] == GABOR_ENGINE_FREQUENCY){
+                bank.engines[i] = alt[i];
+            }
+        }
+    }
+
+    free(alt);
+    free_workspace(&ws);
+    free_image(ref);
+    free_image(img_fft);
+    free_image(impulse_fft);
+    free_image_real(img);
+    free_image_real(impulse);
+
+    return bank;
+
+}
+
+
+
+// The start of a plan line for this bank, everything that must match before its engines are used
+static void plan_key(const struct gabor_filter_bank_s bank, const double tolerance, char* key, const size_t size){
+
+    unsigned int num_threads = (bank.pool != NULL) ? bank.pool->num_threads : 1;
+
+    snprintf(key, size, "%016llx %d %d %u %d %g %g %s %u", hash_gabor_filter_bank(bank), bank.decimate, bank.split,
+             bank.block_size, bank.spectra != NULL, bank.spatial_sigmas, tolerance, kernel_isa_name(), num_threads);
+
+}
+
+
+
+// Engines for the bank from a plan file, if it has a line for it.
+// Returns the bank unchanged (engines still NULL) otherwise.
+struct gabor_filter_bank_s load_gabor_engine_plan(struct gabor_filter_bank_s bank, const double tolerance, const char* const path){
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL){
+        return bank;
+    }
+
+    char key[256];
+    plan_key(bank, tolerance, key, sizeof(key));
+    size_t key_length = strlen(key);
+
+    // Room for the key, a space, a letter per filter and the newline
+    size_t line_size = key_length + bank.num_filters + 3;
+    char* line = (char*)malloc(line_size);
+    if (line == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Later lines win, a bank retuned on the same machine is appended
+    char* found = NULL;
+    while (fgets(line, line_size, file) != NULL){
+
+        // Skip the rest of lines too long to be this bank's
+        if (strchr(line, '\n') == NULL && !feof(file)){
+            int c;
+            while ((c = fgetc(file)) != '\n' && c != EOF){
+            }
+            continue;
+        }
+
+        if (strncmp(line, key, key_length) != 0 || line[key_length] != ' '){
+            continue;
+        }
+
+        const char* letters = line + key_length + 1;
+        if (strspn(letters, engine_letters) != bank.num_filters){
+            continue;
+        }
+
+        free(found);
+        found = strdup(letters);
+        if (found == NULL){
+            fprintf(stderr, "Malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(file);
+    free(line);
+
+    if (found == NULL){
+        return bank;
+    }
+
+    free(bank.engines);
+    bank.engines = (enum gabor_engine_e*)malloc(bank.num_filters*sizeof(enum gabor_engine_e));
+    if (bank.engines == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        bank.engines[i] = (enum gabor_engine_e)(strchr(engine_letters, found[i]) - engine_letters);
+    }
+
+    free(found);
+
+    return bank;
+
+}
+
+
+
+// Append the bank's engines to a plan file. Returns 0 if the file could not be written.
+int save_gabor_engine_plan(const struct gabor_filter_bank_s bank, const double tolerance, const char* const path){
+
+    if (bank.engines == NULL){
+        return 0;
+    }
+
+    FILE* file = fopen(path, "a");
+    if (file == NULL){
+        fprintf(stderr, "Could not write engine plan to %s\n", path);
+        return 0;
+    }
+
+    char key[256];
+    plan_key(bank, tolerance, key, sizeof(key));
+
+    fprintf(file, "%s ", key);
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        fputc(engine_letters[bank.engines[i]], file);
+    }
+    fputc('\n', file);
+
+    return fclose(file) == 0;
+
+}
+
+
+
+// Engines from the plan next to the wisdom file, or tuned and added to it on the first run
+struct gabor_filter_bank_s tune_gabor_filter_bank_cached(struct gabor_filter_bank_s bank, const double tolerance, const char* const wisdom_path){
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.engines", wisdom_path);
+
+    bank = load_gabor_engine_plan(bank, tolerance, path);
+    if (bank.engines != NULL){
+        return bank;
+    }
+
+    bank = tune_gabor_filter_bank(bank, tolerance);
+    save_gabor_engine_plan(bank, tolerance, path);
+
+    return bank;
+
+}
+
+
+
+void disp_gabor_engine_plan(const struct gabor_filter_bank_s bank){
+
+    if (bank.engines == NULL){
+        printf("Engines: untuned\n");
+        return;
+    }
+
+    const char* names[3] = {"frequency", "separable", "recursive"};
+    unsigned int counts[3] = {0, 0, 0};
+    for (unsigned int i = 0; i < bank.num_filters; i++){
+        counts[bank.engines[i]]++;
+    }
+
+    printf("Engines: %u %s, %u %s, %u %s\n", counts[0], names[0], counts[1], names[1], counts[2], names[2]);
+
+}
@@ -0,0 +1,16 @@
+#ifndef tuner_h
+#define tuner_h
+
+#include "types.h"
+
+struct gabor_filter_bank_s tune_gabor_filter_bank(struct gabor_filter_bank_s bank, const double tolerance);
+
+struct gabor_filter_bank_s load_gabor_engine_plan(struct gabor_filter_bank_s bank, const double tolerance, const char* const path);
+
+int save_gabor_engine_plan(const struct gabor_filter_bank_s bank, const double tolerance, const char* const path);
+
+struct gabor_filter_bank_s tune_gabor_filter_bank_cached(struct gabor_filter_bank_s bank, const double tolerance, const char* const wisdom_path);
+
+void disp_gabor_engine_plan(const struct gabor_filter_bank_s bank);
+
+#endif
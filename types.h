@@ -2,19 +2,131 @@
 #define types_h
 
 #include <complex.h>
+#include <stddef.h>
+#include <float.h>
+
+// Precision of every image, filter and transform.
+// Build with -DGABOR_SINGLE (make PRECISION=single) for float data and fftwf plans.
+#ifdef GABOR_SINGLE
+typedef float real_t;
+typedef float complex complex_t;
+#define FFTW(name) fftwf_ ## name
+#define CABS(z) cabsf(z)
+#define CREAL(z) crealf(z)
+#define CIMAG(z) cimagf(z)
+#define CONJ(z) conjf(z)
+#define REAL_MAX FLT_MAX
+#else
+typedef double real_t;
+typedef double complex complex_t;
+#define FFTW(name) fftw_ ## name
+#define CABS(z) cabs(z)
+#define CREAL(z) creal(z)
+#define CIMAG(z) cimag(z)
+#define CONJ(z) conj(z)
+#define REAL_MAX DBL_MAX
+#endif
 
 struct image_s{
-    double complex* raw_vals;
-    double complex** vals;
+    complex_t* raw_vals;
+    complex_t** vals;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;    // Elements from one row to the next, rows are padded past width
+};
+
+// Grayscale input, which has no imaginary part to store
+struct image_real_s{
+    real_t* raw_vals;
+    real_t** vals;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;    // Elements from one row to the next, rows are padded past width
+};
+
+// Complex values with the real and imaginary parts in separate planes,
+// so a loop that only needs one of them only reads that one
+struct image_split_s{
+    real_t* re;
+    real_t* im;
     unsigned int width;
     unsigned int height;
+    unsigned int stride;    // Elements from one row to the next in either plane, rows are padded past width
 };
 
 struct filter_s{
-    double complex* raw_vals;
-    double complex** vals;
+    complex_t* raw_vals;
+    complex_t** vals;
     unsigned int width;
     unsigned int height;
+    unsigned int stride;    // Elements from one row to the next, rows are padded past width
+};
+
+// A filter that is the outer product of a column and a row of taps, both centred on their middle tap
+struct separable_filter_s{
+    complex_t* col;             // 2*radius_y + 1 taps down the rows
+    complex_t* row;             // 2*radius_x + 1 taps along a row
+    unsigned int radius_y;
+    unsigned int radius_x;
+};
+
+// Third order recursive approximation of a 1D Gaussian times a carrier (van Vliet, Young and Verbeek).
+// Run forwards then backwards along a line:
+//     w[n] = b*x[n] + a_fwd[0]*w[n-1] + a_fwd[1]*w[n-2] + a_fwd[2]*w[n-3]
+//     y[n] = b*w[n] + a_bwd[0]*y[n+1] + a_bwd[1]*y[n+2] + a_bwd[2]*y[n+3]
+struct recursive_filter_s{
+    complex_t b;
+    complex_t a_fwd[3];
+    complex_t a_bwd[3];
+    complex_t dc;       // Exact zero frequency response of the kernel being approximated
+};
+
+// A run of consecutive bins along one row of a sparse spectrum
+struct spectrum_span_s{
+    unsigned int row;
+    unsigned int start;
+    unsigned int length;
+    unsigned int offset;    // Index of the span's first value in the packed values
+};
+
+// Only the bins of a spectrum above some threshold, stored as row spans.
+// The values of every span are packed back to back in span order.
+struct sparse_spectrum_s{
+    complex_t* vals;
+    struct spectrum_span_s* spans;
+    unsigned int num_spans;
+    unsigned int num_vals;
+    unsigned int width;
+    unsigned int height;
+};
+
+// Where a critically sampled channel sits in the full resolution spectrum.
+// The channel holds every decimation-th sample of the response, demodulated by the center bin.
+struct subband_s{
+    unsigned int decimation_y;
+    unsigned int decimation_x;
+    unsigned int center_y;
+    unsigned int center_x;
+    unsigned int full_height;
+    unsigned int full_width;
+};
+
+struct thread_pool_s;
+
+// Bump allocator for per-image scratch, see workspace.c
+struct workspace_s{
+    char* base;
+    size_t capacity;
+    size_t used;
+    int huge_pages;     // Ask for large pages, falls back to normal ones if the system says no
+    int mapped;         // base came from mmap rather than fftw_malloc
+};
+
+// How one filter of a bank is applied, see tune_gabor_filter_bank()
+enum gabor_engine_e{
+    GABOR_ENGINE_FREQUENCY,     // Multiply the image spectrum, inverse transform
+    GABOR_ENGINE_SEPARABLE,     // Truncated kernel, a row then a column pass
+    GABOR_ENGINE_RECURSIVE      // Recursive Gaussians along the rows and columns
 };
 
 struct gabor_filter_bank_s{
@@ -24,11 +136,27 @@ struct gabor_filter_bank_s{
     unsigned int height;
     unsigned int width;
     unsigned int num_filters;
+    double spectrum_threshold;          // Bins below this fraction of the peak are dropped when compiled
+    struct sparse_spectrum_s* spectra;  // Filter passbands, NULL until compiled
+    struct subband_s* subbands;         // Smallest grid holding each passband, NULL until compiled
+    int decimate;                       // Output critically sampled channels (needs a compiled bank)
+    int phase_shift;                    // Recenter filters built on the fly with a phase ramp instead of a spatial shift
+    int split;                          // Transform real images and store channels as separate real and imaginary planes
+    unsigned int block_size;            // Channels inverse transformed together by one batched plan, 1 for one at a time
+    double spatial_sigmas;              // Sigmas the separable spatial kernels are truncated at
+    unsigned int spatial_max_radius;    // Filters whose truncated kernel is no wider than this are convolved spatially, 0 for none
+    double recursive_min_sigma;         // Filters at least this wide go through recursive Gaussians instead, 0 for none
+    enum gabor_engine_e* engines;       // Engine of each filter from tuning, overrides the two above, NULL if untuned
+    struct thread_pool_s* pool;         // Workers channels are spread over, NULL to run on the calling thread
+    void* cache_map;                    // Read-only mapping the spectra point into, NULL if they were malloced
+    size_t cache_size;
 };
 
 struct gabor_responses_s{
     struct image_s* channels;
+    struct image_split_s* split_channels;   // Used instead of channels when the bank is split, channels is then NULL
     unsigned int num_channels;
+    struct subband_s* subbands;     // NULL when every channel is full resolution
 };
 
 
@@ -0,0 +1,180 @@
+#define _DEFAULT_SOURCE
+
+#include "workspace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fftw3.h>
+#include <sys/mman.h>
+
+// A workspace is one big block that per-image buffers are carved out of.
+// Everything is released at once by reset_workspace(), so a batch that reuses
+// one workspace per image in flight stops touching the heap after the first image.
+
+// Large pages are 2MB on x86-64, mappings are rounded up to this
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+
+static void allocate_workspace(struct workspace_s* ws, const size_t capacity){
+
+    ws->capacity = capacity;
+    ws->used = 0;
+    ws->mapped = 0;
+    ws->base = NULL;
+
+    if (capacity == 0){
+        return;
+    }
+
+    if (ws->huge_pages){
+
+        size_t size = (capacity + HUGE_PAGE_SIZE - 1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE;
+        void* map = MAP_FAILED;
+
+        // Explicit large pages if some are reserved, otherwise ask for transparent ones
+#ifdef MAP_HUGETLB
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (map == MAP_FAILED){
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (map != MAP_FAILED){
+                madvise(map, size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        if (map != MAP_FAILED){
+            ws->base = (char*)map;
+            ws->capacity = size;
+            ws->mapped = 1;
+            return;
+        }
+
+    }
+
+    // fftw_malloc doesn't promise WORKSPACE_ALIGN, leave room to line the first block up
+    ws->capacity = capacity + WORKSPACE_ALIGN;
+    ws->base = (char*)FFTW(malloc)(ws->capacity);
+    if (ws->base == NULL){
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+
+
+static void release_workspace(struct workspace_s* ws){
+
+    if (ws->base == NULL){
+        return;
+    }
+
+    if (ws->mapped){
+        munmap(ws->base, ws->capacity);
+    }
+    else{
+        FFTW(free)(ws->base);
+    }
+
+    ws->base = NULL;
+    ws->capacity = 0;
+    ws->used = 0;
+
+}
+
+
+
+
+
+
+// capacity can be 0, the first reserve_workspace() then sizes it
+struct workspace_s init_workspace(const size_t capacity, const int huge_pages){
+
+    struct workspace_s ws;
+    ws.huge_pages = huge_pages;
+
+    allocate_workspace(&ws, capacity);
+
+    return ws;
+
+}
+
+
+
+// Make sure an empty workspace holds at least size bytes. It only ever grows,
+// so once it has seen the largest image it never allocates again.
+void reserve_workspace(struct workspace_s* ws, const size_t size){
+
+    if (size <= ws->capacity){
+        return;
+    }
+
+    if (ws->used != 0){
+        fprintf(stderr, "Workspace resized while in use\n");
+        exit(EXIT_FAILURE);
+    }
+
+    release_workspace(ws);
+    allocate_workspace(ws, size);
+
+}
+
+
+
+// Hand every block back at once, anything carved out before is now invalid
+void reset_workspace(struct workspace_s* ws){
+
+    ws->used = 0;
+
+}
+
+
+
+// Blocks can't move once handed out, so running out is a sizing bug in the caller.
+// Sizes are rounded up to WORKSPACE_ALIGN, callers sizing a workspace should do the same.
+void* workspace_alloc(struct workspace_s* ws, const size_t size){
+
+    uintptr_t start = (uintptr_t)(ws->base + ws->used);
+    size_t padding = (WORKSPACE_ALIGN - start % WORKSPACE_ALIGN) % WORKSPACE_ALIGN;
+
+    if (ws->base == NULL || ws->used + padding + WORKSPACE_ROUND(size) > ws->capacity){
+        fprintf(stderr, "Workspace too small\n");
+        exit(EXIT_FAILURE);
+    }
+
+    void* block = ws->base + ws->used + padding;
+    ws->used += padding + WORKSPACE_ROUND(size);
+
+    return block;
+
+}
+
+
+
+void free_workspace(struct workspace_s* ws){
+
+    release_workspace(ws);
+
+}
+
+
+
+
+
+
+// Elements from one row of a 2d array to the next. Every row starts on a WORKSPACE_ALIGN
+// boundary, and a pitch that would land every row in the same cache sets (power of two
+// widths) gets one more line, so column walks and FFTW's column passes spread out.
+unsigned int padded_row_stride(const unsigned int width, const size_t elem_size){
+
+    size_t pitch = WORKSPACE_ROUND(width*elem_size);
+    if (pitch % WORKSPACE_ALIAS_PITCH == 0){
+        pitch += WORKSPACE_ALIGN;
+    }
+
+    return (unsigned int)(pitch/elem_size);
+
+}
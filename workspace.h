@@ -0,0 +1,26 @@
+#ifndef workspace_h
+#define workspace_h
+
+#include "types.h"
+
+// Every block handed out starts on this boundary
+#define WORKSPACE_ALIGN 64
+
+#define WORKSPACE_ROUND(size) (((size) + WORKSPACE_ALIGN - 1)/WORKSPACE_ALIGN*WORKSPACE_ALIGN)
+
+// Rows whose pitch is a multiple of this all start in the same cache sets
+#define WORKSPACE_ALIAS_PITCH 4096
+
+unsigned int padded_row_stride(const unsigned int width, const size_t elem_size);
+
+struct workspace_s init_workspace(const size_t capacity, const int huge_pages);
+
+void reserve_workspace(struct workspace_s* ws, const size_t size);
+
+void reset_workspace(struct workspace_s* ws);
+
+void* workspace_alloc(struct workspace_s* ws, const size_t size);
+
+void free_workspace(struct workspace_s* ws);
+
+#endif